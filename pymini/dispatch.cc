@@ -31,16 +31,92 @@
 #include <errno.h>
 #include <time.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <new>
 #include "emc.h"
 #include "interpl.h"
 #include "interp_return.h"
 #include "rs274ngc_interp.h"    // the interpreter
 #include "bug.h"
 
-static Interp interp;
-MSG_INTERP_LIST interp_list;    /* MSG Union, for interpreter */
+#define DSP_SNAP_TC (DEFAULT_TP_LOOKAHEAD + 8)     /* max queued moves in a planner snapshot */
+#define DSP_SNAP_INTERVAL 0.02                     /* min seconds of motion between planner snapshots */
 
-static void _interp_error(int retval)
+/* 
+ * Planner state at the start of a step buffer. A feed hold cancels the step buffers not on the wire yet, restores
+ * the snapshot of the first one and replays the moves queued since, so the stop is planned from the last step sent.
+ */
+struct dsp_snap
+{
+   TP_STRUCT tp;
+   TC_STRUCT tc[DSP_SNAP_TC];   /* queued moves */
+   struct rtstepper_cap_axis axis[EMC_MAX_AXIS];   /* encoder and backlash state */
+   double feed_scale;
+   uint64_t log_seq;            /* move log position */
+   struct rtstepper_cap_mark cap;   /* capture file position */
+};
+
+/* Planner command queued by the interpreter, see _dsp_tp_add(). */
+struct dsp_move
+{
+   emc_command_msg_t cmd;
+   int id;
+};
+
+/* Per-session interpreter state. */
+struct emc_dispatch
+{
+   Interp interp;
+   MSG_INTERP_LIST list;        /* MSG Union, for interpreter */
+   struct dsp_snap *snap;       /* planner snapshot per io request, indexed by io->index */
+   struct dsp_move *log;        /* move log ring, tc_queue_size entries */
+   uint64_t log_seq;            /* moves logged */
+   int snap_cycles;             /* planner cycles since the last snapshot */
+   const char *busy;            /* run, MDI, verify, home or estimate in progress, see _dsp_claim() */
+};
+
+/* Canon message list of the session bound to this thread, see interp_list in interpl.h. */
+MSG_INTERP_LIST *emc_interp_list(void)
+{
+   return &current_session->dsp->list;
+}
+
+/* Bind the session to this thread for the interpreter and canon layers, returns the session interpreter. */
+static Interp &_dsp_bind(struct emc_session *ps)
+{
+   current_session = ps;
+   Interp::current = &ps->dsp->interp;
+   return ps->dsp->interp;
+}
+
+/* 
+ * Claim the session interpreter for func, refused if a run, MDI, verify, home or estimate is in progress on another
+ * thread. An estimate swaps in scratch canon state, see dsp_estimate().
+ */
+static enum EMC_RESULT _dsp_claim(struct emc_session *ps, const char *func)
+{
+   enum EMC_RESULT stat = EMC_R_OK;
+
+   pthread_mutex_lock(&ps->io_mutex);
+   if (ps->dsp->busy != NULL)
+   {
+      BUG("%s refused, %s in progress\n", func, ps->dsp->busy);
+      stat = EMC_R_ERROR;
+   }
+   else
+      ps->dsp->busy = func;
+   pthread_mutex_unlock(&ps->io_mutex);
+   return stat;
+}
+
+static void _dsp_release(struct emc_session *ps)
+{
+   pthread_mutex_lock(&ps->io_mutex);
+   ps->dsp->busy = NULL;
+   pthread_mutex_unlock(&ps->io_mutex);
+}
+
+static void _interp_error(Interp &interp, int retval)
 {
    char buf[LINELEN];
    int i;
@@ -61,16 +137,300 @@ static void _interp_error(int retval)
    }
 }       /* _interp_error() */
 
-/* Run trajectory planner cycles until the move is complete. */
-static void _run_tp(struct emc_session *ps, struct rtstepper_io_req *io)
+/* 
+ * Returns 1 if another trajectory planner cycle can run. Without flush cycles stop once only DEFAULT_TP_LOOKAHEAD
+ * moves are left queued, so the planner can still blend and plan them with the moves that follow (look-ahead). With
+ * flush all queued moves run to the end.
+ */
+static int _tp_runnable(struct emc_session *ps, int flush)
+{
+   if (tpIsDone(&ps->tp_queue))
+      return 0;
+   return flush || tpQueueDepth(&ps->tp_queue) > DEFAULT_TP_LOOKAHEAD;
+}
+
+/* Commanded step generator position of each axis for planner position pos, with backlash and soft limits. */
+static void _sm_pos(struct emc_session *ps, EmcPose pos, double *sm)
+{
+   unsigned int i;
+
+   emcpos2a(sm, pos);
+   for (i=0; i < ps->axes; i++)
+   {
+      /* Apply backlash. */
+      sm[i] += ps->axis[i].backlash_filt;
+
+      /* Check soft position limit. */
+      if (sm[i] > 0.0)
+         sm[i] = (sm[i] > ps->axis[i].max_pos_limit) ? ps->axis[i].max_pos_limit : sm[i];
+      if (sm[i] < 0.0)
+         sm[i] = (sm[i] < ps->axis[i].min_pos_limit) ? ps->axis[i].min_pos_limit : sm[i];
+   }
+}  /* _sm_pos() */
+
+/* 
+ * Step buffer bytes to fill before dispatch. With a feed override latency (ini: TASK, OVERRIDE_LATENCY) the transfers
+ * in flight hold at most the latency of motion, a feed override or hold can only replan the buffers behind them.
+ */
+static int _io_size(struct emc_session *ps, struct rtstepper_io_req *io)
+{
+   int64_t size;
+
+   if (ps->override_latency_us == 0)
+      return io->buf_size;
+   size = ps->override_latency_us * 1000 / ps->xfr_depth / RTSTEPPER_PERIOD * 2;   /* two bytes per step cycle */
+   return size < io->buf_size ? (int)size : io->buf_size;
+}  /* _io_size() */
+
+/* 
+ * Dispatch the io request returned by _run_tp(). While all queued moves are still within the look-ahead no cycles
+ * were encoded, the empty io request goes back to the pool so no empty transfer, capture record or line position
+ * is posted.
+ */
+static enum EMC_RESULT _dsp_start_xfr(struct emc_session *ps, struct rtstepper_io_req *io)
+{
+   if (io != NULL && io->total == 0)
+   {
+      rtstepper_free_io_req(ps, io);
+      return EMC_R_OK;
+   }
+   return rtstepper_start_xfr(ps, io, tpGetPos(&ps->tp_queue));
+}  /* _dsp_start_xfr() */
+
+/* Feed hold, motion is stopped. Wait for the queued steps to finish then for a resume or ESTOP. */
+static void _dsp_hold(struct emc_session *ps)
+{
+   struct timeval tv;
+   struct timespec ts;
+   int rc;
+
+   rtstepper_wait_xfr(ps);
+   ps->state_bits |= EMC_STATE_HOLD_BIT;
+   ps->feed_overridden = 1;   /* the stop and restart are not in a clean run, do not cache */
+   DBG("_dsp_hold() stopped at x=%0.5f y=%0.5f z=%0.5f\n", ps->position.tran.x, ps->position.tran.y, ps->position.tran.z);
+
+   /* dsp_feed_resume() and ESTOP signal write_done_cond. */
+   do
+   {
+      gettimeofday(&tv, NULL);
+      ts.tv_sec = tv.tv_sec + 2;    /* 2 sec timeout */
+      ts.tv_nsec = 0;
+      rc=0;
+      pthread_mutex_lock(&ps->io_mutex);
+      while (ps->feed_hold && (ps->state_bits & EMC_STATE_ESTOP_BIT) == 0 && rc==0)
+         rc = pthread_cond_timedwait(&ps->write_done_cond, &ps->io_mutex, &ts);
+      pthread_mutex_unlock(&ps->io_mutex);
+   } while (rc == ETIMEDOUT);
+
+   /* ESTOP ends the hold, the queued moves then run out without stepping like any ESTOP. */
+   ps->feed_hold = 0;
+   ps->replan = 0;
+   ps->state_bits &= ~EMC_STATE_HOLD_BIT;
+}  /* _dsp_hold() */
+
+/* Save the planner state at the start of io request io, see struct dsp_snap. */
+static void _dsp_snap(struct emc_session *ps, struct rtstepper_io_req *io)
+{
+   struct emc_dispatch *pd = ps->dsp;
+   struct dsp_snap *sp;
+   struct emc_axis *pa;
+   unsigned int i;
+   int t, len;
+
+   if (pd->snap_cycles * ps->cycle_time < DSP_SNAP_INTERVAL || (len = tcqLen(&ps->tp_queue.queue)) > DSP_SNAP_TC)
+      return;
+
+   sp = &pd->snap[io->index];
+   sp->tp = ps->tp_queue;
+   for (t = 0; t < len; t++)
+      sp->tc[t] = *tcqItem(&ps->tp_queue.queue, t, 0);
+   for (i = 0; i < ps->axes; i++)
+   {
+      pa = &ps->axis[i];
+      sp->axis[i].master_index = pa->master_index;
+      sp->axis[i].pulse_left = pa->pulse_left;
+      sp->axis[i].direction = pa->direction;
+      sp->axis[i].dda_pos = pa->dda_pos;
+      sp->axis[i].backlash_corr = pa->backlash_corr;
+      sp->axis[i].backlash_filt = pa->backlash_filt;
+      sp->axis[i].backlash_vel = pa->backlash_vel;
+      sp->axis[i].pos_cmd = pa->pos_cmd;
+      sp->axis[i].vel_cmd = pa->vel_cmd;
+   }
+   sp->feed_scale = ps->feed_scale;
+   sp->log_seq = pd->log_seq;
+   rtstepper_capture_mark(ps, &sp->cap);
+
+   io->snap = sp;
+   io->snap_seq = sp->log_seq;
+   pd->snap_cycles = 0;
+}  /* _dsp_snap() */
+
+/* Queue an interpreter move or blend setting in the planner. */
+static void _dsp_tp_cmd(struct emc_session *ps, emc_command_msg_t *cmd, int id)
+{
+   switch (cmd->msg.type)
+   {
+   case EMC_TRAJ_LINEAR_MOVE_TYPE:
+      {
+         emc_traj_linear_move_msg_t *p = (emc_traj_linear_move_msg_t *)cmd;
+
+         tpSetId(&ps->tp_queue, id);
+         tpSetVmax(&ps->tp_queue, p->vel);
+         tpSetVmaxLimit(&ps->tp_queue, p->ini_maxvel);   /* feed override cap */
+         tpSetAmax(&ps->tp_queue, p->acc);
+         tpSetJmax(&ps->tp_queue, p->jerk);
+         tpAddLine(&ps->tp_queue, p->end);
+      }
+      break;
+   case EMC_TRAJ_CIRCULAR_MOVE_TYPE:
+      {
+         emc_traj_circular_move_msg_t *p = (emc_traj_circular_move_msg_t *)cmd;
+
+         tpSetId(&ps->tp_queue, id);
+         tpSetVmax(&ps->tp_queue, p->vel);
+         tpSetVmaxLimit(&ps->tp_queue, p->ini_maxvel);   /* feed override cap */
+         tpSetAmax(&ps->tp_queue, p->acc);
+         tpSetJmax(&ps->tp_queue, p->jerk);
+         tpAddCircle(&ps->tp_queue, p->end, p->center, p->normal, p->turn);
+      }
+      break;
+   case EMC_TRAJ_SET_TERM_COND_TYPE:
+      {
+         emc_traj_set_term_cond_msg_t *p = (emc_traj_set_term_cond_msg_t *)cmd;
+
+         /* Set by G64 or G61. A G64 P tolerance rounds line corners with blend arcs. */
+         tpSetTermCond(&ps->tp_queue, p->cond, p->tolerance);
+      }
+      break;
+   default:
+      break;
+   }
+}  /* _dsp_tp_cmd() */
+
+/* Queue a planner command and log it, a feed hold replays the log from the restored snapshot. */
+static void _dsp_tp_add(struct emc_session *ps, emc_command_msg_t *cmd, int id)
+{
+   struct emc_dispatch *pd = ps->dsp;
+   struct dsp_move *pm = &pd->log[pd->log_seq++ % ps->tc_queue_size];
+
+   pm->cmd = *cmd;
+   pm->id = id;
+   _dsp_tp_cmd(ps, cmd, id);
+}  /* _dsp_tp_add() */
+
+/*
+ * Apply a feed override or hold to the steps not on the wire yet. The queued step buffers that have not been submitted are
+ * cancelled along with the step buffer being filled, the planner goes back to its state at the start of the first
+ * cancelled one and replays the moves queued since. The caller then plans the new speed or the stop from there.
+ * Without a usable snapshot the change starts after the queued steps.
+ */
+static void _dsp_rewind(struct emc_session *ps, struct rtstepper_io_req *io)
+{
+   struct emc_dispatch *pd = ps->dsp;
+   struct dsp_snap *sp;
+   struct dsp_move *pm;
+   struct emc_axis *pa;
+   uint64_t floor, seq;
+   unsigned int i;
+   int t, len, max;
+
+   ps->replan = 0;
+   if (io == NULL)
+      return;
+
+   /* Restored moves plus the replayed ones must fit in the planner queue. */
+   if ((max = ps->tc_queue_size - DSP_SNAP_TC - 1) < 0)
+      max = 0;
+   floor = pd->log_seq > (uint64_t)max ? pd->log_seq - max : 0;
+
+   if ((sp = (struct dsp_snap *)rtstepper_cancel_unsent(ps, floor)) == NULL)
+   {
+      if (io->snap == NULL || io->snap_seq < floor)
+         return;
+      sp = (struct dsp_snap *)io->snap;
+   }
+
+   DBG("_dsp_rewind() replay %d moves\n", (int)(pd->log_seq - sp->log_seq));
+
+   ps->tp_queue = sp->tp;
+   len = tcqLen(&ps->tp_queue.queue);
+   for (t = 0; t < len; t++)
+      *tcqItem(&ps->tp_queue.queue, t, 0) = sp->tc[t];
+   for (i = 0; i < ps->axes; i++)
+   {
+      pa = &ps->axis[i];
+      pa->master_index = sp->axis[i].master_index;
+      pa->pulse_left = sp->axis[i].pulse_left;
+      pa->direction = sp->axis[i].direction;
+      pa->dda_pos = sp->axis[i].dda_pos;
+      pa->backlash_corr = sp->axis[i].backlash_corr;
+      pa->backlash_filt = sp->axis[i].backlash_filt;
+      pa->backlash_vel = sp->axis[i].backlash_vel;
+      pa->pos_cmd = sp->axis[i].pos_cmd;
+      pa->vel_cmd = sp->axis[i].vel_cmd;
+   }
+   ps->feed_scale = sp->feed_scale;
+   ps->feed_overridden = 1;
+   rtstepper_capture_rewind(ps, &sp->cap);
+
+   for (seq = sp->log_seq; seq < pd->log_seq; seq++)
+   {
+      pm = &pd->log[seq % ps->tc_queue_size];
+      _dsp_tp_cmd(ps, &pm->cmd, pm->id);
+   }
+
+   /* The io request being filled starts over. */
+   io->total = 0;
+   io->snap = NULL;
+}  /* _dsp_rewind() */
+
+/* 
+ * Run trajectory planner cycles up to the look-ahead point, or until all queued moves are complete if flush is set.
+ * Each planner cycle is one servo period of servo_steps step cycles (ini: TRAJ, SERVO_PERIOD), the step generator
+ * moves each axis to the planner position at constant velocity over the period, which at constant acceleration a
+ * is within a*T^2/8 of the planned path for servo period T. Periods are collected into blocks of up to
+ * RTSTEPPER_ENCODE_BLOCK positions per axis and encoded together. A step buffer is dispatched to the IO system as
+ * soon as another period does not fit and encoding continues in a new buffer, so long moves start stepping right
+ * away and memory per move is capped. Returns the io request holding the last encoded cycle, tagged with the line
+ * number being executed at that point. A feed override or feed hold first replans from the last step sent (see
+ * _dsp_rewind()), once a hold has stopped the encoded steps are dispatched and planning waits for the resume.
+ */
+static struct rtstepper_io_req *_run_tp(struct emc_session *ps, struct rtstepper_io_req *io, int flush)
 {
-   double sm_pos[EMC_MAX_AXIS];
-   int cnt;
+   double sm_pos[EMC_MAX_AXIS][RTSTEPPER_ENCODE_BLOCK];
+   double pos[EMC_MAX_AXIS];
+   int cnt, id, n=0, block=0, held;
    unsigned int i;
 
-   for (cnt=1; !tpIsDone(&ps->tp_queue); cnt++)
+   for (cnt=1; ps->replan || _tp_runnable(ps, flush); cnt++)
    {
+      if (ps->replan)
+      {
+         /* Feed override or hold, plan the change from the last step sent. */
+         _dsp_rewind(ps, io);
+         n = 0;
+         if (!_tp_runnable(ps, flush))
+            break;
+      }
+      if (io != NULL && io->total == 0 && n == 0 && io->snap == NULL)
+         _dsp_snap(ps, io);
+      ps->dsp->snap_cycles++;
+
+      if (ps->feed_scale != ps->feed_override)
+      {
+         /* Scale queued moves, the planner changes speed at the move's accel. */
+         ps->feed_scale = ps->feed_override;
+         ps->feed_overridden = 1;
+         tpSetVscale(&ps->tp_queue, ps->feed_scale);
+      }
+      if (ps->feed_hold)
+         tpPause(&ps->tp_queue);   /* decelerate to a stop at the move's accel */
+      else
+         tpResume(&ps->tp_queue);  /* replans the queued moves */
+
       tpRunCycle(&ps->tp_queue);
+      held = ps->feed_hold && tpIsPaused(&ps->tp_queue);
 #if 0
       if (cnt < 1500)
       {
@@ -84,24 +444,51 @@ static void _run_tp(struct emc_session *ps, struct rtstepper_io_req *io)
       /* Calculate leadscrew compensation (backlash). */
       compute_screw_comp(ps);
 
+      _sm_pos(ps, tpGetPos(&ps->tp_queue), pos);
       for (i=0; i < ps->axes; i++)
+         sm_pos[i][n] = pos[i];
+
+      //DBG("X vel_cmd=%0.9f, X bl_vel=%0.9f, X pos_cmd=%0.9f, X sm=%0.9f, X backlash=%0.9f\n", 
+      //ps->axis[0].vel_cmd, ps->axis[0].backlash_vel, ps->axis[0].pos_cmd, sm_pos[0][n], ps->axis[0].backlash_filt);
+
+      if (io == NULL)
       {
-         /* Apply backlash. */
-         sm_pos[i] = ps->axis[i].pos_cmd + ps->axis[i].backlash_filt;
+         /* no usb dongle or ESTOP, nothing to encode */
+         if (held)
+            _dsp_hold(ps);
+         continue;
+      }
 
-         /* Check soft position limit. */
-         if (sm_pos[i] > 0.0)
-            sm_pos[i] = (sm_pos[i] > ps->axis[i].max_pos_limit) ? ps->axis[i].max_pos_limit : sm_pos[i];
-         if (sm_pos[i] < 0.0)
-            sm_pos[i] = (sm_pos[i] < ps->axis[i].min_pos_limit) ? ps->axis[i].min_pos_limit : sm_pos[i];
+      /* Block ends at RTSTEPPER_ENCODE_BLOCK periods or where the step buffer fills. */
+      if (n == 0)
+      {
+         block = (_io_size(ps, io) - io->total) / 2 / ps->servo_steps;
+         if (block > RTSTEPPER_ENCODE_BLOCK)
+            block = RTSTEPPER_ENCODE_BLOCK;
       }
+      if ((id = tpGetExecId(&ps->tp_queue)))
+         io->id = id;
 
-      //DBG("X vel_cmd=%0.9f, X bl_vel=%0.9f, X pos_cmd=%0.9f, X sm=%0.9f, X backlash=%0.9f\n", 
-      //ps->axis[0].vel_cmd, ps->axis[0].backlash_vel, ps->axis[0].pos_cmd, sm_pos[0], ps->axis[0].backlash_filt);
+      if (++n < block && _tp_runnable(ps, flush) && !held)
+         continue;
 
       /* Encode step buffer. */
-      rtstepper_encode(ps, io, sm_pos);
+      rtstepper_encode(ps, io, sm_pos, n);
+      n = 0;
+
+      if ((_io_size(ps, io) - io->total) / 2 < ps->servo_steps || held)
+      {
+         /* Dispatch full step buffer chunk, continue the move in a new io request. Note, io may be freed once dispatched. */
+         id = io->id;
+         if (rtstepper_start_xfr(ps, io, tpGetPos(&ps->tp_queue)) != EMC_R_OK)
+            return NULL;
+         if (held)
+            _dsp_hold(ps);
+         rtstepper_xfr_hysteresis(ps);
+         io = rtstepper_alloc_io_req(ps, id);
+      }
    }
+   return io;
 }  /* _run_tp() */
 
 /* Dispatch interpreter command. */
@@ -115,27 +502,23 @@ static enum EMC_RESULT _dsp_interp_cmd(struct emc_session *ps, emc_command_msg_t
    {
    case EMC_TRAJ_LINEAR_MOVE_TYPE:
       {
-         emc_traj_linear_move_msg_t *p = (emc_traj_linear_move_msg_t *)cmd;
          struct rtstepper_io_req *io;
 
-         tpSetId(&ps->tp_queue, id);
-         tpSetVmax(&ps->tp_queue, p->vel);
-         tpSetAmax(&ps->tp_queue, p->acc);
-         tpAddLine(&ps->tp_queue, p->end);
+         _dsp_tp_add(ps, cmd, id);
 
          /* Allocate an io request transfer. */ 
          io = rtstepper_alloc_io_req(ps, id);       
 
-         /* Run trajectory planner. */
-         _run_tp(ps, io);
+         /* Run trajectory planner up to the look-ahead point, the last queued moves wait for the ones that follow. */
+         io = _run_tp(ps, io, 0);
 
          DBG("L line=%d x_pos=%0.5f, x_master=%d y_pos=%0.5f, y_master=%d z_pos=%0.5f, z_master=%d\n", id, 
-         p->end.tran.x, ps->axis[EMC_AXIS_X].master_index, 
-         p->end.tran.y, ps->axis[EMC_AXIS_Y].master_index, 
-         p->end.tran.z, ps->axis[EMC_AXIS_Z].master_index);
+         cmd->m3.end.tran.x, ps->axis[EMC_AXIS_X].master_index, 
+         cmd->m3.end.tran.y, ps->axis[EMC_AXIS_Y].master_index, 
+         cmd->m3.end.tran.z, ps->axis[EMC_AXIS_Z].master_index);
 
          /* Dispatch step buffer package to IO system. */
-         if (rtstepper_start_xfr(ps, io, tpGetPos(&ps->tp_queue)) != EMC_R_OK)
+         if (_dsp_start_xfr(ps, io) != EMC_R_OK)
             goto bugout;
         
          stat = EMC_R_OK;
@@ -143,27 +526,23 @@ static enum EMC_RESULT _dsp_interp_cmd(struct emc_session *ps, emc_command_msg_t
       break;
    case EMC_TRAJ_CIRCULAR_MOVE_TYPE:
       {
-         emc_traj_circular_move_msg_t *p = (emc_traj_circular_move_msg_t *)cmd;
          struct rtstepper_io_req *io;
 
-         tpSetId(&ps->tp_queue, id);
-         tpSetVmax(&ps->tp_queue, p->vel);
-         tpSetAmax(&ps->tp_queue, p->acc);
-         tpAddCircle(&ps->tp_queue, p->end, p->center, p->normal, p->turn);
+         _dsp_tp_add(ps, cmd, id);
 
          /* Allocate an io request transfer. */ 
          io = rtstepper_alloc_io_req(ps, id);       
 
-         /* Run trajectory planner. */
-         _run_tp(ps, io);
+         /* Run trajectory planner up to the look-ahead point, the last queued moves wait for the ones that follow. */
+         io = _run_tp(ps, io, 0);
 
          DBG("C line=%d x_pos=%0.5f, x_master=%d y_pos=%0.5f, y_master=%d z_pos=%0.5f, z_master=%d\n", id, 
-         p->end.tran.x, ps->axis[EMC_AXIS_X].master_index, 
-         p->end.tran.y, ps->axis[EMC_AXIS_Y].master_index, 
-         p->end.tran.z, ps->axis[EMC_AXIS_Z].master_index);
+         cmd->m5.end.tran.x, ps->axis[EMC_AXIS_X].master_index, 
+         cmd->m5.end.tran.y, ps->axis[EMC_AXIS_Y].master_index, 
+         cmd->m5.end.tran.z, ps->axis[EMC_AXIS_Z].master_index);
 
          /* Dispatch step buffer package to IO system. */
-         if (rtstepper_start_xfr(ps, io, tpGetPos(&ps->tp_queue)) != EMC_R_OK)
+         if (_dsp_start_xfr(ps, io) != EMC_R_OK)
             goto bugout;
  
          stat = EMC_R_OK;
@@ -171,7 +550,8 @@ static enum EMC_RESULT _dsp_interp_cmd(struct emc_session *ps, emc_command_msg_t
       break;
    case EMC_TASK_PLAN_PAUSE_TYPE:
       {
-         /* Wait for any current IO to finish. */
+         /* Finish queued moves and wait for any current IO to finish. */
+         dsp_flush(ps);
          dsp_wait_io_done(ps);
 
          /* M0, M1 and M60 causes a pause. A user resume command will clear the pause. */
@@ -180,12 +560,9 @@ static enum EMC_RESULT _dsp_interp_cmd(struct emc_session *ps, emc_command_msg_t
       break;
    case EMC_TRAJ_SET_TERM_COND_TYPE:
       {
-         emc_traj_set_term_cond_msg_t *p = (emc_traj_set_term_cond_msg_t *)cmd;
-         
-         DBG("Set blending %s\n", (p->cond == TC_TERM_COND_BLEND) ? "on" : "off");
+         DBG("Set blending %s tolerance=%0.5f\n", (cmd->m4.cond == TC_TERM_COND_BLEND) ? "on" : "off", cmd->m4.tolerance);
 
-         /* Set by G64 or G61. Note G64 'tolerance' parameter is not supported. */
-         tpSetTermCond(&ps->tp_queue, p->cond);
+         _dsp_tp_add(ps, cmd, id);
 
          stat = EMC_R_OK;
       }
@@ -193,24 +570,14 @@ static enum EMC_RESULT _dsp_interp_cmd(struct emc_session *ps, emc_command_msg_t
    case EMC_TRAJ_DELAY_TYPE:
       {
          emc_traj_delay_msg_t *p = (emc_traj_delay_msg_t *)cmd;
-         double step, delay=p->delay;
          
-         if (delay > 0.0)
+         if (p->delay > 0.0)
          {
-            /* Wait for any current IO to finish. */
+            /* Record the dwell once the steps before it are sent, a feed hold may still replan them. */
+            dsp_flush(ps);
             dsp_wait_io_done(ps);
-
-            /* Now perform the delay. */
-            step = 1.0;
-            while (step > delay)
-            {
-               if (ps->state_bits & EMC_STATE_ESTOP_BIT)
-                  break;
-               esleep(step);
-               delay -= step;
-            }
-            if (delay > 0.0)
-               esleep(delay);
+            rtstepper_capture_event(ps, RTSTEPPER_CAP_DELAY, id, &p->delay, sizeof(p->delay));
+            dsp_delay(ps, p->delay);
          }
          stat = EMC_R_OK;
       }
@@ -218,12 +585,21 @@ static enum EMC_RESULT _dsp_interp_cmd(struct emc_session *ps, emc_command_msg_t
    case EMC_SYSTEM_CMD_TYPE:
       {
          emc_system_cmd_msg_t *p = (emc_system_cmd_msg_t *)cmd;
+         struct rtstepper_cap_mcode mc;
+
+         /* Finish queued moves, the mcode runs at the end of the previous move. */
+         dsp_flush(ps);
 
          /* Wait for any current IO to finish. */
          dsp_wait_io_done(ps);
 
+         mc.index = p->index;
+         mc.p_number = p->p_number;
+         mc.q_number = p->q_number;
+         rtstepper_capture_event(ps, RTSTEPPER_CAP_MCODE, id, &mc, sizeof(mc));
+
          /* Call mcode python plugin (m3, m4, m5, m7, m8, m9 & user_defined). */
-         emc_plugin_cb(p->index, p->p_number, p->q_number);
+         emc_plugin_cb(ps, p->index, p->p_number, p->q_number);
 
          stat = EMC_R_OK;
       }
@@ -231,13 +607,14 @@ static enum EMC_RESULT _dsp_interp_cmd(struct emc_session *ps, emc_command_msg_t
    case EMC_TASK_PLAN_END_TYPE:
       FINISH();    /* M2 or M30 */
 
-      /* Wait for current IO to finish. */
+      /* Finish queued moves and wait for current IO to finish. */
+      dsp_flush(ps);
       dsp_wait_io_done(ps);
 
       if ((ps->state_bits & EMC_STATE_ESTOP_BIT) == 0)
       {
          /* Post final line number for gui. */
-         emc_post_position_cb(id, ps->position); 
+         emc_post_position_cb(ps, id, ps->position); 
       }
 
       stat = EMC_R_OK;
@@ -264,7 +641,7 @@ static enum EMC_RESULT _dsp_interp_verify(struct emc_session *ps, emc_command_ms
       {
          emc_traj_linear_move_msg_t *p = (emc_traj_linear_move_msg_t *)cmd;
          DBG("L line=%d x_pos=%0.5f, y_pos=%0.5f, z_pos=%0.5f\n", id, p->end.tran.x, p->end.tran.y, p->end.tran.z);
-         emc_post_position_cb(id, p->end);
+         emc_post_position_cb(ps, id, p->end);
          stat = EMC_R_OK;
       }
       break;
@@ -272,7 +649,7 @@ static enum EMC_RESULT _dsp_interp_verify(struct emc_session *ps, emc_command_ms
       {
          emc_traj_circular_move_msg_t *p = (emc_traj_circular_move_msg_t *)cmd;
          DBG("C line=%d x_pos=%0.5f, y_pos=%0.5f, z_pos=%0.5f\n", id, p->end.tran.x, p->end.tran.y, p->end.tran.z);
-         emc_post_position_cb(id, p->end);
+         emc_post_position_cb(ps, id, p->end);
          stat = EMC_R_OK;
       }
       break;
@@ -299,7 +676,7 @@ static enum EMC_RESULT _dsp_interp_verify(struct emc_session *ps, emc_command_ms
    case EMC_TASK_PLAN_END_TYPE:
       FINISH();    /* M2 or M30 */
       /* Post final line number for gui. */
-      emc_post_position_cb(id, ps->position); 
+      emc_post_position_cb(ps, id, ps->position); 
 
       stat = EMC_R_OK;
       break;
@@ -317,13 +694,19 @@ enum EMC_RESULT dsp_mdi(struct emc_session *ps, const char *mdi)
    enum EMC_RESULT stat;
    int retval, len;
    int line_number=0;
+   Interp &interp = _dsp_bind(ps);
 
    DBG("dsp_mdi() cmd=%s\n", mdi);
 
+   if (_dsp_claim(ps, "dsp_mdi()") != EMC_R_OK)
+      return EMC_R_ERROR;
+
+   ps->feed_hold = 0;   /* a hold requested while idle does not stall this run */
+
    retval = interp.execute(mdi, line_number);
    if (retval > INTERP_MIN_ERROR)
    {
-      _interp_error(retval);
+      _interp_error(interp, retval);
       stat = EMC_R_INTERPRETER_ERROR;
       goto bugout;
    }
@@ -343,17 +726,176 @@ enum EMC_RESULT dsp_mdi(struct emc_session *ps, const char *mdi)
 
    stat = EMC_R_OK;
 bugout:
+   /* No look-ahead across MDI commands, finish the move now. */
+   dsp_flush(ps);
+   _dsp_release(ps);
    return stat;
 }       /* dsp_mdi() */
 
-enum EMC_RESULT dsp_auto(struct emc_session *ps, const char *gcodefile)
+#define CACHE_HASH(v) (h = rtstepper_hash(h, &(v), sizeof(v)))
+
+/* 
+ * Build the step stream cache file name for gcodefile. The key is a hash of the file contents, the ini axis and traj
+ * settings, the machine position and encoder state and the interpreter modal state, so a change to any of them
+ * selects a different cache file. Returns 0 if the cache is disabled.
+ */
+static int _cache_path(struct emc_session *ps, Interp &interp, const char *gcodefile, char *path, int size)
+{
+   struct emc_axis *pa;
+   int g_codes[ACTIVE_G_CODES], m_codes[ACTIVE_M_CODES];
+   double settings[ACTIVE_SETTINGS], parameters[RS274NGC_MAX_PARAMETERS];
+   uint32_t version = RTSTEPPER_CAP_VERSION, period = RTSTEPPER_PERIOD;
+   uint64_t h = RTSTEPPER_HASH_INIT;
+   unsigned int i;
+
+   if (ps->step_cache[0] == 0 || ps->capture != NULL)
+      return 0;   /* no cache or user capture in progress */
+
+   if (rtstepper_hash_file(gcodefile, &h) != EMC_R_OK)
+      return 0;
+
+   CACHE_HASH(version);
+   CACHE_HASH(period);
+   CACHE_HASH(ps->axes);
+   CACHE_HASH(ps->dongles);
+   CACHE_HASH(ps->step_pulse_width);
+   CACHE_HASH(ps->linearUnits);
+   CACHE_HASH(ps->angularUnits);
+   CACHE_HASH(ps->maxVelocity);
+   CACHE_HASH(ps->maxAcceleration);
+   CACHE_HASH(ps->junctionDeviation);
+   CACHE_HASH(ps->servo_steps);
+   CACHE_HASH(ps->position);
+   h = rtstepper_hash(h, ps->toolTable, sizeof(ps->toolTable));
+   for (i=0; i < ps->axes; i++)
+   {
+      pa = &ps->axis[i];
+      CACHE_HASH(pa->type);
+      CACHE_HASH(pa->max_pos_limit);
+      CACHE_HASH(pa->min_pos_limit);
+      CACHE_HASH(pa->backlash);
+      CACHE_HASH(pa->max_acceleration);
+      CACHE_HASH(pa->max_velocity);
+      CACHE_HASH(pa->max_jerk);
+      CACHE_HASH(pa->step_pin);
+      CACHE_HASH(pa->direction_pin);
+      CACHE_HASH(pa->step_active_high);
+      CACHE_HASH(pa->direction_active_high);
+      CACHE_HASH(pa->dongle);
+      CACHE_HASH(pa->steps_per_unit);
+      CACHE_HASH(pa->master_index);
+      CACHE_HASH(pa->pulse_left);
+      CACHE_HASH(pa->direction);
+      CACHE_HASH(pa->dda_pos);
+      CACHE_HASH(pa->backlash_corr);
+      CACHE_HASH(pa->backlash_filt);
+      CACHE_HASH(pa->backlash_vel);
+      CACHE_HASH(pa->pos_cmd);
+      CACHE_HASH(pa->vel_cmd);
+   }
+
+   interp.active_g_codes(g_codes);
+   interp.active_m_codes(m_codes);
+   interp.active_settings(settings);
+   interp.active_parameters(parameters);
+   CACHE_HASH(g_codes);
+   CACHE_HASH(m_codes);
+   CACHE_HASH(settings);
+   CACHE_HASH(parameters);
+
+   snprintf(path, size, "%s/%016llx.rtcap", ps->step_cache, (unsigned long long)h);
+   return 1;
+}  /* _cache_path() */
+
+static int _cache_exists(const char *path)
+{
+   struct stat st;
+
+   return stat(path, &st) == 0;
+}  /* _cache_exists() */
+
+/* 
+ * Run the open gcode file from the step stream cache. The interpreter still reads the file so its modal state,
+ * parameters and canon position end up the same as a planned run, but canon output is dropped instead of being
+ * planned and encoded. The step stream, M-code plugin calls and dwells come straight from the mapped cache file.
+ * Feed override and feed hold are refused while the cached steps stream, see dsp_feed_override().
+ */
+static enum EMC_RESULT _dsp_cache_run(struct emc_session *ps, Interp &interp, const char *cache)
 {
+   emc_command_msg_t *cmd;
    enum EMC_RESULT stat;
-   int retval, len;
+   int retval, len, end_line=0;
    char line[LINELEN];
 
+   MSG("Using step stream cache %s\n", cache);
+
+   while ((fgets(line, sizeof(line), ps->gfile) != NULL))
+   {
+      retval = interp.execute(line, ps->line_number);
+      if (retval > INTERP_MIN_ERROR)
+      {
+         _interp_error(interp, retval);
+         return EMC_R_INTERPRETER_ERROR;
+      }
+      for (len = interp_list.len(); len > 0; len--)
+      {
+         cmd = interp_list.get();
+         if (cmd->msg.type == EMC_TRAJ_SET_TERM_COND_TYPE)
+            _dsp_interp_cmd(ps, cmd, ps->line_number);   /* keep G61/G64 blending for the next run */
+         else if (cmd->msg.type == EMC_TASK_PLAN_END_TYPE)
+         {
+            FINISH();    /* M2 or M30 */
+            interp_list.clear();
+            end_line = ps->line_number;
+            break;
+         }
+      }
+      ps->line_number++;
+   }
+
+   /* The cached steps can not be rescaled or decelerated, a feed hold is only taken before they start. */
+   pthread_mutex_lock(&ps->io_mutex);
+   ps->replaying = 1;
+   ps->replan = 0;
+   pthread_mutex_unlock(&ps->io_mutex);
+   if (ps->feed_hold)
+      _dsp_hold(ps);
+
+   rtstepper_io_stats_run(ps, 1);
+   stat = rtstepper_replay(ps, cache, "dongle");
+   rtstepper_io_stats_run(ps, 0);
+
+   pthread_mutex_lock(&ps->io_mutex);
+   ps->replaying = 0;
+   pthread_mutex_unlock(&ps->io_mutex);
+
+   if (ps->state_bits & EMC_STATE_ESTOP_BIT)
+      return EMC_R_OK;
+   if (stat != EMC_R_OK)
+      return EMC_R_ERROR;
+
+   /* Replay restored the encoder state, continue planning from the cached end position. */
+   tpSetPos(&ps->tp_queue, ps->position);
+   if (end_line)
+      emc_post_position_cb(ps, end_line, ps->position);
+   return EMC_R_OK;
+}  /* _dsp_cache_run() */
+
+enum EMC_RESULT dsp_auto(struct emc_session *ps, const char *gcodefile)
+{
+   enum EMC_RESULT stat;
+   int retval, len, cache=0;
+   char line[LINELEN], cache_file[LINELEN+32], cache_tmp[LINELEN+40];
+   emc_command_msg_t *cmd;
+   Interp &interp = _dsp_bind(ps);
+
    DBG("dsp_auto() file=%s, paused=%d\n", gcodefile, ps->state_bits & EMC_STATE_PAUSED_BIT); 
 
+   if (_dsp_claim(ps, "dsp_auto()") != EMC_R_OK)
+      return EMC_R_ERROR;
+
+   ps->feed_hold = 0;   /* a hold requested while idle does not stall this run */
+
    if (ps->state_bits & EMC_STATE_PAUSED_BIT)
    {
       /* Pause is set, clear it. */
@@ -369,8 +911,27 @@ enum EMC_RESULT dsp_auto(struct emc_session *ps, const char *gcodefile)
          goto bugout;
       } 
       ps->line_number=1;
+      ps->feed_overridden = 0;
+
+      /* Run from the step stream cache if this program was cached from the same start state. The cache holds steps 
+         at 100% feed. */
+      if (ps->feed_override == 1.0 && _cache_path(ps, interp, gcodefile, cache_file, sizeof(cache_file)))
+      {
+         if (_cache_exists(cache_file))
+         {
+            stat = _dsp_cache_run(ps, interp, cache_file);
+            goto bugout;
+         }
+
+         /* Otherwise capture this run, it becomes the cache file if the program is cacheable. */
+         snprintf(cache_tmp, sizeof(cache_tmp), "%s.tmp", cache_file);
+         if (rtstepper_capture_open(ps, cache_tmp) == EMC_R_OK)
+            cache = 1;
+      }
    }
 
+   rtstepper_io_stats_run(ps, 1);
+
    /* Read, interpret and execute each line in the gcode file */
    while ((fgets(line, sizeof(line), ps->gfile) != NULL))
    {
@@ -386,9 +947,10 @@ enum EMC_RESULT dsp_auto(struct emc_session *ps, const char *gcodefile)
       if (retval > INTERP_MIN_ERROR)
       {
          /* Interpreter error, wait for current IO to finish so the error msg is at the appropiate line #. */
+         dsp_flush(ps);
          dsp_wait_io_done(ps);
 
-         _interp_error(retval);
+         _interp_error(interp, retval);
          stat = EMC_R_INTERPRETER_ERROR;
          goto bugout;
       }
@@ -397,7 +959,18 @@ enum EMC_RESULT dsp_auto(struct emc_session *ps, const char *gcodefile)
          len = interp_list.len();
          while (len)
          {
-            if ((stat = _dsp_interp_cmd(ps, interp_list.get(), ps->line_number)) != EMC_R_OK)
+            cmd = interp_list.get();
+            if (cmd->msg.type == EMC_TASK_PLAN_PAUSE_TYPE)
+            {
+               /* Program is resumed by the user, do not cache this program. */
+               if (cache)
+               {
+                  rtstepper_capture_close(ps);
+                  remove(cache_tmp);
+                  cache = 0;
+               }
+            }
+            if ((stat = _dsp_interp_cmd(ps, cmd, ps->line_number)) != EMC_R_OK)
             {
                if (stat == EMC_R_PROGRAM_PAUSED)
                {
@@ -405,9 +978,11 @@ enum EMC_RESULT dsp_auto(struct emc_session *ps, const char *gcodefile)
                   emc_post_paused_cb(ps);
 
                   /* Update the display with the mcode line number. */
-                  emc_post_position_cb(ps->line_number, ps->position); 
+                  emc_post_position_cb(ps, ps->line_number, ps->position); 
 
                   ps->line_number++;
+                  rtstepper_io_stats_run(ps, 0);
+                  _dsp_release(ps);
                   return stat;
                }
                else
@@ -425,8 +1000,27 @@ enum EMC_RESULT dsp_auto(struct emc_session *ps, const char *gcodefile)
    stat = EMC_R_OK;
 
 bugout:
+   /* Finish moves still queued for look-ahead (end of file without M2, error or ESTOP). */
+   dsp_flush(ps);
+   rtstepper_io_stats_run(ps, 0);
+   if (cache)
+   {
+      /* Keep the capture only if the whole program ran at 100% feed without a feed hold. A hold may still come in
+         while the last steps are sent. */
+      dsp_wait_io_done(ps);
+      if (ps->feed_overridden)
+         cache = 0;
+      if (cache && stat == EMC_R_OK && !(ps->state_bits & EMC_STATE_ESTOP_BIT))
+         rtstepper_capture_state(ps);
+      rtstepper_capture_close(ps);
+      if (cache && stat == EMC_R_OK && !(ps->state_bits & EMC_STATE_ESTOP_BIT) && rename(cache_tmp, cache_file) == 0)
+         MSG("Step stream cached to %s\n", cache_file);
+      else
+         remove(cache_tmp);
+   }
    if (ps->gfile != NULL)
       fclose(ps->gfile);
+   _dsp_release(ps);
    return stat;
 }       /* dsp_auto() */
 
@@ -435,6 +1029,10 @@ enum EMC_RESULT dsp_verify(struct emc_session *ps, const char *gcodefile)
    enum EMC_RESULT stat;
    int retval, len;
    char line[LINELEN];
+   Interp &interp = _dsp_bind(ps);
+
+   if (_dsp_claim(ps, "dsp_verify()") != EMC_R_OK)
+      return EMC_R_ERROR;
 
    ps->state_bits |= EMC_STATE_VERIFY_BIT;
 
@@ -454,7 +1052,7 @@ enum EMC_RESULT dsp_verify(struct emc_session *ps, const char *gcodefile)
       retval = interp.execute(line, ps->line_number);
       if (retval > INTERP_MIN_ERROR)
       {
-         _interp_error(retval);
+         _interp_error(interp, retval);
          stat = EMC_R_INTERPRETER_ERROR;
          goto bugout;
       }
@@ -465,7 +1063,7 @@ enum EMC_RESULT dsp_verify(struct emc_session *ps, const char *gcodefile)
          {
             if (!(ps->state_bits & EMC_STATE_VERIFY_BIT))
             {
-               emc_post_position_cb(ps->line_number, ps->position);    /* user cancel */
+               emc_post_position_cb(ps, ps->line_number, ps->position);    /* user cancel */
                goto bugout;               
             }
 
@@ -491,6 +1089,7 @@ bugout:
    ps->state_bits &= ~EMC_STATE_VERIFY_BIT;
    if (ps->gfile != NULL)
       fclose(ps->gfile);
+   _dsp_release(ps);
    return stat;
 }       /* dsp_verify() */
 
@@ -501,6 +1100,292 @@ enum EMC_RESULT dsp_verify_cancel(struct emc_session *ps)
    return EMC_R_OK;
 }
 
+/* Runtime estimate in progress, see dsp_estimate(). */
+struct dsp_estimator
+{
+   TP_STRUCT tp;                   /* scratch planner, the session planner is left alone */
+   struct emc_estimate *est;
+   double *line_time;              /* per gcode line, optional */
+   int line_cnt;
+   int slot;                       /* current tool slot */
+};
+
+static void _estimate_add(struct dsp_estimator *pe, int id, double t)
+{
+   pe->est->total += t;
+   pe->est->tool[pe->slot] += t;
+   if (pe->line_time != NULL && id > 0 && id <= pe->line_cnt)
+      pe->line_time[id-1] += t;
+}
+
+/* Estimate the moves the planner would run, up to the look-ahead point or all queued moves if flush is set, see _run_tp(). */
+static void _estimate_tp(struct dsp_estimator *pe, int flush)
+{
+   double t, slow;
+   int id;
+
+   while (tpQueueDepth(&pe->tp) > (flush ? 0 : DEFAULT_TP_LOOKAHEAD))
+   {
+      id = tpEstimate(&pe->tp, &t, &slow);
+      pe->est->below_feed += slow;
+      _estimate_add(pe, id, t);
+   }
+}
+
+static void _dsp_interp_estimate(struct dsp_estimator *pe, emc_command_msg_t *cmd, int id)
+{
+   switch (cmd->msg.type)
+   {
+   case EMC_TRAJ_LINEAR_MOVE_TYPE:
+      {
+         emc_traj_linear_move_msg_t *p = (emc_traj_linear_move_msg_t *)cmd;
+         tpSetId(&pe->tp, id);
+         tpSetVmax(&pe->tp, p->vel);
+         tpSetVmaxLimit(&pe->tp, p->ini_maxvel);
+         tpSetAmax(&pe->tp, p->acc);
+         tpSetJmax(&pe->tp, p->jerk);
+         tpAddLine(&pe->tp, p->end);
+         _estimate_tp(pe, 0);
+      }
+      break;
+   case EMC_TRAJ_CIRCULAR_MOVE_TYPE:
+      {
+         emc_traj_circular_move_msg_t *p = (emc_traj_circular_move_msg_t *)cmd;
+         tpSetId(&pe->tp, id);
+         tpSetVmax(&pe->tp, p->vel);
+         tpSetVmaxLimit(&pe->tp, p->ini_maxvel);
+         tpSetAmax(&pe->tp, p->acc);
+         tpSetJmax(&pe->tp, p->jerk);
+         tpAddCircle(&pe->tp, p->end, p->center, p->normal, p->turn);
+         _estimate_tp(pe, 0);
+      }
+      break;
+   case EMC_TASK_PLAN_PAUSE_TYPE:
+      _estimate_tp(pe, 1);   /* M0, M1 and M60 wait for the user, not timed */
+      break;
+   case EMC_TRAJ_SET_TERM_COND_TYPE:
+      {
+         emc_traj_set_term_cond_msg_t *p = (emc_traj_set_term_cond_msg_t *)cmd;
+         tpSetTermCond(&pe->tp, p->cond, p->tolerance);
+      }
+      break;
+   case EMC_TRAJ_DELAY_TYPE:
+      {
+         emc_traj_delay_msg_t *p = (emc_traj_delay_msg_t *)cmd;
+         if (p->delay > 0.0)
+         {
+            _estimate_tp(pe, 1);
+            pe->est->dwell += p->delay;
+            _estimate_add(pe, id, p->delay);
+         }
+      }
+      break;
+   case EMC_SYSTEM_CMD_TYPE:
+      {
+         emc_system_cmd_msg_t *p = (emc_system_cmd_msg_t *)cmd;
+
+         /* Queued moves finish before the mcode runs, the plugin itself is not timed. */
+         _estimate_tp(pe, 1);
+         if (p->index == 6 && p->p_number >= 0 && p->p_number < CANON_POCKETS_MAX)
+            pe->slot = (int)p->p_number;   /* M6 */
+      }
+      break;
+   case EMC_TASK_PLAN_END_TYPE:
+      FINISH();    /* M2 or M30 */
+      _estimate_tp(pe, 1);
+      break;
+   default:
+      BUG("unknown command type=%d cmd=%s\n", cmd->msg.type, lookup_message(cmd->msg.type));
+      break;
+   }
+}   /* _dsp_interp_estimate() */
+
+/*
+ * Estimate the run time of gcodefile without running it. The canon move stream goes through a scratch planner with
+ * the same look-ahead, junction and blend planning as a run, and each move is timed in closed form from its planned
+ * entry and exit velocity, see tpEstimate(). If line_time is not NULL it gets the time per gcode line for the first
+ * line_cnt lines, so any line range can be summed. Feed override and hold are not applied. The program runs on a
+ * scratch interpreter and canon state cloned from the session, so modal codes, offsets, feed rate and canon end point
+ * are left as they were for the next run and its cache key.
+ */
+enum EMC_RESULT dsp_estimate(struct emc_session *ps, const char *gcodefile, struct emc_estimate *est, double *line_time, int line_cnt)
+{
+   struct dsp_estimator pe;
+   TC_STRUCT *tc_space = NULL;
+   FILE *gfile = NULL;
+   Interp *scratch = NULL;
+   struct emc_canon *canon = NULL;
+   enum EMC_RESULT stat = EMC_R_ERROR;
+   int retval, len, line_number;
+   char line[LINELEN];
+   Interp &interp = _dsp_bind(ps);
+
+   DBG("dsp_estimate() file=%s\n", gcodefile);
+
+   memset(est, 0, sizeof(struct emc_estimate));
+   if (line_time != NULL && line_cnt > 0)
+      memset(line_time, 0, sizeof(double) * line_cnt);
+
+   if (_dsp_claim(ps, "dsp_estimate()") != EMC_R_OK)
+      return EMC_R_ERROR;
+
+   if (ps->state_bits & EMC_STATE_PAUSED_BIT)
+   {
+      BUG("unable to estimate while a program is paused\n");
+      goto bugout;
+   }
+
+   if ((scratch = new (std::nothrow) Interp()) == NULL)
+   {
+      BUG("unable to malloc estimate interpreter\n");
+      goto bugout;
+   }
+   if (scratch->clone(interp) > INTERP_MIN_ERROR)
+   {
+      _interp_error(*scratch, INTERP_ERROR);
+      goto bugout;
+   }
+   if ((canon = emc_canon_scratch(ps)) == NULL)
+      goto bugout;
+   Interp::current = scratch;
+
+   /* Look-ahead moves plus the next move and its G64 P blend arc. */
+   if ((tc_space = new (std::nothrow) TC_STRUCT[DEFAULT_TP_LOOKAHEAD + 3]) == NULL)
+   {
+      BUG("unable to malloc estimate motion queue\n");
+      goto bugout;
+   }
+   if (tpCreate(&pe.tp, DEFAULT_TP_LOOKAHEAD + 3, tc_space) == -1)
+      goto bugout;
+   tpSetCycleTime(&pe.tp, ps->cycle_time);
+   tpSetPos(&pe.tp, ps->position);
+   tpSetVlimit(&pe.tp, ps->maxVelocity);
+   tpSetJunctionDeviation(&pe.tp, ps->junctionDeviation);
+   tpSetTermCond(&pe.tp, tpGetTermCond(&ps->tp_queue), ps->tp_queue.tolerance);   /* G61/G64 carries over from the last run */
+   pe.est = est;
+   pe.line_time = line_time;
+   pe.line_cnt = line_cnt;
+   pe.slot = 0;
+
+   if ((gfile = fopen(gcodefile, "r")) == NULL)
+   {
+      BUG("unable to open %s\n", gcodefile);
+      stat = EMC_R_INVALID_GCODE_FILE;
+      goto bugout;
+   }
+
+   /* Read and interpret each line in the gcode file, time its canon commands. */
+   for (line_number=1; fgets(line, sizeof(line), gfile) != NULL; line_number++)
+   {
+      retval = scratch->execute(line, line_number);
+      if (retval > INTERP_MIN_ERROR)
+      {
+         _interp_error(*scratch, retval);
+         stat = EMC_R_INTERPRETER_ERROR;
+         goto bugout;
+      }
+      for (len = interp_list.len(); len > 0; len--)
+         _dsp_interp_estimate(&pe, interp_list.get(), line_number);
+      est->lines = line_number;
+   }
+   _estimate_tp(&pe, 1);
+
+   DBG("dsp_estimate() total=%0.3f below_feed=%0.3f dwell=%0.3f lines=%d\n", est->total, est->below_feed, est->dwell, est->lines);
+   stat = EMC_R_OK;
+
+bugout:
+   if (gfile != NULL)
+      fclose(gfile);
+   interp_list.clear();
+   if (canon != NULL)
+      emc_canon_restore(ps, canon);
+   Interp::current = &interp;
+   delete scratch;
+   if (tc_space != NULL)
+      tpDelete(&pe.tp);
+   delete[] tc_space;
+   _dsp_release(ps);
+   return stat;
+}       /* dsp_estimate() */
+
+/* 
+ * Set the feed override scale, called from the ui thread while a program runs. Like a feed hold the step buffers not
+ * yet submitted to the dongle are replanned at the new scale, so it takes effect within the override latency (ini:
+ * TASK, OVERRIDE_LATENCY).
+ * A program run from the step stream cache (ini: TASK, STEP_CACHE) streams steps planned at 100% feed, a change is
+ * refused with EMC_R_ERROR until the run ends.
+ */
+enum EMC_RESULT dsp_feed_override(struct emc_session *ps, double scale)
+{
+   enum EMC_RESULT stat=EMC_R_ERROR;
+
+   if (scale <= 0.0 || scale > MAX_FEED_OVERRIDE)
+   {
+      BUG("invalid feed override=%0.3f, expected 0-%0.1f\n", scale, MAX_FEED_OVERRIDE);
+      goto bugout;
+   }
+   if (ps->replaying && scale != ps->feed_override)
+   {
+      BUG("feed override not available while running from the step stream cache\n");
+      goto bugout;
+   }
+
+   DBG("dsp_feed_override() scale=%0.3f\n", scale);
+   pthread_mutex_lock(&ps->io_mutex);
+   if (scale != ps->feed_override)
+   {
+      ps->feed_override = scale;
+      ps->replan = 1;
+      pthread_cond_broadcast(&ps->write_done_cond);
+   }
+   pthread_mutex_unlock(&ps->io_mutex);
+
+   stat = EMC_R_OK;
+bugout:
+   return stat;
+}  /* dsp_feed_override() */
+
+/* 
+ * Feed hold, called from the ui thread while a program runs. Step buffers not yet submitted to the dongle are
+ * cancelled and the planner decelerates to a stop at the move's accel from the last step sent (see _dsp_rewind()),
+ * so the stop begins once the in-flight transfers finish. Sent steps are kept so position and home are not lost,
+ * dsp_feed_resume() continues from the stop. A hold only applies to the current run, dsp_auto() and dsp_mdi() clear
+ * it. The cached steps of a program run from the step stream cache can not be decelerated, a hold is refused with
+ * EMC_R_ERROR once they stream (use ESTOP).
+ */
+enum EMC_RESULT dsp_feed_hold(struct emc_session *ps)
+{
+   enum EMC_RESULT stat=EMC_R_ERROR;
+
+   MSG("User feed hold...\n");
+   pthread_mutex_lock(&ps->io_mutex);
+   if (ps->replaying)
+   {
+      BUG("feed hold not available while running from the step stream cache\n");
+      goto bugout;
+   }
+   if (!ps->feed_hold)
+   {
+      ps->feed_hold = 1;
+      ps->replan = 1;
+   }
+   pthread_cond_broadcast(&ps->write_done_cond);
+   stat = EMC_R_OK;
+bugout:
+   pthread_mutex_unlock(&ps->io_mutex);
+   return stat;
+}  /* dsp_feed_hold() */
+
+enum EMC_RESULT dsp_feed_resume(struct emc_session *ps)
+{
+   MSG("User feed resume...\n");
+   pthread_mutex_lock(&ps->io_mutex);
+   ps->feed_hold = 0;
+   pthread_cond_broadcast(&ps->write_done_cond);
+   pthread_mutex_unlock(&ps->io_mutex);
+   return EMC_R_OK;
+}  /* dsp_feed_resume() */
+
 enum EMC_RESULT dsp_estop(struct emc_session *ps)
 {
    rtstepper_estop(ps, RTSTEPPER_MECH_THREAD);
@@ -514,7 +1399,9 @@ enum EMC_RESULT dsp_estop_reset(struct emc_session *ps)
    enum EMC_RESULT stat;
 
    MSG("User estop_reset...\n");
-   ps->state_bits &= ~(EMC_STATE_ESTOP_BIT | EMC_STATE_PAUSED_BIT);
+   ps->state_bits &= ~(EMC_STATE_ESTOP_BIT | EMC_STATE_PAUSED_BIT | EMC_STATE_HOLD_BIT);
+   ps->feed_hold = 0;
+   ps->replan = 0;
    reset_screw_comp(ps);
    rtstepper_close(ps);
    if ((stat = rtstepper_open(ps)) != EMC_R_OK)
@@ -524,6 +1411,11 @@ enum EMC_RESULT dsp_estop_reset(struct emc_session *ps)
 
 enum EMC_RESULT dsp_home(struct emc_session *ps)
 {
+   Interp &interp = _dsp_bind(ps);
+
+   if (_dsp_claim(ps, "dsp_home()") != EMC_R_OK)
+      return EMC_R_ERROR;
+
    /* Set origin. */
    ps->position.tran.x = 0.0;
    ps->position.tran.y = 0.0;
@@ -539,7 +1431,8 @@ enum EMC_RESULT dsp_home(struct emc_session *ps)
    rtstepper_home(ps);
    reset_screw_comp(ps);
    ps->state_bits |= EMC_STATE_HOMED_BIT;
-   emc_post_position_cb(0, ps->position);
+   emc_post_position_cb(ps, 0, ps->position);
+   _dsp_release(ps);
    return EMC_R_OK;
 }  /* dsp_estop_reset() */
 
@@ -587,19 +1480,73 @@ bugout:
 
 enum EMC_RESULT dsp_wait_io_done(struct emc_session *ps)
 {
-   return rtstepper_wait_xfr(ps);
+   /* A feed hold while waiting replans the steps not sent yet. */
+   while (rtstepper_wait_xfr_replan(ps) == EMC_R_OK && ps->replan && (ps->state_bits & EMC_STATE_ESTOP_BIT) == 0)
+      dsp_flush(ps);
+   return EMC_R_OK;
 }
 
+/* Run all moves queued for look-ahead to the end and dispatch their step buffers. */
+enum EMC_RESULT dsp_flush(struct emc_session *ps)
+{
+   struct rtstepper_io_req *io;
+
+   if (tpIsDone(&ps->tp_queue) && !ps->replan)
+      return EMC_R_OK;
+
+   io = rtstepper_alloc_io_req(ps, tpGetNextId(&ps->tp_queue) - 1);
+   io = _run_tp(ps, io, 1);
+   if (io == NULL)
+      return EMC_R_OK;   /* no usb dongle or ESTOP */
+   if (_dsp_start_xfr(ps, io) != EMC_R_OK)
+      return EMC_R_ERROR;
+   return EMC_R_OK;
+}  /* dsp_flush() */
+
+/* Dwell, wait for any current IO to finish then sleep until the delay is done or ESTOP. */
+enum EMC_RESULT dsp_delay(struct emc_session *ps, double delay)
+{
+   double step;
+
+   dsp_wait_io_done(ps);
+
+   step = 1.0;
+   while (step > delay)
+   {
+      if (ps->state_bits & EMC_STATE_ESTOP_BIT)
+         break;
+      esleep(step);
+      delay -= step;
+   }
+   if (delay > 0.0)
+      esleep(delay);
+   return EMC_R_OK;
+}  /* dsp_delay() */
+
 enum EMC_RESULT dsp_open(struct emc_session *ps)
 {
    enum EMC_RESULT stat = EMC_R_ERROR;
+   Interp *interp;
    int r;
 
    DBG("dsp_open()\n");
 
+   if ((ps->dsp = new (std::nothrow) emc_dispatch()) == NULL || emc_canon_open(ps) != EMC_R_OK)
+   {
+      BUG("dsp_open() unable to malloc interpreter\n");
+      goto bugout;
+   }
+   ps->dsp->log = new (std::nothrow) dsp_move[ps->tc_queue_size];
+   if ((ps->dsp->snap = new (std::nothrow) dsp_snap[ps->pool.count]) == NULL || ps->dsp->log == NULL)
+   {
+      BUG("dsp_open() unable to malloc feed hold snapshots count=%d\n", ps->pool.count);
+      goto bugout;
+   }
+   interp = &_dsp_bind(ps);
+
    /* Initialize gcode interpreter. */
-   interp.ini_load(ps->ini_file);
-   r = interp.init();   /* clears interp.file() */
+   interp->ini_load(ps->ini_file);
+   r = interp->init();   /* clears interp->file() */
    if (r > INTERP_MIN_ERROR)
    {
       BUG("dsp_open() interpreter error: %d\n", r);
@@ -607,7 +1554,12 @@ enum EMC_RESULT dsp_open(struct emc_session *ps)
    }
 
    /* Initialize trajectory planner. */
-   if (tpCreate(&ps->tp_queue, DEFAULT_TC_QUEUE_SIZE, ps->tc_queue) == -1)
+   if ((ps->tc_queue = new (std::nothrow) TC_STRUCT[ps->tc_queue_size]) == NULL)
+   {
+      BUG("dsp_open() unable to malloc motion queue size=%d\n", ps->tc_queue_size);
+      goto bugout;
+   }
+   if (tpCreate(&ps->tp_queue, ps->tc_queue_size, ps->tc_queue) == -1)
    {
       BUG("dsp_open() unabled to initialize trajectory planner\n");
       goto bugout;
@@ -615,6 +1567,8 @@ enum EMC_RESULT dsp_open(struct emc_session *ps)
    tpSetCycleTime(&ps->tp_queue, ps->cycle_time);
    tpSetPos(&ps->tp_queue, ps->position);
    tpSetVlimit(&ps->tp_queue, ps->maxVelocity);
+   tpSetJunctionDeviation(&ps->tp_queue, ps->junctionDeviation);
+   ps->feed_override = ps->feed_scale = 1.0;
 
    stat = EMC_R_OK;
 bugout:
@@ -624,7 +1578,17 @@ bugout:
 enum EMC_RESULT dsp_close(struct emc_session *ps)
 {
    DBG("dsp_close()\n");
-   interp.exit();
+   if (ps->dsp != NULL)
+   {
+      _dsp_bind(ps).exit();
+      delete[] ps->dsp->snap;
+      delete[] ps->dsp->log;
+      delete ps->dsp;
+      ps->dsp = NULL;
+   }
+   emc_canon_close(ps);
    tpDelete(&ps->tp_queue);
+   delete[] ps->tc_queue;
+   ps->tc_queue = NULL;
    return EMC_R_OK;
 }  /* dsp_close() */
@@ -80,6 +80,7 @@ struct emc_axis
    double backlash;             /* amount of backlash */
    double max_acceleration;     /* upper limit of joint accel */
    double max_velocity;         /* upper limit of joint speed */
+   double max_jerk;             /* upper limit of joint jerk, 0 = unlimited */
 
    /* Used in leadscrew compensation calculation. */
    double backlash_corr;        /* backlash correction */
@@ -93,11 +94,15 @@ struct emc_axis
    int direction_pin;           /* DB25 pin number */
    int step_active_high;       /* DB25 pin polarity */
    int direction_active_high;  /* DB25 pin polarity */
+   int dongle;                 /* dongle index for the DB25 pins, SERIAL_NUMBER list order */
    double steps_per_unit;      /* INPUT_SCALE */
 
    /* Used in rtstpper_encode(). */
+   unsigned char step_mask;       /* DB25 step pin bit, 0 = unused axis */
+   unsigned char direction_mask;  /* DB25 direction pin bit */
    int master_index;   /* running position in step counts */
-   int clk_tail;       /* used calculate number cycles between pulses */
+   int64_t dda_pos;    /* commanded position in fixed point steps, see RTSTEPPER_DDA_SHIFT */
+   int pulse_left;     /* step pulse bytes left, including the trailing inactive byte */
    int direction;      /* cycle time step direction */
 };
 
@@ -108,7 +113,7 @@ struct emc_axis
  * +---------------------------------------v---------------------------------------+
  * | 31 | 30 | 29 | 28 | 27 | 26 | 25 | 24 | 23 | 22 | 21 | 20 | 19 | 18 | 17 | 16 |
  * ----------------------------------------^---------------------------------------+
- * |    |    |    |    |    |    |    |    |    |    |    |    |VERF|HOME|PAUS|ESTP|
+ * |    |    |    |    |    |    |    |    |    |    |    |HOLD|VERF|HOME|PAUS|ESTP|
  * +---------------------------------------v---------------------------------------+
  * | 15 | 14 | 13 | 12 | 11 | 10 |  9 |  8 |  7 |  6 |  5 |  4 |  3 |  2 |  1 |  0 |
  * ----------------------------------------^---------------------------------------+
@@ -120,6 +125,7 @@ struct emc_axis
  *   PAUS = PROGRAM_PAUSED (1=True, 0=False)
  *   HOME = HOMED (1=True, 0=False)
  *   VERF = VERIFY (1=True, 0=False)
+ *   HOLD = FEED_HOLD, motion stopped by emc_ui_feed_hold() (1=True, 0=False)
  *   ABRT = RTSTEPPER_ABORT (1=True, 0=False)
  *   EMPT = RTSTEPPER_EMPTY (1=True, 0=False)
  *   STAL = RTSTEPPER_STALL (1=True, 0=False)
@@ -132,34 +138,107 @@ struct emc_axis
 #define EMC_STATE_PAUSED_BIT 0x020000
 #define EMC_STATE_HOMED_BIT 0x040000
 #define EMC_STATE_VERIFY_BIT 0x080000
+#define EMC_STATE_HOLD_BIT 0x100000
 
-/* size of motion queue, a TC_STRUCT is about 512 bytes so this queue is about a megabyte.  */
+struct post_position_py;
+typedef void *(*logger_cb_t) (const char *msg);
+typedef void *(*post_position_cb_t) (int cmd, struct post_position_py *pospy);
+typedef void *(*post_event_cb_t) (int cmd);
+typedef void *(*plugin_cb_t) (int mcode, double p_number, double q_number);
+typedef void *(*post_input_cb_t) (int input_num, int state);
+
+/* Per-session state private to emccanon.cc and dispatch.cc. */
+struct emc_canon;
+struct emc_dispatch;
+
+/* default size of motion queue (ini: TRAJ, TC_QUEUE_SIZE), a TC_STRUCT is about 700 bytes so this queue is about
+   1.4 megabytes. It must hold more than DEFAULT_TP_LOOKAHEAD moves
+   plus a line and its G64 P blend arc. */
 #define DEFAULT_TC_QUEUE_SIZE 2000
 
+/* longest SERVO_PERIOD in microseconds, waypoints are interpolated linearly between planner cycles */
+#define MAX_SERVO_PERIOD 10000
+
+/* largest feed override scale, see emc_ui_feed_override() */
+#define MAX_FEED_OVERRIDE 2.0
+
+/* moves kept queued ahead of the active one, so junction planning sees enough path to stop in */
+#define DEFAULT_TP_LOOKAHEAD 32
+
+/* Program runtime estimate, see emc_ui_estimate(). Times are in seconds. */
+struct emc_estimate
+{
+   double total;                   /* motion plus dwell, M0/M1 pauses and mcode plugins are not timed */
+   double below_feed;              /* motion below the programmed feed, accel, decel, corners and velocity limits */
+   double dwell;                   /* G4 */
+   double tool[CANON_POCKETS_MAX]; /* total per tool slot, by M6, slot 0 until the first tool change */
+   int lines;                      /* gcode lines read */
+};
+
 struct emc_session
 {
    char ini_file[LINELEN];
+   char home_dir[LINELEN];         /* user home directory, tool table path */
    uint32_t state_bits;
-   uint32_t old_state_bits;
+   uint32_t old_state_bits;        /* INPUTn latched high since rtstepper_clear_abort(), updated atomically */
+
+   /* gui callbacks, latched from the registered callbacks at emc_ui_open() */
+   post_event_cb_t post_event_cb;
+   post_position_cb_t post_position_cb;
+   plugin_cb_t plugin_cb;
+   post_input_cb_t post_input_cb;
 
    /* interpreter */
+   struct emc_dispatch *dsp;       /* interpreter instance and its canon message list */
+   struct emc_canon *canon;        /* canon origin, units, feed rate, etc */
    FILE *gfile;                    /* gcode file */
    int line_number;                /* saved during program pause */
 
    /* trajectory planner */
-   double cycle_time;              /* waypoint period in seconds */
+   double cycle_time;              /* waypoint (servo) period in seconds */
    double cycle_freq;              /* 1 / cycle_time */
+   int servo_steps;                /* step cycles interpolated per waypoint (ini: TRAJ, SERVO_PERIOD) */
    TP_STRUCT tp_queue;             /* trajectory planner based on TC elements */
-   TC_STRUCT tc_queue[DEFAULT_TC_QUEUE_SIZE + 10]; /* discriminate-based trajectory planning */
+   TC_STRUCT *tc_queue;            /* discriminate-based trajectory planning, tc_queue_size elements */
+   int tc_queue_size;              /* ini: TRAJ, TC_QUEUE_SIZE */
+   volatile double feed_override;  /* feed override scale requested by the ui, see emc_ui_feed_override() */
+   double feed_scale;              /* feed override scale applied to the planner */
+   int feed_overridden;            /* feed override or feed hold since the program started, its steps are not cached */
+   volatile int feed_hold;         /* feed hold requested by the ui, see emc_ui_feed_hold() */
+   volatile int replan;            /* feed override or hold not yet applied, unsent step buffers are replanned */
+   int replaying;                  /* running from the step stream cache, feed override and hold are refused */
 
    /* rtstepper dongle */
+   pthread_mutex_t io_mutex;       /* io queue lock, shared by the ui, usb event and emulator threads */
+   pthread_cond_t write_done_cond; /* io queue drained or below low water, feed hold, resume or ESTOP */
+   pthread_cond_t event_done_cond; /* event_thread exited */
+   pthread_mutex_t cap_mutex;      /* step stream capture lock */
    int req_cnt;                 /* number of queued usb io requests */
+   int64_t queue_us;            /* queued step data in microseconds of motion */
+   int64_t queue_high_us;       /* hysteresis high water mark in us (ini: TASK, QUEUE_HIGH_WATER in ms) */
+   int64_t queue_low_us;        /* hysteresis low water mark in us (ini: TASK, QUEUE_LOW_WATER in ms) */
+   int64_t override_latency_us; /* in-flight motion limit in us for feed override and hold, 0 = off (ini: TASK, OVERRIDE_LATENCY in ms) */
+   struct rtstepper_io_stats io_stats;
+   int io_running;              /* gcode program is running, io queue underruns are counted */
+   uint64_t io_idle_us;         /* time the io queue ran empty while running, 0 = not empty */
+   int xfr_cnt;                 /* number of submitted (in-flight) usb io requests */
+   int xfr_depth;               /* maximum in-flight usb io requests (ini: TASK, XFR_DEPTH) */
+   struct rtstepper_io_pool pool;  /* preallocated io requests and step buffers */
+   int step_pulse_width;        /* step pulse width in step buffer bytes (ini: TASK, STEP_PULSE_WIDTH) */
+   unsigned char polarity_mask[RTSTEPPER_DONGLE_MAX];  /* DB25 low true step/direction pins per dongle, applied to each step buffer before dispatch */
+   int encode_axis[EMC_MAX_AXIS];  /* axes with DB25 pins assigned */
+   int encode_axes;             /* number of entries in encode_axis */
    struct rtstepper_io_req head;
-   struct rtstepper_file_descriptor fd_table;
-   char serial_num[64];         /* dongle usb serial number */
+   struct rtstepper_file_descriptor fd_table[RTSTEPPER_DONGLE_MAX];  /* one per dongle, fd_table[0] reports INPUTn */
+   int dongles;                 /* number of dongles, axes are spread across them (ini: AXIS_n, DONGLE) */
+   char serial_num[RTSTEPPER_DONGLE_MAX][64];  /* dongle usb serial numbers (ini: TASK, SERIAL_NUMBER) */
+   int emulate;                 /* 0=usb dongle, 1=emulator realtime, 2=emulator turbo */
    int input0_abort_enabled;    /* 0=false, 1=true */
    int input1_abort_enabled;    /* 0=false, 1=true */
    int input2_abort_enabled;    /* 0=false, 1=true */
+   int status_interval;         /* dongle status query interval in ms (ini: TASK, STATUS_INTERVAL) */
+   struct rtstepper_capture *capture;  /* step stream capture file, NULL if not capturing */
+   char step_cache[LINELEN];    /* step stream cache directory, empty = no cache (ini: TASK, STEP_CACHE) */
 
    /* task */
    int programUnits;            // CANON_UNITS_INCHES,MM,CM
@@ -172,6 +251,7 @@ struct emc_session
    EmcPose position;            // current commanded position
    double maxVelocity;          // max system velocity
    double maxAcceleration;      // max system acceleration
+   double junctionDeviation;    // corner deviation for junction velocity planning, 0 = off (ini: TRAJ, JUNCTION_DEVIATION)
 
    /* io */
    struct CANON_TOOL_TABLE toolTable[CANON_POCKETS_MAX];
@@ -277,7 +357,7 @@ typedef struct _emc_traj_linear_move_msg_t
    emc_msg_t msg;
    enum EMC_MOTION_TYPE type;
    EmcPose end;                 // end point
-   double vel, ini_maxvel, acc;
+   double vel, ini_maxvel, acc, jerk;
    int feed_mode;
 } emc_traj_linear_move_msg_t;
 
@@ -296,7 +376,7 @@ typedef struct _emc_traj_circular_move_msg_t
    PmCartesian normal;
    int turn;
    int type;
-   double vel, ini_maxvel, acc;
+   double vel, ini_maxvel, acc, jerk;
    int feed_mode;
 } emc_traj_circular_move_msg_t;
 
@@ -330,15 +410,6 @@ typedef struct _emc_command_msg_t
    };
 } emc_command_msg_t;
 
-struct post_position_py;
-typedef void *(*logger_cb_t) (const char *msg);
-typedef void *(*post_position_cb_t) (int cmd, struct post_position_py *pospy);
-typedef void *(*post_event_cb_t) (int cmd);
-typedef void *(*plugin_cb_t) (int mcode, double p_number, double q_number);
-
-extern char USER_HOME_DIR[];
-extern struct emc_session session;
-
 /* Forward declarations. */
 struct emcpose_py;
 
@@ -346,12 +417,16 @@ struct emcpose_py;
 extern "C"
 {
 #endif
+   /* Session bound to the calling thread, for code without a session parameter (interpreter, canon, ini). */
+   extern __thread struct emc_session *current_session;
+
    void esleep(double seconds);
    enum EMC_RESULT emc_logger_cb(const char *fmt, ...);
-   enum EMC_RESULT emc_plugin_cb(int mcode, double p_number, double q_number);
-   enum EMC_RESULT emc_post_position_cb(int id, EmcPose pos);
+   enum EMC_RESULT emc_plugin_cb(struct emc_session *ps, int mcode, double p_number, double q_number);
+   enum EMC_RESULT emc_post_position_cb(struct emc_session *ps, int id, EmcPose pos);
    enum EMC_RESULT emc_post_estop_cb(struct emc_session *ps);
    enum EMC_RESULT emc_post_paused_cb(struct emc_session *ps);
+   enum EMC_RESULT emc_post_input_cb(struct emc_session *ps, int input_num, int state);
    DLL_EXPORT void *emc_ui_open(const char *home, const char *ini_file);
    DLL_EXPORT enum EMC_RESULT emc_ui_close(void *hd);
    DLL_EXPORT enum EMC_RESULT emc_ui_estop(void *hd);
@@ -360,6 +435,7 @@ extern "C"
    DLL_EXPORT enum EMC_RESULT emc_ui_register_gui_event_cb(post_event_cb_t fp);
    DLL_EXPORT enum EMC_RESULT emc_ui_register_position_cb(post_position_cb_t fp);
    DLL_EXPORT enum EMC_RESULT emc_ui_register_plugin_cb(plugin_cb_t fp);
+   DLL_EXPORT enum EMC_RESULT emc_ui_register_input_cb(post_input_cb_t fp);
    DLL_EXPORT enum EMC_RESULT emc_ui_wait_io_done(void *hd);
    DLL_EXPORT enum EMC_RESULT emc_ui_home(void *hd);
    DLL_EXPORT enum EMC_RESULT emc_ui_get_version(const char **ver);
@@ -370,7 +446,20 @@ extern "C"
    DLL_EXPORT enum EMC_RESULT emc_ui_disable_din_abort(void *hd, int input_num);
    DLL_EXPORT enum EMC_RESULT emc_ui_verify_cmd(void *hd, const char *gcode_file);
    DLL_EXPORT enum EMC_RESULT emc_ui_verify_cancel(void *hd);
+   DLL_EXPORT enum EMC_RESULT emc_ui_estimate(void *hd, const char *gcode_file, struct emc_estimate *est, double *line_time, int line_cnt);
    DLL_EXPORT enum EMC_RESULT emc_ui_test(const char *snum);
+   DLL_EXPORT enum EMC_RESULT emc_ui_capture_start(void *hd, const char *capture_file);
+   DLL_EXPORT enum EMC_RESULT emc_ui_capture_stop(void *hd);
+   DLL_EXPORT enum EMC_RESULT emc_ui_replay(void *hd, const char *capture_file, const char *sink);
+   DLL_EXPORT enum EMC_RESULT emc_ui_get_io_stats(void *hd, struct rtstepper_io_stats *stats);
+   DLL_EXPORT enum EMC_RESULT emc_ui_feed_override(void *hd, double scale);
+   DLL_EXPORT enum EMC_RESULT emc_ui_feed_hold(void *hd);
+   DLL_EXPORT enum EMC_RESULT emc_ui_feed_resume(void *hd);
+
+   enum EMC_RESULT emc_canon_open(struct emc_session *ps);
+   enum EMC_RESULT emc_canon_close(struct emc_session *ps);
+   struct emc_canon *emc_canon_scratch(struct emc_session *ps);
+   void emc_canon_restore(struct emc_session *ps, struct emc_canon *saved);
 
    enum EMC_RESULT dsp_open(struct emc_session *ps);
    enum EMC_RESULT dsp_close(struct emc_session *ps);
@@ -379,11 +468,17 @@ extern "C"
    enum EMC_RESULT dsp_estop(struct emc_session *ps);
    enum EMC_RESULT dsp_estop_reset(struct emc_session *ps);
    enum EMC_RESULT dsp_wait_io_done(struct emc_session *ps);
+   enum EMC_RESULT dsp_flush(struct emc_session *ps);
+   enum EMC_RESULT dsp_delay(struct emc_session *ps, double delay);
    enum EMC_RESULT dsp_home(struct emc_session *ps);
    enum EMC_RESULT dsp_enable_din_abort(struct emc_session *ps, int num);
    enum EMC_RESULT dsp_disable_din_abort(struct emc_session *ps, int num);
    enum EMC_RESULT dsp_verify(struct emc_session *ps, const char *gcodefile);
    enum EMC_RESULT dsp_verify_cancel(struct emc_session *ps);
+   enum EMC_RESULT dsp_estimate(struct emc_session *ps, const char *gcodefile, struct emc_estimate *est, double *line_time, int line_cnt);
+   enum EMC_RESULT dsp_feed_override(struct emc_session *ps, double scale);
+   enum EMC_RESULT dsp_feed_hold(struct emc_session *ps);
+   enum EMC_RESULT dsp_feed_resume(struct emc_session *ps);
    const char *lookup_task_interp_state(int type);
    const char *lookup_message(int type);
    void compute_screw_comp(struct emc_session *ps);
@@ -44,17 +44,61 @@
 #include "interpl.h"    // interp_list
 #include "bug.h"
 
+#include <vector>
+#include <new>
+
+struct pt
+{
+   double x, y, z, a, b, c, u, v, w;
+   int line_no;
+};
+
 /* 
- * There are a lot of ugly globals in emccanon.cc. They should all be moved 
- * into a session object. The session object should be passed in as pointer input
- * parameter. DES 12/26/2014 
+ * Canon state, one per session. It is allocated by emc_canon_open() and reached through current_session,
+ * the macros below keep the original global names so the canon functions read as before.
  */
+struct emc_canon
+{
+   double css_maximum;
+   double xy_rotation;
+   PM_QUATERNION quat;
+   CANON_POSITION programOrigin;
+   CANON_UNITS lengthUnits;
+   CANON_PLANE activePlane;
+   int canonFeedMode;
+   int synched;
+   EmcPose currentToolOffset;
+   CANON_POSITION canonEndPoint;
+   CANON_MOTION_MODE canonMotionMode;
+   double canonMotionTolerance;
+   double canonNaivecamTolerance;
+   double spindleSpeed;
+   int preppedTool;
+   bool optional_program_stop;
+   bool block_delete;
+   double currentLinearFeedRate;
+   double currentAngularFeedRate;
+   int cartesian_move;
+   int angular_move;
+   std::vector < struct pt >chained_points;   /* naive cam detector segments */
+
+   emc_canon() : css_maximum(0.0), xy_rotation(0.0), quat(1, 0, 0, 0),
+      programOrigin(0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0), lengthUnits(CANON_UNITS_MM), activePlane(CANON_PLANE_XY),
+      canonFeedMode(0), synched(0), currentToolOffset(), canonEndPoint(0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0),
+      canonMotionMode(0), canonMotionTolerance(0.0), canonNaivecamTolerance(0.0), spindleSpeed(0.0), preppedTool(0),
+      optional_program_stop(ON), block_delete(ON), currentLinearFeedRate(0.0), currentAngularFeedRate(0.0),
+      cartesian_move(0), angular_move(0)
+   {
+   }
+};
+
+#define CANON (current_session->canon)
 
 static int debug_velacc = 0;
-static double css_maximum;
+#define css_maximum (CANON->css_maximum)
 
 static const double tiny = 1e-7;
-static double xy_rotation = 0.;
+#define xy_rotation (CANON->xy_rotation)
 
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
@@ -106,7 +150,7 @@ static double xy_rotation = 0.;
 
 #define AXIS_PERIOD(axisnum) (IS_PERIODIC(axisnum) ? 360 : 0)
 
-static PM_QUATERNION quat(1, 0, 0, 0);
+#define quat (CANON->quat)
 
 static void flush_segments(void);
 
@@ -122,15 +166,15 @@ static void flush_segments(void);
   Units are then converted from mm to external units, as reported by
   the GET_EXTERNAL_LENGTH_UNITS() function.
   */
-static CANON_POSITION programOrigin(0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0);
-static CANON_UNITS lengthUnits = CANON_UNITS_MM;
-static CANON_PLANE activePlane = CANON_PLANE_XY;
+#define programOrigin (CANON->programOrigin)
+#define lengthUnits (CANON->lengthUnits)
+#define activePlane (CANON->activePlane)
 
-static int feed_mode = 0;
-static int synched = 0;
+#define canonFeedMode (CANON->canonFeedMode)
+#define synched (CANON->synched)
 
 /* Tool length offset is saved here */
-static EmcPose currentToolOffset;
+#define currentToolOffset (CANON->currentToolOffset)
 
 static double offset_x(double x)
 {
@@ -323,7 +367,7 @@ static void to_prog(CANON_POSITION & e)
 
 static int axis_valid(int n)
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    return ps->axes_mask & (1 << n);
 }
 
@@ -336,7 +380,7 @@ static int axis_valid(int n)
   retrieves the xyz position after the last of the queued segments.  these
   are also in absolute frame, mm units.
   */
-static CANON_POSITION canonEndPoint;
+#define canonEndPoint (CANON->canonEndPoint)
 static void canonUpdateEndPoint(double x, double y, double z, double a, double b, double c, double u, double v, double w)
 {
    canonEndPoint.x = x;
@@ -363,41 +407,41 @@ void CANON_UPDATE_END_POINT(double x, double y, double z, double a, double b, do
 
 /* motion control mode is used to signify blended v. stop-at-end moves.
    Set to 0 (invalid) at start, so first call will send command out */
-static CANON_MOTION_MODE canonMotionMode = 0;
+#define canonMotionMode (CANON->canonMotionMode)
 
 /* motion path-following tolerance is used to set the max path-following
    deviation during CANON_CONTINUOUS.
    If this param is 0, then it will behave as emc always did, allowing
    almost any deviation trying to keep speed up. */
-static double canonMotionTolerance = 0.0;
+#define canonMotionTolerance (CANON->canonMotionTolerance)
 
-static double canonNaivecamTolerance = 0.0;
+#define canonNaivecamTolerance (CANON->canonNaivecamTolerance)
 
 /* Spindle speed is saved here */
-static double spindleSpeed = 0.0;
+#define spindleSpeed (CANON->spindleSpeed)
 
 /* Prepped tool is saved here */
-static int preppedTool = 0;
+#define preppedTool (CANON->preppedTool)
 
 /* optional program stop */
-static bool optional_program_stop = ON; //set enabled by default (previous EMC behaviour)
+#define optional_program_stop (CANON->optional_program_stop)  //set enabled by default (previous EMC behaviour)
 
 /* optional block delete */
-static bool block_delete = ON;  //set enabled by default (previous EMC behaviour)
+#define block_delete (CANON->block_delete)  //set enabled by default (previous EMC behaviour)
 
 /*
   Feed rate is saved here; values are in mm/sec or deg/sec.
   It will be initially set in INIT_CANON() below.
 */
-static double currentLinearFeedRate = 0.0;
-static double currentAngularFeedRate = 0.0;
+#define currentLinearFeedRate (CANON->currentLinearFeedRate)
+#define currentAngularFeedRate (CANON->currentAngularFeedRate)
 
 /* Used to indicate whether the current move is linear, angular, or 
    a combination of both. */
    //AJ says: linear means axes XYZ move (lines or even circles)
    //         angular means axes ABC move
-static int cartesian_move = 0;
-static int angular_move = 0;
+#define cartesian_move (CANON->cartesian_move)
+#define angular_move (CANON->angular_move)
 
 static double toExtVel(double vel)
 {
@@ -424,6 +468,11 @@ static double toExtAcc(double acc)
    return toExtVel(acc);
 }
 
+static double toExtJerk(double jerk)
+{
+   return toExtVel(jerk);
+}
+
 #if 0
 static void send_origin_msg(void)
 {
@@ -497,7 +546,7 @@ void SET_ORIGIN_OFFSETS(double x, double y, double z, double a, double b, double
 
 void USE_LENGTH_UNITS(CANON_UNITS in_unit)
 {
-   struct emc_session *ps = &session; 
+   struct emc_session *ps = current_session; 
    lengthUnits = in_unit;
    ps->programUnits = in_unit;
 }
@@ -511,15 +560,15 @@ void SET_TRAVERSE_RATE(double rate)
 void SET_FEED_MODE(int mode)
 {
    flush_segments();
-   feed_mode = mode;
-   if (feed_mode == 0)
+   canonFeedMode = mode;
+   if (canonFeedMode == 0)
       STOP_SPEED_FEED_SYNCH();
 }
 
 void SET_FEED_RATE(double rate)
 {
 
-   if (feed_mode)
+   if (canonFeedMode)
    {
       START_SPEED_FEED_SYNCH(rate, 1);
       currentLinearFeedRate = rate;
@@ -548,7 +597,7 @@ void SET_FEED_REFERENCE(CANON_FEED_REFERENCE reference)
 
 double getStraightAcceleration(double x, double y, double z, double a, double b, double c, double u, double v, double w)
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    double dx, dy, dz, du, dv, dw, da, db, dc;
    double tx, ty, tz, tu, tv, tw, ta, tb, tc, tmax;
    double acc, dtot;
@@ -678,9 +727,73 @@ double getStraightAcceleration(double x, double y, double z, double a, double b,
    return acc;
 }
 
+/* Path jerk that keeps each moving axis within its MAX_JERK, same scaling as getStraightAcceleration(). 0 = no jerk limit. */
+double getStraightJerk(double x, double y, double z, double a, double b, double c, double u, double v, double w)
+{
+   struct emc_session *ps = current_session;
+   double d[9], j, t, tmax, dtot;
+   int i;
+
+   d[0] = fabs(x - canonEndPoint.x);
+   d[1] = fabs(y - canonEndPoint.y);
+   d[2] = fabs(z - canonEndPoint.z);
+   d[3] = fabs(a - canonEndPoint.a);
+   d[4] = fabs(b - canonEndPoint.b);
+   d[5] = fabs(c - canonEndPoint.c);
+   d[6] = fabs(u - canonEndPoint.u);
+   d[7] = fabs(v - canonEndPoint.v);
+   d[8] = fabs(w - canonEndPoint.w);
+
+   tmax = 0.0;
+   for (i = 0; i < 9; i++)
+   {
+      if (!axis_valid(i) || d[i] < tiny)
+      {
+         d[i] = 0.0;
+         continue;
+      }
+      if (ps->axis[i].max_jerk <= 0.0)
+         continue;      /* unlimited */
+      j = (i >= 3 && i <= 5) ? FROM_EXT_ANG(ps->axis[i].max_jerk) : FROM_EXT_LEN(ps->axis[i].max_jerk);
+      t = d[i] / j;
+      tmax = MAX(tmax, t);
+   }
+
+   // Path length, angular axes only count for a pure angular move.
+   if (d[0] || d[1] || d[2])
+      dtot = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+   else if (d[6] || d[7] || d[8])
+      dtot = sqrt(d[6] * d[6] + d[7] * d[7] + d[8] * d[8]);
+   else
+      dtot = sqrt(d[3] * d[3] + d[4] * d[4] + d[5] * d[5]);
+
+   if (debug_velacc)
+      printf("getStraightJerk tmax %g dtot %g\n", tmax, dtot);
+   return tmax > 0.0 ? dtot / tmax : 0.0;
+}
+
+/* Arc jerk, the lowest MAX_JERK of the plane axes and the helix axis if it moves. 0 = no jerk limit. */
+static double getArcJerk(int axis1, int axis2, int axial)
+{
+   struct emc_session *ps = current_session;
+   int axes[3] = { axis1, axis2, axial };
+   double j, jerk = 0.0;
+   int i;
+
+   for (i = 0; i < 3; i++)
+   {
+      if (axes[i] < 0 || ps->axis[axes[i]].max_jerk <= 0.0)
+         continue;
+      j = FROM_EXT_LEN(ps->axis[axes[i]].max_jerk);
+      if (jerk <= 0.0 || j < jerk)
+         jerk = j;
+   }
+   return jerk;
+}
+
 double getStraightVelocity(double x, double y, double z, double a, double b, double c, double u, double v, double w)
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    double dx, dy, dz, da, db, dc, du, dv, dw;
    double tx, ty, tz, ta, tb, tc, tu, tv, tw, tmax;
    double vel, dtot;
@@ -824,17 +937,9 @@ double getStraightVelocity(double x, double y, double z, double a, double b, dou
    return vel;
 }
 
-#include <vector>
-struct pt
-{
-   double x, y, z, a, b, c, u, v, w;
-   int line_no;
-};
-
 static std::vector < struct pt >&chained_points(void)
 {
-   static std::vector < struct pt >points;
-   return points;
+   return CANON->chained_points;
 }
 
 static void flush_segments(void)
@@ -883,7 +988,7 @@ static void flush_segments(void)
    }
 
    emc_traj_linear_move_msg_t linearMoveMsg = { {EMC_TRAJ_LINEAR_MOVE_TYPE} };
-   linearMoveMsg.feed_mode = feed_mode;
+   linearMoveMsg.feed_mode = canonFeedMode;
 
    // now x, y, z, and b are in absolute mm or degree units
    linearMoveMsg.end.tran.x = TO_EXT_LEN(x);
@@ -903,6 +1008,7 @@ static void flush_segments(void)
    linearMoveMsg.ini_maxvel = toExtVel(ini_maxvel);
    double acc = getStraightAcceleration(x, y, z, a, b, c, u, v, w);
    linearMoveMsg.acc = toExtAcc(acc);
+   linearMoveMsg.jerk = toExtJerk(getStraightJerk(x, y, z, a, b, c, u, v, w));
 
    linearMoveMsg.type = EMC_MOTION_TYPE_FEED;
    if ((vel && acc) || synched)
@@ -1017,9 +1123,10 @@ void STRAIGHT_TRAVERSE(int line_number, double x, double y, double z, double a,
    linearMoveMsg.end = to_ext_pose(x, y, z, a, b, c, u, v, w);
    linearMoveMsg.vel = linearMoveMsg.ini_maxvel = toExtVel(vel);
    linearMoveMsg.acc = toExtAcc(acc);
+   linearMoveMsg.jerk = toExtJerk(getStraightJerk(x, y, z, a, b, c, u, v, w));
 
-   int old_feed_mode = feed_mode;
-   if (feed_mode)
+   int old_feed_mode = canonFeedMode;
+   if (canonFeedMode)
       STOP_SPEED_FEED_SYNCH();
 
    if (vel && acc)
@@ -1254,13 +1361,13 @@ void ARC_FEED(int line_number,
               double first_end, double second_end,
               double first_axis, double second_axis, int rotation, double axis_end_point, double a, double b, double c, double u, double v, double w)
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    EmcPose end;
 //    PM_CARTESIAN center, normal;
    PmCartesian center, normal;
    emc_traj_circular_move_msg_t circularMoveMsg = { {EMC_TRAJ_CIRCULAR_MOVE_TYPE} };
    emc_traj_linear_move_msg_t linearMoveMsg = { {EMC_TRAJ_LINEAR_MOVE_TYPE} };
-   double v1, v2, a1, a2, vel, ini_maxvel, circ_maxvel, axial_maxvel = 0.0, circ_acc, acc = 0.0;
+   double v1, v2, a1, a2, vel, ini_maxvel, circ_maxvel, axial_maxvel = 0.0, circ_acc, acc = 0.0, jerk = 0.0;
    double radius, angle, theta1, theta2, helical_length, axis_len;
    double tcircle, taxial, tmax, thelix, ta, tb, tc, da, db, dc;
    double tu, tv, tw, du, dv, dw;
@@ -1291,8 +1398,8 @@ void ARC_FEED(int line_number,
    //circ_maxvel = max vel defined by ini constraints in the circle plane (XY, YZ or XZ)
    //axial_maxvel = max vel defined by ini constraints in the axial direction (Z, X or Y)
 
-   linearMoveMsg.feed_mode = feed_mode;
-   circularMoveMsg.feed_mode = feed_mode;
+   linearMoveMsg.feed_mode = canonFeedMode;
+   circularMoveMsg.feed_mode = canonFeedMode;
    flush_segments();
 
    a = FROM_PROG_ANG(a);
@@ -1359,6 +1466,7 @@ void ARC_FEED(int line_number,
          ini_maxvel = MIN(ini_maxvel, v1);
          acc = MIN(acc, a1);
       }
+      jerk = getArcJerk(0, 1, (axis_valid(2) && axis_len > 0.001) ? 2 : -1);
       break;
 
    case CANON_PLANE_YZ:
@@ -1395,6 +1503,7 @@ void ARC_FEED(int line_number,
          ini_maxvel = MIN(ini_maxvel, v1);
          acc = MIN(acc, a1);
       }
+      jerk = getArcJerk(1, 2, (axis_valid(0) && axis_len > 0.001) ? 0 : -1);
 
       break;
 
@@ -1432,6 +1541,7 @@ void ARC_FEED(int line_number,
          ini_maxvel = MIN(ini_maxvel, v1);
          acc = MIN(acc, a1);
       }
+      jerk = getArcJerk(0, 2, (axis_valid(1) && axis_len > 0.001) ? 1 : -1);
       break;
    }
 
@@ -1547,6 +1657,7 @@ void ARC_FEED(int line_number,
       linearMoveMsg.vel = toExtVel(vel);
       linearMoveMsg.ini_maxvel = toExtVel(ini_maxvel);
       linearMoveMsg.acc = toExtAcc(acc);
+      linearMoveMsg.jerk = toExtJerk(jerk);
       if (vel && acc)
       {
          interp_list.set_line_number(line_number);
@@ -1591,6 +1702,7 @@ void ARC_FEED(int line_number,
       circularMoveMsg.vel = toExtVel(vel);
       circularMoveMsg.ini_maxvel = toExtVel(ini_maxvel);
       circularMoveMsg.acc = toExtAcc(acc);
+      circularMoveMsg.jerk = toExtJerk(jerk);
       if (vel && acc)
       {
          interp_list.set_line_number(line_number);
@@ -2020,7 +2132,7 @@ void INIT_CANON()
   */
 CANON_TOOL_TABLE GET_EXTERNAL_TOOL_TABLE(int pocket)
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    CANON_TOOL_TABLE retval;
 
    if (pocket < 0 || pocket >= CANON_POCKETS_MAX)
@@ -2042,7 +2154,7 @@ CANON_TOOL_TABLE GET_EXTERNAL_TOOL_TABLE(int pocket)
 
 CANON_POSITION GET_EXTERNAL_POSITION()
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    CANON_POSITION position;
    EmcPose pos;
 
@@ -2078,7 +2190,7 @@ double GET_EXTERNAL_FEED_RATE()
 // traverse rate wanted is in program units per minute
 double GET_EXTERNAL_TRAVERSE_RATE()
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    double traverse;
 
    // convert from external to program units
@@ -2092,7 +2204,7 @@ double GET_EXTERNAL_TRAVERSE_RATE()
 
 double GET_EXTERNAL_LENGTH_UNITS(void)
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    double u;
 
    u = ps->linearUnits;
@@ -2110,7 +2222,7 @@ double GET_EXTERNAL_LENGTH_UNITS(void)
 
 double GET_EXTERNAL_ANGLE_UNITS(void)
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    double u;
 
    u = ps->angularUnits;
@@ -2294,7 +2406,7 @@ int GET_EXTERNAL_SELECTED_TOOL_SLOT()
 
 int GET_EXTERNAL_AXIS_MASK()
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    return ps->axes_mask;
 }
 
@@ -2379,3 +2491,42 @@ int WAIT(int index, int input_type, int wait_type, double timeout)
 {
    return 0;
 }
+
+/* Allocate canon state for the session, called by dsp_open() before the interpreter is initialized. */
+enum EMC_RESULT emc_canon_open(struct emc_session *ps)
+{
+   if ((ps->canon = new (std::nothrow) emc_canon) == NULL)
+   {
+      BUG("unable to malloc canon state\n");
+      return EMC_R_ERROR;
+   }
+   return EMC_R_OK;
+}  /* emc_canon_open() */
+
+enum EMC_RESULT emc_canon_close(struct emc_session *ps)
+{
+   delete ps->canon;
+   ps->canon = NULL;
+   return EMC_R_OK;
+}  /* emc_canon_close() */
+
+/* Swap in a copy of the session canon state, see dsp_estimate(). Returns the session canon state for emc_canon_restore(). */
+struct emc_canon *emc_canon_scratch(struct emc_session *ps)
+{
+   struct emc_canon *saved = ps->canon;
+
+   if ((ps->canon = new (std::nothrow) emc_canon(*saved)) == NULL)
+   {
+      BUG("unable to malloc scratch canon state\n");
+      ps->canon = saved;
+      return NULL;
+   }
+   return saved;
+}  /* emc_canon_scratch() */
+
+/* Drop the scratch canon state and put back the session canon state. */
+void emc_canon_restore(struct emc_session *ps, struct emc_canon *saved)
+{
+   delete ps->canon;
+   ps->canon = saved;
+}  /* emc_canon_restore() */
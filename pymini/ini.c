@@ -38,7 +38,7 @@ static char *_trim_tail(char *buf)
 /* Get value for specified section and key from the ini file. */
 int iniGetKeyValue(const char *section, const char *key, char *value, int value_size)
 {
-   struct emc_session *ps = &session;
+   struct emc_session *ps = current_session;
    char rcbuf[255];
    char new_section[64];
    FILE *inFile;
@@ -215,7 +215,6 @@ void reset_screw_comp(struct emc_session *ps)
    }
 }
 
-#if 0
 /* Convert EmcPose structure to array. */
 void emcpos2a(double *a, EmcPose pos)
 {
@@ -229,7 +228,6 @@ void emcpos2a(double *a, EmcPose pos)
    a[EMC_AXIS_V] = pos.v;
    a[EMC_AXIS_W] = pos.w;
 }
-#endif
 
 void update_tp_position(struct emc_session *ps, EmcPose pos)
 {
@@ -26,7 +26,7 @@
 # 12/16/2014 - New
 
 import os, sys, logging
-from ctypes import cdll, c_int, c_char_p, c_void_p, c_double, c_long, c_void_p, byref, cast, Structure, POINTER, CFUNCTYPE
+from ctypes import cdll, c_int, c_char_p, c_void_p, c_double, c_long, c_void_p, c_uint32, c_uint64, byref, cast, Structure, POINTER, CFUNCTYPE
 import sys, importlib
 from version import Version 
 
@@ -72,11 +72,42 @@ class EmcPose(Structure):
 class mech_pos(Structure):
    _fields_ = [("id", c_int), ("pos", EmcPose)]
 
+# Following must match RTSTEPPER_HIST_BUCKETS and struct rtstepper_io_stats in rtstepper.h.
+IO_HIST_BUCKETS = 32
+
+class IoStats(Structure):
+   _fields_ = [("xfr_cnt", c_uint64),
+      ("xfr_bytes", c_uint64),
+      ("underrun_cnt", c_uint64),
+      ("underrun_us", c_uint64),
+      ("query_cnt", c_uint64),
+      ("empty_cnt", c_uint64),
+      ("stall_cnt", c_uint64),
+      ("trip_cnt", c_uint32),
+      ("reserved", c_uint32),
+      ("latency_hist", c_uint64 * IO_HIST_BUCKETS),
+      ("queue_hist", c_uint64 * IO_HIST_BUCKETS),
+      ("gap_hist", c_uint64 * IO_HIST_BUCKETS)]
+
+# Following must match CANON_POCKETS_MAX in emctool.h and struct emc_estimate in emc.h.
+CANON_POCKETS_MAX = 56
+
+class Estimate(Structure):
+   _fields_ = [("total", c_double),
+      ("below_feed", c_double),
+      ("dwell", c_double),
+      ("tool", c_double * CANON_POCKETS_MAX),
+      ("lines", c_int)]
+
 # Define dll to python callback functions.
 LOGGER_CB_FUNC = CFUNCTYPE(None, c_char_p)
 POSITION_CB_FUNC = CFUNCTYPE(None, c_int, POINTER(mech_pos))
 PLUGIN_CB_FUNC = CFUNCTYPE(None, c_int, c_double, c_double)
 GUI_EVENT_CB_FUNC = CFUNCTYPE(None, c_int)
+INPUT_CB_FUNC = CFUNCTYPE(None, c_int, c_int)
+
+# Following must match GUI_EVENT in ui.c.
+GUI_EVENT_MECH_INPUT = 7
 
 class EmcMech(object):
 
@@ -122,6 +153,12 @@ class EmcMech(object):
          self._register_gui_event_cb.argtype = [self.cb_gui_event]
          self._register_gui_event_cb.restype = c_int
 
+         # enum EMC_RESULT emc_ui_register_input_cb(void (*fp)(int input_num, int state))
+         self.cb_input = INPUT_CB_FUNC(self.post_input_cb)
+         self._register_input_cb = self.lib.emc_ui_register_input_cb
+         self._register_input_cb.argtype = [self.cb_input]
+         self._register_input_cb.restype = c_int
+
          # enum EMC_RESULT emc_ui_register_position_cb(void (*fp)(int cmd, struct post_position_py *pos))
          self.cb_position = POSITION_CB_FUNC(self.post_position_cb)
          self._register_position_cb = self.lib.emc_ui_register_position_cb
@@ -188,11 +225,51 @@ class EmcMech(object):
          self._verify_cancel.argtypes = [c_void_p]
          self._verify_cancel.restype= c_int
 
+         # enum EMC_RESULT emc_ui_estimate(void *hd, const char *gcodefile, struct emc_estimate *est, double *line_time, int line_cnt)
+         self._estimate = self.lib.emc_ui_estimate
+         self._estimate.argtypes = [c_void_p, c_char_p, POINTER(Estimate), POINTER(c_double), c_int]
+         self._estimate.restype = c_int
+
          # enum EMC_RESULT emc_ui_test(const char *snum)
          self._test = self.lib.emc_ui_test
          self._test.argtypes = [c_char_p]
          self._test.restype = c_int
 
+         # enum EMC_RESULT emc_ui_get_io_stats(void *hd, struct rtstepper_io_stats *stats)
+         self._get_io_stats = self.lib.emc_ui_get_io_stats
+         self._get_io_stats.argtypes = [c_void_p, POINTER(IoStats)]
+         self._get_io_stats.restype = c_int
+
+         # enum EMC_RESULT emc_ui_capture_start(void *hd, const char *capture_file)
+         self._capture_start = self.lib.emc_ui_capture_start
+         self._capture_start.argtypes = [c_void_p, c_char_p]
+         self._capture_start.restype = c_int
+
+         # enum EMC_RESULT emc_ui_capture_stop(void *hd)
+         self._capture_stop = self.lib.emc_ui_capture_stop
+         self._capture_stop.argtypes = [c_void_p]
+         self._capture_stop.restype = c_int
+
+         # enum EMC_RESULT emc_ui_replay(void *hd, const char *capture_file, const char *sink)
+         self._replay = self.lib.emc_ui_replay
+         self._replay.argtypes = [c_void_p, c_char_p, c_char_p]
+         self._replay.restype = c_int
+
+         # enum EMC_RESULT emc_ui_feed_override(void *hd, double scale)
+         self._feed_override = self.lib.emc_ui_feed_override
+         self._feed_override.argtypes = [c_void_p, c_double]
+         self._feed_override.restype = c_int
+
+         # enum EMC_RESULT emc_ui_feed_hold(void *hd)
+         self._feed_hold = self.lib.emc_ui_feed_hold
+         self._feed_hold.argtypes = [c_void_p]
+         self._feed_hold.restype = c_int
+
+         # enum EMC_RESULT emc_ui_feed_resume(void *hd)
+         self._feed_resume = self.lib.emc_ui_feed_resume
+         self._feed_resume.argtypes = [c_void_p]
+         self._feed_resume.restype = c_int
+
       except Exception as err:
          logging.error("unable to load library: %s %s" % (self.LIBRARY_FILE, err))
 
@@ -216,6 +293,15 @@ class EmcMech(object):
          m['id'] = cmd
          self.guiq.put(m)
 
+   ################################################################################################################
+   def post_input_cb(self, input_num, state):
+      if (self.guiq != None):
+         m = {}
+         m['id'] = GUI_EVENT_MECH_INPUT
+         m['input'] = input_num
+         m['state'] = state
+         self.guiq.put(m)
+
    ################################################################################################################
    def post_position_cb(self, cmd, post_p):
       post = post_p[0]
@@ -242,6 +328,25 @@ class EmcMech(object):
    def verify_cancel(self):
       return self._verify_cancel(self.hd)
 
+   #############################################################################################################
+   def estimate(self, gcodefile, range_lines=0):
+      # Program run time in seconds without running it. With range_lines the time of each range_lines gcode lines is
+      # returned in 'ranges' as (first_line, last_line, seconds). Interpreter state is left as it was, it returns an
+      # error while a program, MDI command, verify or home runs.
+      e = Estimate()
+      line_time, line_cnt = None, 0
+      if range_lines > 0:
+         with open(gcodefile, 'rb') as f:
+            line_cnt = sum(1 for line in f)
+         line_time = (c_double * max(line_cnt, 1))()
+      stat = self._estimate(self.hd, gcodefile.encode('ascii'), byref(e), line_time, line_cnt)
+      est = {'result':stat, 'total':e.total, 'below_feed':e.below_feed, 'dwell':e.dwell, 'lines':e.lines,
+             'tools':dict((slot, t) for slot, t in enumerate(e.tool) if t > 0.0)}
+      if range_lines > 0:
+         est['ranges'] = [(i + 1, min(i + range_lines, line_cnt), sum(line_time[i:i + range_lines]))
+                          for i in range(0, line_cnt, range_lines)]
+      return est
+
    #############################################################################################################
    def wait_io_done(self):
       return self._wait_io_done(self.hd)
@@ -283,6 +388,44 @@ class EmcMech(object):
    def test(self, snum):
       return self._test(snum.encode('ascii'))
 
+   #############################################################################################################
+   def get_io_stats(self):
+      # Histogram bucket 0 = 0us, bucket n = [2^(n-1), 2^n) us.
+      s = IoStats()
+      self._get_io_stats(self.hd, byref(s))
+      stats = {'xfr_cnt':s.xfr_cnt, 'xfr_bytes':s.xfr_bytes, 'underrun_cnt':s.underrun_cnt, 'underrun_us':s.underrun_us,
+               'query_cnt':s.query_cnt, 'empty_cnt':s.empty_cnt, 'stall_cnt':s.stall_cnt, 'trip_cnt':s.trip_cnt,
+               'latency_hist':list(s.latency_hist), 'queue_hist':list(s.queue_hist), 'gap_hist':list(s.gap_hist)}
+      return stats
+
+   #############################################################################################################
+   def capture_start(self, capture_file):
+      return self._capture_start(self.hd, capture_file.encode('ascii'))
+
+   #############################################################################################################
+   def capture_stop(self):
+      return self._capture_stop(self.hd)
+
+   #############################################################################################################
+   def replay(self, capture_file, sink="dongle"):
+      return self._replay(self.hd, capture_file.encode('ascii'), sink.encode('ascii'))
+
+   #############################################################################################################
+   def feed_override(self, scale):
+      # Scale the programmed feed rate, 1.0 = 100%. Safe to call from the gui thread while a program runs.
+      # Returns an error while a program runs from the step stream cache (ini: TASK, STEP_CACHE).
+      return self._feed_override(self.hd, scale)
+
+   #############################################################################################################
+   def feed_hold(self):
+      # Decelerate to a stop inside the current move, home and position are kept. Safe to call from the gui thread.
+      # Returns an error while a program runs from the step stream cache (ini: TASK, STEP_CACHE).
+      return self._feed_hold(self.hd)
+
+   #############################################################################################################
+   def feed_resume(self):
+      return self._feed_resume(self.hd)
+
    #############################################################################################################
    def get_version(self):
       p = c_void_p()
@@ -300,6 +443,7 @@ class EmcMech(object):
       self.register_gui_event_cb()
       self.register_position_cb()
       self.register_plugin_cb()
+      self.register_input_cb()
 
    ################################################################################################################
    def register_plugin_cb(self):
@@ -313,6 +457,10 @@ class EmcMech(object):
    def register_position_cb(self):
       return self._register_position_cb(self.cb_position)
 
+   #############################################################################################################
+   def register_input_cb(self):
+      return self._register_input_cb(self.cb_input)
+
    ################################################################################################################
    def open(self, home_dir, ini_file="rtstepper.ini"):
       self.hd = self._open(home_dir.encode('ascii'), ini_file.encode('ascii'))
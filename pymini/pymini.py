@@ -88,6 +88,7 @@ class GuiEvent(object):
    MECH_POSITION = 4
    MECH_ESTOP = 5  # auto estop from mech
    MECH_PAUSED = 6  # M0, M1 or M60 from parser
+   MECH_INPUT = 7  # dongle INPUTn change
 
 class ButtonState(object):
    # estop, home, jog, mdi, run, resume, verify
@@ -288,6 +289,8 @@ class Gui(tkinter.Tk):
             self.set_estop_state()  # auto estop from mech
          elif (e['id'] == GuiEvent.MECH_PAUSED):
             self.set_idle_state(ButtonState.RESUME)  # auto pause from parser
+         elif (e['id'] == GuiEvent.MECH_INPUT):
+            logging.info("INPUT%d=%d\n" % (e['input'], e['state']))
          else:
             logging.info("unable to process gui event %d\n" % (e['id']))
          e = None
@@ -307,10 +307,10 @@ const read_function_pointer Interp::default_readers[256] = {
 // And now indent can continue.
 /****************************************************************************/
 
-/* There are four global variables*. The first three are _gees, _ems,
-and _readers. The last one, declared here, is for interpreter settings */
+/* There are three global variables*. They are _gees, _ems and _readers. 
+Interpreter settings (_setup) are per instance, see Interp::Interp(). */
 
-setup Interp::_setup;
+__thread Interp *Interp::current = 0;
 
 /* The notion of "global variables" is a misnomer - These last four should only
    be accessable by the interpreter and not exported to the rest of emc */
@@ -124,9 +124,6 @@ int Interp::comp_set_programmed(setup_pointer settings, double x, double y, doub
  * Side effects: Generates a nurbs move and updates the position of the tool
  */
 
-static unsigned int nurbs_order;
-static std::vector<CONTROL_POINT> nurbs_control_points;
-
 int Interp::convert_nurbs(int mode,
       block_pointer block,     //!< pointer to a block of RS274 instructions
       setup_pointer settings)  //!< pointer to machine settings
@@ -138,16 +135,16 @@ int Interp::convert_nurbs(int mode,
 	CHKS((((block->x_flag) && !(block->y_flag)) || (!(block->x_flag) && (block->y_flag))), (
              "You must specify both X and Y coordinates for Control Points"));
 	CHKS((!(block->x_flag) && !(block->y_flag) && (block->p_number > 0) && 
-             (!nurbs_control_points.empty())), (
+             (!_nurbs_control_points.empty())), (
              "Can specify P without X and Y only for the first control point"));
 
-        CHKS(((block->p_number <= 0) && (!nurbs_control_points.empty())), (
+        CHKS(((block->p_number <= 0) && (!_nurbs_control_points.empty())), (
              "Must specify positive weight P for every Control Point"));
         if (settings->feed_mode == UNITS_PER_MINUTE) {
             CHKS((settings->feed_rate == 0.0), (
                  "Cannot make a NURBS with 0 feedrate"));
         }
-        if (nurbs_control_points.empty()) {
+        if (_nurbs_control_points.empty()) {
             CP.X = settings->current_x;
             CP.Y = settings->current_y;
             if (!(block->x_flag) && !(block->y_flag) && (block->p_number > 0)) {
@@ -155,24 +152,24 @@ int Interp::convert_nurbs(int mode,
             } else {
                 CP.W = 1;
             }
-            nurbs_order = 3;
-            nurbs_control_points.push_back(CP);
+            _nurbs_order = 3;
+            _nurbs_control_points.push_back(CP);
         } 
         if (block->l_number != -1 && block->l_number > 3) {
-            nurbs_order = block->l_number;  
+            _nurbs_order = block->l_number;  
         } 
         if ((block->x_flag) && (block->y_flag)) {
             CHP(find_ends(block, settings, &CP.X, &CP.Y, &end_z, &AA_end, &BB_end, &CC_end,
                           &u_end, &v_end, &w_end));
             CP.W = block->p_number;
-            nurbs_control_points.push_back(CP);
+            _nurbs_control_points.push_back(CP);
             }
 
-//for (i=0;i<nurbs_control_points.size();i++){
+//for (i=0;i<_nurbs_control_points.size();i++){
 //                printf( "X %8.4f, Y %8.4f, W %8.4f\n",
-//              nurbs_control_points[i].X,
-//               nurbs_control_points[i].Y,
-//               nurbs_control_points[i].W);
+//              _nurbs_control_points[i].X,
+//               _nurbs_control_points[i].Y,
+//               _nurbs_control_points[i].W);
 //       }
 //        printf("*-----------------------------------------*\n");
         settings->motion_mode = mode;
@@ -181,13 +178,13 @@ int Interp::convert_nurbs(int mode,
     else if (mode == G_5_3){
         CHKS((settings->motion_mode != G_5_2), (
              "Cannot use G5.3 without G5.2 first"));
-        CHKS((nurbs_control_points.size()<nurbs_order), EMC_I18N("You must specify a number of control points at least equal to the order L = %d"), nurbs_order);
-	settings->current_x = nurbs_control_points[nurbs_control_points.size()-1].X;
-        settings->current_y = nurbs_control_points[nurbs_control_points.size()-1].Y;
-        NURBS_FEED(block->line_number, nurbs_control_points, nurbs_order);
+        CHKS((_nurbs_control_points.size()<_nurbs_order), EMC_I18N("You must specify a number of control points at least equal to the order L = %d"), _nurbs_order);
+	settings->current_x = _nurbs_control_points[_nurbs_control_points.size()-1].X;
+        settings->current_y = _nurbs_control_points[_nurbs_control_points.size()-1].Y;
+        NURBS_FEED(block->line_number, _nurbs_control_points, _nurbs_order);
 	//printf("hello\n");
-	nurbs_control_points.clear();
-	//printf("%d\n", 	nurbs_control_points.size());
+	_nurbs_control_points.clear();
+	//printf("%d\n", 	_nurbs_control_points.size());
 	settings->motion_mode = -1;
     }
     return INTERP_OK;
@@ -236,13 +233,13 @@ int Interp::convert_spline(int mode,
                     &u_end, &v_end, &w_end));
       cp.W = 1;
       cp.X = settings->current_x, cp.Y = settings->current_y;
-      nurbs_control_points.push_back(cp);
+      _nurbs_control_points.push_back(cp);
       cp.X = x1, cp.Y = y1;
-      nurbs_control_points.push_back(cp);
+      _nurbs_control_points.push_back(cp);
       cp.X = x2, cp.Y = y2;
-      nurbs_control_points.push_back(cp);
-      NURBS_FEED(block->line_number, nurbs_control_points, 3);
-      nurbs_control_points.clear();
+      _nurbs_control_points.push_back(cp);
+      NURBS_FEED(block->line_number, _nurbs_control_points, 3);
+      _nurbs_control_points.clear();
       settings->current_x = x2;
       settings->current_y = y2;
     } else {
@@ -265,15 +262,15 @@ int Interp::convert_spline(int mode,
 
       cp.W = 1;
       cp.X = settings->current_x, cp.Y = settings->current_y;
-      nurbs_control_points.push_back(cp);
+      _nurbs_control_points.push_back(cp);
       cp.X = x1, cp.Y = y1;
-      nurbs_control_points.push_back(cp);
+      _nurbs_control_points.push_back(cp);
       cp.X = x2, cp.Y = y2;
-      nurbs_control_points.push_back(cp);
+      _nurbs_control_points.push_back(cp);
       cp.X = x3, cp.Y = y3;
-      nurbs_control_points.push_back(cp);
-      NURBS_FEED(block->line_number, nurbs_control_points, 4);
-      nurbs_control_points.clear();
+      _nurbs_control_points.push_back(cp);
+      NURBS_FEED(block->line_number, _nurbs_control_points, 4);
+      _nurbs_control_points.clear();
 
       settings->cycle_i = -block->p_number;
       settings->cycle_j = -block->q_number;
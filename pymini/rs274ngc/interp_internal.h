@@ -223,9 +223,6 @@ enum SPINDLE_MODE
 #define RS274NGC_PARAMETER_FILE_NAME_DEFAULT "rs274ngc.var"
 #define RS274NGC_PARAMETER_FILE_BACKUP_SUFFIX ".bak"
 
-// number of parameters in parameter table
-#define RS274NGC_MAX_PARAMETERS 5414
-
 // Subroutine parameters
 #define INTERP_SUB_PARAMS 30
 #define INTERP_OWORD_LABELS 1000
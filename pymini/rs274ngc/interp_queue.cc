@@ -48,11 +48,12 @@ static double latheorigin_z(setup_pointer settings, double z) {
     return z;
 }
 
-static double endpoint[2];
-static int endpoint_valid = 0;
+/* Queued canon state is per interpreter instance, see Interp::current. */
+#define endpoint (Interp::current->_endpoint)
+#define endpoint_valid (Interp::current->_endpoint_valid)
 
 std::vector<queued_canon>& qc(void) {
-    static std::vector<queued_canon> c;
+    std::vector<queued_canon> &c = Interp::current->_qc;
     if(0) printf("len %d\n", (int)c.size());
     return c;
 }
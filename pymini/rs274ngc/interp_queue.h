@@ -8,6 +8,9 @@
 * Copyright (c) 2009 All rights reserved.
 *
 ********************************************************************/
+#ifndef INTERP_QUEUE_H
+#define INTERP_QUEUE_H
+
 #include <vector>
 
 enum queued_canon_type
@@ -126,3 +129,5 @@ void set_endpoint_zx(double z, double x);
 int move_endpoint_and_flush(setup_pointer settings, double x, double y);
 void qc_reset(void);
 void qc_scale(double scale);
+
+#endif /* INTERP_QUEUE_H */
@@ -67,6 +67,8 @@ class MSG_INTERP_LIST
    int line_number;             // line number of node from get()
 };
 
-extern MSG_INTERP_LIST interp_list;     /* MSG Union, for interpreter */
+/* MSG Union, for interpreter. One list per session, see dispatch.cc. */
+MSG_INTERP_LIST *emc_interp_list(void);
+#define interp_list (*emc_interp_list())
 
 #endif /* _INTERPL_H */
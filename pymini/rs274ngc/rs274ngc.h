@@ -18,6 +18,9 @@
 #define ACTIVE_M_CODES 10
 #define ACTIVE_SETTINGS 3
 
+// number of parameters in parameter table
+#define RS274NGC_MAX_PARAMETERS 5414
+
 /**********************/
 /* INCLUDE DIRECTIVES */
 /**********************/
@@ -1,6 +1,7 @@
 #ifndef RS274NGC_INTERP_H
 #define RS274NGC_INTERP_H
 #include "rs274ngc.h"
+#include "interp_queue.h"
 
 class Interp
 {
@@ -52,6 +53,9 @@ class Interp
 // synchronize your internal model with the external world
    int synch();
 
+// copy the settings of another interpreter
+   int clone(const Interp &from);
+
 /* Interface functions to call to get information from the interpreter.
    If a function has a return value, the return value contains the information.
    If a function returns nothing, information is copied into one of the
@@ -67,6 +71,9 @@ class Interp
 // copy active F, S settings into array [0]..[2]
    void active_settings(double *settings);
 
+// copy numbered parameters into array [0]..[RS274NGC_MAX_PARAMETERS-1]
+   void active_parameters(double *parameters);
+
 // copy the text of the error message whose number is error_code into the
 // error_text array, but stop at max_size if the text is longer.
    void error_text(int error_code, char *error_text, int max_size);
@@ -352,8 +359,22 @@ class Interp
    read_function_pointer _readers[256];
    static const read_function_pointer default_readers[256];
 
-   static setup _setup;
+   setup &_setup;               /* interpreter settings, one per instance */
+
+/* Per instance state, formerly file statics. */
+   unsigned int _nurbs_order;
+   std::vector < CONTROL_POINT > _nurbs_control_points;
+   char _parameter_file[LINELEN];
+   char _saved_error[LINELEN + 1];
 
+ public:
+/* Interpreter running on this thread, the queued canon functions in interp_queue.cc have no instance parameter. */
+   static __thread Interp *current;
+   std::vector < queued_canon > _qc;    /* queued canon calls for cutter compensation */
+   double _endpoint[2];
+   int _endpoint_valid;
+
+ private:
    enum
    {
       AXIS_MASK_X = 1, AXIS_MASK_Y = 2, AXIS_MASK_Z = 4,
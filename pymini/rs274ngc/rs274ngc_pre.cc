@@ -96,17 +96,28 @@ extern char * _rs274ngc_errors[];
 
 //#define LOG_FILE &_setup.log_file[0]
 
-static char RS274NGC_PARAMETER_FILE[LINELEN] = RS274NGC_PARAMETER_FILE_NAME_DEFAULT;
-
 Interp::Interp() 
-    : log_file(0)
-{}
+    : log_file(0), _setup(*(setup *)calloc(1, sizeof(setup))),
+      _nurbs_order(0), _endpoint_valid(0)
+{
+    _endpoint[0] = _endpoint[1] = 0;
+    strcpy(_parameter_file, RS274NGC_PARAMETER_FILE_NAME_DEFAULT);
+    _saved_error[0] = 0;
+}
 
 Interp::~Interp() {
+    int i;
+
     if(log_file) {
    fclose(log_file);
    log_file = 0;
     }
+    for (i = 0; i < INTERP_SUB_ROUTINE_LEVELS; i++) {
+   free_named_parameters(i, &_setup);
+   free(_setup.sub_context[i].named_parameters.named_parameters);
+   free(_setup.sub_context[i].named_parameters.named_param_values);
+    }
+    free(&_setup);
 }
 
 void Interp::doLog(char *fmt, ...)
@@ -328,7 +339,7 @@ written. Otherwise, the default parameter file name is used.
 
 int Interp::exit()
 {
-  save_parameters(RS274NGC_PARAMETER_FILE, _setup.parameters);
+  save_parameters(_parameter_file, _setup.parameters);
   reset();
 
   return INTERP_OK;
@@ -403,7 +414,7 @@ int Interp::init()
 
   _setup.length_units = GET_EXTERNAL_LENGTH_UNIT_TYPE();
   USE_LENGTH_UNITS(_setup.length_units);
-  CHP(restore_parameters(RS274NGC_PARAMETER_FILE));
+  CHP(restore_parameters(_parameter_file));
   pars = _setup.parameters;
   _setup.origin_index = (int) (pars[5220] + 0.0001);
   if(_setup.origin_index < 1 || _setup.origin_index > 9) {
@@ -1115,12 +1126,81 @@ int Interp::synch()
   _setup.adaptive_feed = GET_EXTERNAL_ADAPTIVE_FEED_ENABLE();
   _setup.feed_hold = GET_EXTERNAL_FEED_HOLD_ENABLE();
 
-  save_parameters(RS274NGC_PARAMETER_FILE, _setup.parameters);
+  save_parameters(_parameter_file, _setup.parameters);
   load_tool_table();   /*  must set  _setup.tool_max first */
 
   return INTERP_OK;
 }
 
+/***********************************************************************/
+
+/*! Interp::clone
+
+Returned Value: int
+   If any of the following errors occur, this returns the error code shown.
+   Otherwise, this returns INTERP_OK.
+   1. A named parameter cannot be copied: NCE_OUT_OF_MEMORY
+
+Side Effects:
+   The _setup of from is copied to this interpreter: parameters, modal
+   codes, offsets, units, feed rate and tool table. The open file,
+   o-word labels and subroutine state are not copied, named parameters
+   are duplicated, so neither interpreter frees strings of the other.
+
+Called By: external programs
+
+This gives a scratch interpreter that starts where from is, running
+it leaves from as it was.
+
+*/
+
+int Interp::clone(const Interp &from)
+{
+  int i, n;
+  struct named_parameters_struct *np;
+
+  memcpy(_readers, from._readers, sizeof(_readers));
+  _setup = from._setup;
+  _setup.file_pointer = NULL;
+  _setup.percent_flag = OFF;
+  _setup.block1.o_name = 0;
+  _setup.named_parameter_occurrence = 0;
+  _setup.defining_sub = 0;
+  _setup.sub_name = 0;
+  _setup.skipping_o = 0;
+  _setup.skipping_to_sub = 0;
+  _setup.oword_labels = 0;
+  for (i = 0; i < INTERP_SUB_ROUTINE_LEVELS; i++) {
+    _setup.sub_context[i].filename = 0;
+    _setup.sub_context[i].subName = 0;
+    np = &_setup.sub_context[i].named_parameters;
+    n = np->named_parameter_used_size;
+    np->named_parameter_alloc_size = np->named_parameter_used_size = 0;
+    np->named_parameters = 0;
+    np->named_param_values = 0;
+    if (n == 0)
+      continue;
+    np->named_parameters = (char **)calloc(n, sizeof(char *));
+    np->named_param_values = (double *)malloc(n * sizeof(double));
+    if (np->named_parameters == 0 || np->named_param_values == 0)
+      ERS(NCE_OUT_OF_MEMORY);
+    np->named_parameter_alloc_size = n;
+    memcpy(np->named_param_values, from._setup.sub_context[i].named_parameters.named_param_values, n * sizeof(double));
+    for (np->named_parameter_used_size = 0; np->named_parameter_used_size < n; np->named_parameter_used_size++) {
+      const char *name = from._setup.sub_context[i].named_parameters.named_parameters[np->named_parameter_used_size];
+      if ((np->named_parameters[np->named_parameter_used_size] = strdup(name)) == 0)
+        ERS(NCE_OUT_OF_MEMORY);
+    }
+  }
+  strcpy(_parameter_file, from._parameter_file);
+  _qc = from._qc;
+  _endpoint[0] = from._endpoint[0];
+  _endpoint[1] = from._endpoint[1];
+  _endpoint_valid = from._endpoint_valid;
+
+  return INTERP_OK;
+}
+
 /***********************************************************************/
 /***********************************************************************/
 
@@ -1200,14 +1280,30 @@ void Interp::active_settings(double *settings) //!< array of settings to copy in
   }
 }
 
-static char savedError[LINELEN+1];
+/***********************************************************************/
+
+/*! Interp::active_parameters
+
+Returned Value: none
+
+Side Effects: copies the numbered parameters into the parameters array.
+
+Called By: external programs
+
+*/
+
+void Interp::active_parameters(double *parameters) //!< array of RS274NGC_MAX_PARAMETERS to copy into
+{
+  memcpy(parameters, _setup.parameters, sizeof(_setup.parameters));
+}
+
 void Interp::setError(const char *fmt, ...)
 {
     va_list ap;
 
     va_start(ap, fmt);
 
-    vsnprintf(savedError, LINELEN, fmt, ap);
+    vsnprintf(_saved_error, LINELEN, fmt, ap);
 
     va_end(ap);
 }
@@ -1237,7 +1333,7 @@ void Interp::error_text(int error_code,        //!< code number of error
 {
     if(error_code == INTERP_ERROR)
     {
-        strncpy(error_text, savedError, max_size);
+        strncpy(error_text, _saved_error, max_size);
         error_text[max_size-1] = 0;
 
         return;
@@ -1414,12 +1510,12 @@ int Interp::ini_load(const char *filename)
    if (iniGetKeyValue("RS274NGC", "PARAMETER_FILE", inistring, sizeof(inistring)) > 0)
    {
       // found it
-      snprintf(RS274NGC_PARAMETER_FILE, sizeof(RS274NGC_PARAMETER_FILE), "%s/%s", USER_HOME_DIR, inistring);
+      snprintf(_parameter_file, sizeof(_parameter_file), "%s/%s", current_session->home_dir, inistring);
    } 
    else 
    {
-      // not found, leave RS274NGC_PARAMETER_FILE alone
-      BUG("unable to find PARAMETER_FILE in %s/%s\n", USER_HOME_DIR, filename);
+      // not found, leave _parameter_file alone
+      BUG("unable to find PARAMETER_FILE in %s/%s\n", current_session->home_dir, filename);
    }
 
    return 0;
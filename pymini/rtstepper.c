@@ -53,51 +53,78 @@
 #define LIBUSB_TIMEOUT 30000    /* milliseconds */
 #define LIBUSB_CONTROL_REQ_TIMEOUT 5000
 
-/* EP0 Vendor Setup commands (bRequest). */
-enum STEP_CMD
+#define POOL_EMPTY 0xffffffff   /* free list end marker */
+
+/* Serialize dongle claim/release, shared by all sessions and rtstepper_test(). */
+static pthread_mutex_t _usb_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static enum EMC_RESULT start_xfr(struct emc_session *ps);
+static void init_encoder(struct emc_session *ps);
+static void encode_polarity(unsigned char *buf, int total, unsigned char polarity_mask);
+
+/* 
+ * DB25 pin to bitfield map.
+ *                pin #       na, 1,  2,   3,   4,   5,    6,    7,   8,    9  
+ */
+static const int pin_map[] = { 0, 0, 0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80 };
+
+/* Return wall clock time in microseconds. */
+static uint64_t now_us(void)
 {
-   STEP_SET,                    /* set step elements, clear state bits */
-   STEP_QUERY,                  /* query current step and state info */
-   STEP_ABORT_SET,              /* set un-synchronized stop */
-   STEP_ABORT_CLEAR,            /* clear un-synchronized stop */
-};
+   struct timeval tv;
 
-//#define STEP_BUF_CHUNK 4096
-#define STEP_BUF_CHUNK 16384
+   gettimeofday(&tv, NULL);
+   return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}       /* now_us() */
+
+/* Add a sample to a log2 histogram, lock-free. */
+static void hist_add(uint64_t *hist, uint64_t us)
+{
+   int n = us ? 64 - __builtin_clzll(us) : 0;
 
-static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;  
-static pthread_cond_t _write_done_cond = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t _event_done_cond = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t _dongle_done_cond = PTHREAD_COND_INITIALIZER;
+   if (n >= RTSTEPPER_HIST_BUCKETS)
+      n = RTSTEPPER_HIST_BUCKETS - 1;
+   __sync_fetch_and_add(&hist[n], 1);
+}       /* hist_add() */
 
-struct __attribute__ ((packed)) step_state
+/* Return motion time in microseconds for a step buffer, one byte is half a step clock period. */
+static int64_t step_time_us(int total)
 {
-   union
-   {
-      uint16_t _word;
-   };
-};
+   return (int64_t)total * RTSTEPPER_PERIOD / 2000;
+}       /* step_time_us() */
 
-struct __attribute__ ((packed)) step_elements
+/* Return true if the usb dongle or the dongle emulator is open. */
+static int is_open(struct rtstepper_file_descriptor *pfd)
 {
-   char reserved[8];
-};
+   return pfd->hd != NULL || pfd->emu != NULL;
+}       /* is_open() */
 
-struct __attribute__ ((packed)) step_query
+/* Send a EP0 vendor request to the usb dongle or the dongle emulator. */
+static int control_transfer(struct rtstepper_file_descriptor *pfd, uint8_t request_type, uint8_t request, unsigned char *data, uint16_t length)
 {
-   struct step_state state_bits;
-   unsigned char reserved;
-   unsigned char trip_cnt;      /* stall trip count */
-   uint32_t step;               /* running step count */
-};
+   if (pfd->emu != NULL)
+      return rtstepper_emu_control_transfer(pfd->emu, request_type, request, data, length);
+
+   return libusb_control_transfer(pfd->hd, request_type,       /* bmRequestType */
+                         request,       /* bRequest */
+                         0x0,   /* wValue */
+                         DONGLE_INTERFACE, /* wIndex */
+                         data, length, LIBUSB_CONTROL_REQ_TIMEOUT);
+}       /* control_transfer() */
 
-static enum EMC_RESULT start_xfr(struct rtstepper_io_req *io);
+static int submit_transfer(struct rtstepper_file_descriptor *pfd, struct libusb_transfer *transfer)
+{
+   if (pfd->emu != NULL)
+      return rtstepper_emu_submit_transfer(pfd->emu, transfer);
+   return libusb_submit_transfer(transfer);
+}       /* submit_transfer() */
 
-/* 
- * DB25 pin to bitfield map.
- *                pin #       na, 1,  2,   3,   4,   5,    6,    7,   8,    9  
- */
-static const int pin_map[] = { 0, 0, 0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80 };
+static int cancel_transfer(struct rtstepper_file_descriptor *pfd, struct libusb_transfer *transfer)
+{
+   if (pfd->emu != NULL)
+      return rtstepper_emu_cancel_transfer(pfd->emu, transfer);
+   return libusb_cancel_transfer(transfer);
+}       /* cancel_transfer() */
 
 static int is_rt(libusb_device *dev, const char *sn)
 {
@@ -138,74 +165,247 @@ static int is_rt(libusb_device *dev, const char *sn)
    return stat;
 }       /* is_rt() */
 
-/* Libusb requires an event handling thread for asynchronous io. This loop calls xfr_cb(). 
+/* 
+ * Latch an enabled INPUTn that is high in bits. Returns RTSTEPPER_R_INPUT_TRUE only to the caller that set the latch,
+ * so each dongle event thread can call it and a low to high transition estops once until rtstepper_clear_abort().
+ */
+static enum EMC_RESULT input_triggered(struct emc_session *ps, uint32_t bits, uint32_t input_bit, int enabled)
+{
+   if (!is_open(&ps->fd_table[0]) || !enabled || (bits & input_bit) == 0)
+      return RTSTEPPER_R_INPUT_FALSE;
+   if (__sync_fetch_and_or(&ps->old_state_bits, input_bit) & input_bit)
+      return RTSTEPPER_R_INPUT_FALSE;
+   return RTSTEPPER_R_INPUT_TRUE;   /* found input low to high transition */
+}  /* input_triggered() */
+
+/* 
+ * Merge dongle state bits into the session state. Post an input callback for each INPUTn change and 
+ * estop on an enabled INPUTn low to high transition. Edges come from the bits this thread swapped in, not from a
+ * second read of ps->state_bits that another dongle event thread may have changed.
+ */
+static void update_state(struct emc_session *ps, uint32_t bits)
+{
+   static const uint32_t input_bit[] = { RTSTEPPER_STEP_STATE_INPUT0_BIT, RTSTEPPER_STEP_STATE_INPUT1_BIT, RTSTEPPER_STEP_STATE_INPUT2_BIT };
+   const int enabled[] = { ps->input0_abort_enabled, ps->input1_abort_enabled, ps->input2_abort_enabled };
+   const uint32_t dongle_bits = RTSTEPPER_STEP_STATE_INPUT0_BIT | RTSTEPPER_STEP_STATE_INPUT1_BIT | RTSTEPPER_STEP_STATE_INPUT2_BIT |
+                                RTSTEPPER_STEP_STATE_ABORT_BIT | RTSTEPPER_STEP_STATE_EMPTY_BIT | RTSTEPPER_STEP_STATE_STALL_BIT;
+   uint32_t old_bits, new_bits;
+   int i;
+
+   do
+   {
+      old_bits = ps->state_bits;
+      new_bits = (old_bits & ~dongle_bits) | (bits & dongle_bits);
+   } while (!__sync_bool_compare_and_swap(&ps->state_bits, old_bits, new_bits));
+
+   for (i = 0; i < 3; i++)
+   {
+      if ((old_bits ^ new_bits) & input_bit[i])
+         emc_post_input_cb(ps, i, (new_bits & input_bit[i]) != 0);
+   }
+
+   for (i = 0; i < 3; i++)
+   {
+      if (input_triggered(ps, new_bits, input_bit[i], enabled[i]) == RTSTEPPER_R_INPUT_TRUE)
+      {
+         rtstepper_estop(ps, RTSTEPPER_EVENT_THREAD);
+         emc_post_estop_cb(ps);
+         MSG("INPUT%d estop...\n", i);
+      }
+   }
+}  /* update_state() */
+
+/* 
+ * Merge the last STEP_QUERY state bits of each dongle. INPUTn come from the first dongle, ABORT and STALL from any
+ * dongle and EMPTY is set only when every dongle is empty.
+ */
+static uint32_t merge_state(struct emc_session *ps)
+{
+   uint32_t bits, empty = RTSTEPPER_STEP_STATE_EMPTY_BIT;
+   int i;
+
+   bits = ps->fd_table[0].state_bits & (RTSTEPPER_STEP_STATE_INPUT0_BIT | RTSTEPPER_STEP_STATE_INPUT1_BIT | RTSTEPPER_STEP_STATE_INPUT2_BIT);
+   for (i = 0; i < ps->dongles; i++)
+   {
+      bits |= ps->fd_table[i].state_bits & (RTSTEPPER_STEP_STATE_ABORT_BIT | RTSTEPPER_STEP_STATE_STALL_BIT);
+      empty &= ps->fd_table[i].state_bits;
+   }
+   return bits | empty;
+}  /* merge_state() */
+
+/* Async STEP_QUERY complete callback, runs in event_thread (or the emulator thread). */
+static void status_cb(struct libusb_transfer *transfer)
+{
+   struct rtstepper_file_descriptor *pfd = transfer->user_data;
+   struct emc_session *ps = pfd->session;
+   struct rtstepper_io_stats *st = &ps->io_stats;
+   struct step_query query;
+   uint32_t trip_cnt = 0;
+   int i;
+
+   if (transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length == sizeof(query))
+   {
+      memcpy(&query, libusb_control_transfer_get_data(transfer), sizeof(query));
+      pfd->state_bits = query.state_bits._word;
+      pfd->trip_cnt = query.trip_cnt;
+      update_state(ps, merge_state(ps));
+      __sync_fetch_and_add(&pfd->query_good, 1);
+
+      /* Each dongle has its own event thread, the session counters are shared. */
+      __sync_fetch_and_add(&st->query_cnt, 1);
+      if ((query.state_bits._word & RTSTEPPER_STEP_STATE_EMPTY_BIT) && ps->queue_us > 0)
+         __sync_fetch_and_add(&st->empty_cnt, 1);    /* dongle starved while the host still had step data */
+      if (query.state_bits._word & RTSTEPPER_STEP_STATE_STALL_BIT)
+         __sync_fetch_and_add(&st->stall_cnt, 1);
+      for (i = 0; i < ps->dongles; i++)
+         trip_cnt += ps->fd_table[i].trip_cnt;
+      st->trip_cnt = trip_cnt;
+   }
+   else if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+   {
+      if (__sync_fetch_and_add(&pfd->query_bad, 1) < 30)
+         BUG("invalid usb query_response dongle=%d len=%d status=%d good_query_cnt=%d\n", pfd->dongle, transfer->actual_length, 
+             transfer->status, pfd->query_good);
+   }
+
+   pfd->status_busy = 0;
+}  /* status_cb() */
+
+/* Async STEP_ABORT_SET complete callback. */
+static void abort_cb(struct libusb_transfer *transfer)
+{
+   struct rtstepper_file_descriptor *pfd = transfer->user_data;
+
+   if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+      BUG("set_abort failed dongle=%d status=%d\n", pfd->dongle, transfer->status);
+
+   pfd->abort_busy = 0;
+}  /* abort_cb() */
+
+/* 
+ * Submit a STEP_QUERY control transfer if one is due. Returns in tv the time left until the next one. Runs in
+ * event_thread so the query never blocks and never competes with the bulk step stream for a thread.
+ */
+static void status_poll(struct rtstepper_file_descriptor *pfd, struct timeval *tv)
+{
+   struct emc_session *ps = pfd->session;
+   struct timeval now, interval;
+   int r;
+
+   gettimeofday(&now, NULL);
+
+   if (!pfd->status_busy && !timercmp(&now, &pfd->status_next, <))
+   {
+      libusb_fill_control_setup(pfd->status_buf, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
+                                STEP_QUERY, 0x0, DONGLE_INTERFACE, sizeof(struct step_query));
+      libusb_fill_control_transfer(pfd->status_xfr, pfd->hd, pfd->status_buf, status_cb, pfd, LIBUSB_CONTROL_REQ_TIMEOUT);
+      pfd->status_busy = 1;
+      if ((r = submit_transfer(pfd, pfd->status_xfr)) != 0)
+      {
+         pfd->status_busy = 0;
+         BUG("invalid status query: %s\n", libusb_error_name(r));
+      }
+
+      interval.tv_sec = ps->status_interval / 1000;
+      interval.tv_usec = (ps->status_interval % 1000) * 1000;
+      timeradd(&now, &interval, &pfd->status_next);
+   }
+
+   if (timercmp(&now, &pfd->status_next, <))
+      timersub(&pfd->status_next, &now, tv);
+   else
+      timerclear(tv);
+
+   /* Wake up at least every 100ms to check event_done, at most every 1ms while a late query is still in flight. */
+   if (tv->tv_sec > 0 || tv->tv_usec > 100000)
+   {
+      tv->tv_sec = 0;
+      tv->tv_usec = 100000;
+   }
+   if (pfd->status_busy && tv->tv_sec == 0 && tv->tv_usec < 1000)
+      tv->tv_usec = 1000;
+}  /* status_poll() */
+
+/* Libusb requires an event handling thread for asynchronous io. This loop calls xfr_cb() and polls dongle status. 
  * Note, libusb_control_transfer() will also call xfr_cb(), this caused a mutex hang issue. 
  */
 void event_thread(struct rtstepper_file_descriptor *pfd)
 {
+   struct emc_session *ps = pfd->session;
    struct timeval tv;
 
-   tv.tv_sec = 0;
-   tv.tv_usec = 0.1 * 1E6;   /* 100ms */
+   gettimeofday(&pfd->status_next, NULL);
 
    while (!pfd->event_done)
    {
-      /* If libusb has nothing to do, it will block until timeout expires. */
-      libusb_handle_events_timeout_completed(pfd->ctx, &tv, NULL);
+      status_poll(pfd, &tv);
+
+      /* If libusb has nothing to do, it will block until timeout expires. The emulator completes transfers in its own thread. */
+      if (pfd->emu != NULL)
+         esleep(tv.tv_sec + tv.tv_usec * 1E-6);
+      else
+         libusb_handle_events_timeout_completed(pfd->ctx, &tv, NULL);
    }  /* while (!event_done) */
 
+   /* Complete any outstanding status or abort transfer before libusb_close. */
+   if (pfd->status_busy)
+      cancel_transfer(pfd, pfd->status_xfr);
+   while (pfd->status_busy || pfd->abort_busy)
+   {
+      tv.tv_sec = 0;
+      tv.tv_usec = 0.01 * 1E6;   /* 10ms */
+      if (pfd->emu != NULL)
+         esleep(0.01);
+      else
+         libusb_handle_events_timeout_completed(pfd->ctx, &tv, NULL);
+   }
+
    DBG("event_thread() closed...\n");
+   pthread_mutex_lock(&ps->io_mutex);
    pfd->event_abort_done = 1;
-   pthread_cond_signal(&_event_done_cond);
+   pthread_cond_signal(&ps->event_done_cond);
+   pthread_mutex_unlock(&ps->io_mutex);
 }  /* event_thread() */
 
-void dongle_thread(struct rtstepper_file_descriptor *pfd)
+/* Allocate the async status transfers and create event_thread, call after the device or emulator is open. */
+static enum EMC_RESULT start_event_thread(struct rtstepper_file_descriptor *pfd)
 {
-   struct emc_session *ps;
-
-   ps = container_of(pfd, struct emc_session, fd_table);
-
-   while (!pfd->dongle_done)
+   pfd->status_busy = pfd->abort_busy = 0;
+   if ((pfd->status_xfr = libusb_alloc_transfer(0)) == NULL || (pfd->abort_xfr = libusb_alloc_transfer(0)) == NULL)
    {
-      esleep(0.05);   /* 50ms */
-
-      rtstepper_query_state(ps);
-
-      if (rtstepper_is_input0_triggered(ps) == RTSTEPPER_R_INPUT_TRUE)
-      {
-         rtstepper_estop(ps, RTSTEPPER_DONGLE_THREAD);
-         emc_post_estop_cb(ps);
-         MSG("INPUT0 estop...\n");
-      }
-      if (rtstepper_is_input1_triggered(ps) == RTSTEPPER_R_INPUT_TRUE)
-      {
-         rtstepper_estop(ps, RTSTEPPER_DONGLE_THREAD);
-         emc_post_estop_cb(ps);
-         MSG("INPUT1 estop...\n");
-      }
-      if (rtstepper_is_input2_triggered(ps) == RTSTEPPER_R_INPUT_TRUE)
-      {
-         rtstepper_estop(ps, RTSTEPPER_DONGLE_THREAD);
-         emc_post_estop_cb(ps);
-         MSG("INPUT2 estop...\n");
-      }
-
-      /* Check for estop and not aborted yet. */
-      //if (ps->state_bits & EMC_STATE_ESTOP_BIT && !(ps->state_bits & RTSTEPPER_STEP_STATE_ABORT_BIT))
-      //   rtstepper_set_abort(ps);  /* abort io in the dongle */     
+      BUG("unable to malloc usb transfer\n");
+      return RTSTEPPER_R_MALLOC_ERROR;
+   }
 
-   }  /* while (!dongle_done) */
+   pfd->event_done = pfd->event_abort_done = 0;
+   pthread_create(&pfd->event_tid, NULL, (void *(*)(void *))event_thread, (void *)pfd);
+   return EMC_R_OK;
+}  /* start_event_thread() */
 
-   DBG("dongle_thread() closed...\n");
-   pfd->dongle_abort_done = 1;
-   pthread_cond_signal(&_dongle_done_cond);
-}  /* dongle_thread() */
+static void stop_event_thread(struct rtstepper_file_descriptor *pfd)
+{
+   struct emc_session *ps = pfd->session;
+
+   /* Wait for event_thread to shutdown before calling libusb_close. */
+   pfd->event_done = 1;
+   pthread_mutex_lock(&ps->io_mutex);
+   while (!pfd->event_abort_done)
+      pthread_cond_wait(&ps->event_done_cond, &ps->io_mutex);
+   pthread_mutex_unlock(&ps->io_mutex);
+   pthread_join(pfd->event_tid, NULL);
+
+   if (pfd->status_xfr != NULL)
+      libusb_free_transfer(pfd->status_xfr);
+   if (pfd->abort_xfr != NULL)
+      libusb_free_transfer(pfd->abort_xfr);
+   pfd->status_xfr = pfd->abort_xfr = NULL;
+}  /* stop_event_thread() */
 
 static int claim_interface(struct rtstepper_file_descriptor *pfd)
 {
    int stat=1, r;
 
-   pthread_mutex_lock(&_mutex);
+   pthread_mutex_lock(&_usb_mutex);
 
    if (pfd->hd != NULL)
    {
@@ -232,7 +432,7 @@ static int claim_interface(struct rtstepper_file_descriptor *pfd)
    stat=0;
 
 bugout:
-   pthread_mutex_unlock(&_mutex);
+   pthread_mutex_unlock(&_usb_mutex);
    return stat;   
 } /* claim_interface() */
 
@@ -241,17 +441,19 @@ static int release_interface(struct rtstepper_file_descriptor *pfd)
    if (pfd->hd == NULL)
       return 0;
 
-   pthread_mutex_lock(&_mutex);
+   pthread_mutex_lock(&_usb_mutex);
 
    libusb_release_interface(pfd->hd, DONGLE_INTERFACE);
    libusb_close(pfd->hd);
    libusb_free_device_list(pfd->list_all, 1);
    libusb_exit(pfd->ctx);
    pfd->hd = NULL;
+   pfd->list_all = NULL;
+   pfd->ctx = NULL;
 
    DBG("released interface %d\n", DONGLE_INTERFACE);
 
-   pthread_mutex_unlock(&_mutex);
+   pthread_mutex_unlock(&_usb_mutex);
    return 0;
 } /* release_interface() */
 
@@ -262,7 +464,14 @@ static enum EMC_RESULT open_device(struct rtstepper_file_descriptor *pfd, const
    
    libusb_init(&pfd->ctx);
    libusb_set_debug(pfd->ctx, 3);
-   n = libusb_get_device_list(pfd->ctx, &pfd->list_all);
+   if ((n = libusb_get_device_list(pfd->ctx, &pfd->list_all)) < 0)
+   {
+      BUG("invalid libusb_get_device_list: %s\n", libusb_error_name(n));
+      libusb_exit(pfd->ctx);
+      pfd->list_all = NULL;
+      pfd->ctx = NULL;
+      goto bugout;
+   }
 
    /* Look for rtstepper device(s). */
    for (i=0; i < n; i++)
@@ -274,53 +483,104 @@ static enum EMC_RESULT open_device(struct rtstepper_file_descriptor *pfd, const
             goto bugout;
 
          /* Create event_thread after libusb_open. */
-         pfd->event_done = pfd->event_abort_done = 0;
-         pthread_create(&pfd->event_tid, NULL, (void *(*)(void *))event_thread, (void *)pfd);
-
-         /* Create dongle_thread for reading input bits. */
-         pfd->dongle_done = pfd->dongle_abort_done = 0;
-         pthread_create(&pfd->dongle_tid, NULL, (void *(*)(void *))dongle_thread, (void *)pfd);
-
-         stat = EMC_R_OK;
+         if ((stat = start_event_thread(pfd)) != EMC_R_OK)
+         {
+            release_interface(pfd);
+            goto bugout;
+         }
          break;
       }
    }
 
 bugout:
+   if (pfd->hd == NULL && pfd->list_all != NULL)
+   {
+      /* No interface claimed, free what release_interface() would have. */
+      libusb_free_device_list(pfd->list_all, 1);
+      libusb_exit(pfd->ctx);
+      pfd->list_all = NULL;
+      pfd->ctx = NULL;
+   }
    return stat;
 }       /* open_device() */
 
-static enum EMC_RESULT close_device(struct rtstepper_file_descriptor *pfd)
+static enum EMC_RESULT open_emulator(struct rtstepper_file_descriptor *pfd, int mode)
 {
-   if (pfd->hd != NULL)
+   if ((pfd->emu = rtstepper_emu_open(pfd->session, mode, pfd->dongle)) == NULL)
+      return RTSTEPPER_R_DEVICE_UNAVAILABLE;
+
+   /* Emulator completes transfers in its own thread, event_thread only polls dongle status. */
+   if (start_event_thread(pfd) != EMC_R_OK)
    {
-      /* Wait for dongle_thread to shutdown before calling libusb_close. */
-      pfd->dongle_done = 1;
-      pthread_mutex_lock(&_mutex);
-      while (!pfd->dongle_abort_done)
-         pthread_cond_wait(&_dongle_done_cond, &_mutex);
-      pthread_mutex_unlock(&_mutex);
+      rtstepper_emu_close(pfd->emu);
+      pfd->emu = NULL;
+      return RTSTEPPER_R_MALLOC_ERROR;
+   }
 
-      /* Wait for event_thread to shutdown before calling libusb_close. */
-      pfd->event_done = 1;
-      pthread_mutex_lock(&_mutex);
-      while (!pfd->event_abort_done)
-         pthread_cond_wait(&_event_done_cond, &_mutex);
-      pthread_mutex_unlock(&_mutex);
+   return EMC_R_OK;
+}       /* open_emulator() */
 
+static enum EMC_RESULT close_device(struct rtstepper_file_descriptor *pfd)
+{
+   if (pfd->emu != NULL)
+   {
+      /* Wait for event_thread to shutdown before closing the emulator. */
+      stop_event_thread(pfd);
+      rtstepper_emu_close(pfd->emu);
+      pfd->emu = NULL;
+   }
+   else if (pfd->hd != NULL)
+   {
+      stop_event_thread(pfd);
       release_interface(pfd);
    }
    return EMC_R_OK;
 }       /* close_device() */
 
+/* 
+ * Pop a free io request from the pool. The free list is a Treiber stack, the tag in the upper 32 bits of top 
+ * is bumped on every change so a stale compare-and-swap (ABA) fails. Safe to call from any thread.
+ */
+static struct rtstepper_io_req *pool_get(struct rtstepper_io_pool *pp)
+{
+   uint64_t top, new_top;
+   uint32_t i;
+
+   do
+   {
+      top = pp->top;
+      i = (uint32_t)top;
+      if (i == POOL_EMPTY)
+         return NULL;
+      new_top = (((top >> 32) + 1) << 32) | pp->next[i];
+   } while (!__sync_bool_compare_and_swap(&pp->top, top, new_top));
+
+   return &pp->io[i];
+}  /* pool_get() */
+
+/* Push an io request back on the pool free list. Safe to call from any thread. */
+static void pool_put(struct rtstepper_io_pool *pp, struct rtstepper_io_req *io)
+{
+   uint64_t top, new_top;
+
+   do
+   {
+      top = pp->top;
+      pp->next[io->index] = (uint32_t)top;
+      new_top = (((top >> 32) + 1) << 32) | io->index;
+   } while (!__sync_bool_compare_and_swap(&pp->top, top, new_top));
+}  /* pool_put() */
+
 static void cancel_xfr(struct emc_session *ps)
 {
    struct rtstepper_io_req *io;
    struct list_head *p, *tmp;
+   int i;
 
-   pthread_mutex_lock(&_mutex);
+   pthread_mutex_lock(&ps->io_mutex);
 
    /* Walk the queue deleting all io requests. */
+   ps->queue_us = 0;
    list_for_each_safe(p, tmp, &ps->head.list)
    {
       /* Need to re-home after canceling any io request. */
@@ -328,24 +588,59 @@ static void cancel_xfr(struct emc_session *ps)
 
       io = list_entry(p, struct rtstepper_io_req, list);
 
-      /* Cancel current io transfer, xfr_cb() will complete the cancel.  */
-      if (io->req != NULL)
+      /* Cancel in-flight io transfers on every dongle, xfr_cb() will complete the cancel.  */
+      if (io->submitted)
       {
-         libusb_cancel_transfer(io->req);
+         for (i = 0; i < ps->dongles; i++)
+            cancel_transfer(&ps->fd_table[i], io->transfer[i]);
+         ps->queue_us += step_time_us(io->total);
          continue;
       }
       
       /* Remove all pending io requests from the queue. */
-      free(io->buf);
       list_del(&io->list);
-      free(io);
+      pool_put(&ps->pool, io);
    }
 
-   ps->req_cnt = 0;
+   /* Only the cancelled in-flight io requests remain, xfr_cb() will remove them. */
+   ps->req_cnt = ps->xfr_cnt;
 
-   pthread_mutex_unlock(&_mutex);
+   pthread_mutex_unlock(&ps->io_mutex);
 } /* cancel_xfr() */
 
+/*
+ * Cancel the queued io requests that are not on the wire yet, starting at the first one with a planner snapshot at
+ * or after move log position seq (see dispatch.cc). Io requests ahead of it and the ones already submitted still
+ * step. Returns the snapshot of the first cancelled io request, NULL if none was cancelled.
+ */
+void *rtstepper_cancel_unsent(struct emc_session *ps, uint64_t seq)
+{
+   struct rtstepper_io_req *io;
+   struct list_head *p, *tmp;
+   void *snap = NULL;
+
+   pthread_mutex_lock(&ps->io_mutex);
+
+   list_for_each_safe(p, tmp, &ps->head.list)
+   {
+      io = list_entry(p, struct rtstepper_io_req, list);
+
+      if (snap == NULL && (io->submitted || io->snap == NULL || io->snap_seq < seq))
+         continue;
+
+      if (snap == NULL)
+         snap = io->snap;
+      list_del(&io->list);
+      ps->req_cnt--;
+      ps->queue_us -= step_time_us(io->total);
+      pool_put(&ps->pool, io);
+   }
+
+   pthread_mutex_unlock(&ps->io_mutex);
+
+   return snap;
+} /* rtstepper_cancel_unsent() */
+
 #if 0
 static int x_index;
 static int y_index;
@@ -388,12 +683,16 @@ static void bitchk(int id, unsigned char *buf, int total)
 }
 #endif
 
-/* Libusb asynchronous transfer complete callback function. */
+/* 
+ * Libusb asynchronous transfer complete callback function. Called once per dongle for each io request, the last 
+ * completion retires the io request. 
+ */
 static void xfr_cb(struct libusb_transfer *transfer)
 {
    struct emc_session *ps;
    struct rtstepper_io_req *io;
-   int empty;
+   uint64_t now = now_us();
+   int empty, low;
 
    DBG("xfr_cb() io=%p, %d bytes written\n", transfer->user_data, transfer->actual_length);
 
@@ -402,6 +701,7 @@ static void xfr_cb(struct libusb_transfer *transfer)
 
    if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
    {
+      io->error = 1;
       switch (transfer->status)
       {
       case LIBUSB_TRANSFER_ERROR:
@@ -436,72 +736,125 @@ static void xfr_cb(struct libusb_transfer *transfer)
    {
       if (transfer->actual_length != transfer->length)
       {
+         io->error = 1;
          BUG("usb transfer incomplete exp=%d act=%d\n", transfer->length, transfer->actual_length);
          emc_post_estop_cb(ps);
       }
-      else
-      {
-         //bitchk(io->id, io->buf, io->total);
+   }
 
-         /* Transfer is ok, save current position. */
-         ps->position = io->position;
-         emc_post_position_cb(io->id, io->position); 
-      }
+   /* Wait for the other dongles to complete their part of this io request. */
+   if (__sync_sub_and_fetch(&io->pending, 1) > 0)
+      return;
+
+   if (!io->error)
+   {
+      //bitchk(io->id, io->buf[0], io->total);
+
+      /* Transfer is ok, save current position. */
+      ps->position = io->position;
+      emc_post_position_cb(ps, io->id, io->position); 
+
+      __sync_fetch_and_add(&ps->io_stats.xfr_cnt, 1);
+      __sync_fetch_and_add(&ps->io_stats.xfr_bytes, io->total);
+      hist_add(ps->io_stats.latency_hist, now - io->submit_us);
    }
 
-   pthread_mutex_lock(&_mutex);
+   pthread_mutex_lock(&ps->io_mutex);
 
-   libusb_free_transfer(io->req);
-   free(io->buf);
+   io->submitted = 0;
    list_del(&io->list);
-   free(io);
+   pool_put(&ps->pool, io);
    ps->req_cnt--;
+   ps->xfr_cnt--;
+   ps->queue_us -= step_time_us(io->total);
    empty = list_empty(&ps->head.list);
+   low = ps->queue_us <= ps->queue_low_us;
+   hist_add(ps->io_stats.queue_hist, ps->queue_us);
+   if (empty && ps->io_running)
+      ps->io_idle_us = now;    /* possible underrun, see rtstepper_queue_xfr() */
 
-   pthread_mutex_unlock(&_mutex);
+   pthread_mutex_unlock(&ps->io_mutex);
 
    if (!empty)
    {
-      /* Kickoff next usb io request from the head of the queue (FIFO). */
-      io = list_entry(ps->head.list.next, struct rtstepper_io_req, list);
-      start_xfr(io);
+      /* Top up the in-flight usb io requests from the queue (FIFO). */
+      start_xfr(ps);
    }
-   else
+
+   if (empty || low)
    { 
-      /* All usb io is complete. */
+      /* All usb io is complete or queued motion fell below the low water mark. */
       DBG("broadcast write_done_cond...\n");
-      pthread_cond_broadcast(&_write_done_cond);
+      pthread_cond_broadcast(&ps->write_done_cond);
    }
 
    return;
 }  /* xfr_cb() */
 
-static enum EMC_RESULT start_xfr(struct rtstepper_io_req *io)
+/*
+ * Submit queued io requests until xfr_depth transfers are in flight. Bulk transfers on the same endpoint 
+ * complete in submit order, so walking the queue from the head keeps the io requests FIFO. Keeping more
+ * than one transfer submitted removes the completion to resubmit gap where the bulk endpoint sits idle.
+ * With more than one dongle each io request is submitted to all dongles back to back, so every dongle
+ * has the same step cycles queued and the streams stay cycle-aligned.
+ */
+static enum EMC_RESULT start_xfr(struct emc_session *ps)
 {
    enum EMC_RESULT stat = RTSTEPPER_R_IO_ERROR;
-   struct emc_session *ps = io->session;
-   int r, tmo;
+   struct rtstepper_io_req *io;
+   struct list_head *p;
+   int i, r, tmo, ahead=0;
 
    if (ps->state_bits & EMC_STATE_ESTOP_BIT)
       return EMC_R_OK;  /* ESTOP active, ignore io requests. */
 
-   DBG("start_xfr() io=%p, cnt=%d\n", io, io->total);
+   pthread_mutex_lock(&ps->io_mutex);
 
-   tmo = (int)((double) io->total * 0.021333);      /* timeout in ms = steps * period * 1000 */
-   tmo += 5000; /* plus 5 seconds */
+   list_for_each(p, &ps->head.list)
+   {
+      io = list_entry(p, struct rtstepper_io_req, list);
 
-   /* Allocate an asynchronous transfer. */
-   io->req = libusb_alloc_transfer(0);
-   libusb_fill_bulk_transfer(io->req, ps->fd_table.hd, DONGLE_OUT_EP, io->buf, io->total, xfr_cb, io, tmo);
+      ahead += io->total;
 
-   /* Kickoff the asynchronous io. */
-   if ((r = libusb_submit_transfer(io->req)) != 0)
-   {
-      BUG("invalid start_xfr: %s\n", libusb_error_name(r));
-      emc_post_estop_cb(ps);
-      goto bugout;
+      if (io->submitted)
+         continue;   /* already in flight */
+
+      if (ps->xfr_cnt >= ps->xfr_depth)
+         break;
+
+      DBG("start_xfr() io=%p, cnt=%d, in_flight=%d\n", io, io->total, ps->xfr_cnt);
+
+      tmo = (int)((double) ahead * 0.021333);      /* timeout in ms = steps * period * 1000, including transfers ahead of this one */
+      tmo += 5000; /* plus 5 seconds */
+
+      /* Use preallocated asynchronous transfers, the count must be set before the first one can complete. */
+      io->submitted = 1;
+      io->pending = ps->dongles;
+      io->error = 0;
+      io->submit_us = now_us();
+      for (i = 0; i < ps->dongles; i++)
+      {
+         libusb_fill_bulk_transfer(io->transfer[i], ps->fd_table[i].hd, DONGLE_OUT_EP, io->buf[i], io->total, xfr_cb, io, tmo);
+
+         /* Kickoff the asynchronous io. */
+         if ((r = submit_transfer(&ps->fd_table[i], io->transfer[i])) != 0)
+         {
+            BUG("invalid start_xfr dongle=%d: %s\n", i, libusb_error_name(r));
+            io->error = 1;
+            if (__sync_sub_and_fetch(&io->pending, ps->dongles - i) == 0)
+               io->submitted = 0;   /* nothing left in flight, cancel_xfr() removes the io request */
+            else
+               ps->xfr_cnt++;   /* xfr_cb() retires the io request when the submitted parts complete */
+            pthread_mutex_unlock(&ps->io_mutex);
+            emc_post_estop_cb(ps);
+            goto bugout;
+         }
+      }
+      ps->xfr_cnt++;
    }
 
+   pthread_mutex_unlock(&ps->io_mutex);
+
    stat = EMC_R_OK;
 bugout:
    return stat;
@@ -510,7 +863,7 @@ bugout:
 enum EMC_RESULT rtstepper_start_xfr(struct emc_session *ps, struct rtstepper_io_req *io, EmcPose pos)
 {
    enum EMC_RESULT stat = RTSTEPPER_R_IO_ERROR;
-   int i, j, mid, empty;
+   int i;
 
    if (io == NULL)
       goto bugout;
@@ -521,87 +874,104 @@ enum EMC_RESULT rtstepper_start_xfr(struct emc_session *ps, struct rtstepper_io_
    /* Save commanded position for this io request. */
    io->position = pos;
 
-   /* Finish last pulse for this step buffer. */
-   for (i = 0; i < ps->axes; i++)
-   {
-      if (ps->axis[i].step_pin == 0)
-         continue;   /* skip */
+   /* Convert active high step buffers to DB25 pin polarity. */
+   for (i = 0; i < ps->dongles; i++)
+      encode_polarity(io->buf[i], io->total, ps->polarity_mask[i]);
 
-      if (ps->axis[i].clk_tail)
-      {
-         /* Stretch pulse to 50% duty cycle. */
-         mid = (io->total - ps->axis[i].clk_tail) / 2;
-         for (j=0; j < mid; j++)
-         {
-            if (ps->axis[i].step_active_high)
-               io->buf[ps->axis[i].clk_tail + j] |= pin_map[ps->axis[i].step_pin]; /* set bit */
-            else
-               io->buf[ps->axis[i].clk_tail + j] &= ~pin_map[ps->axis[i].step_pin]; /* clear bit */
-         }
-         ps->axis[i].clk_tail = 0;  /* reset */
-      }
-   }
+   if (ps->capture != NULL)
+      rtstepper_capture_write(ps, io);
 
-   pthread_mutex_lock(&_mutex);
+   stat = rtstepper_queue_xfr(ps, io);
 
-   empty = list_empty(&ps->head.list);
+ bugout:
+   return stat;
+}       /* rtstepper_start_xfr() */
+
+/* Queue a step buffer that is already in DB25 pin polarity, used by rtstepper_start_xfr() and rtstepper_replay(). */
+enum EMC_RESULT rtstepper_queue_xfr(struct emc_session *ps, struct rtstepper_io_req *io)
+{
+   uint64_t gap;
+
+   pthread_mutex_lock(&ps->io_mutex);
+
+   if (ps->io_idle_us)
+   {
+      /* Queue ran empty in the middle of a program, the dongle was starved for this long. */
+      gap = now_us() - ps->io_idle_us;
+      ps->io_idle_us = 0;
+      __sync_fetch_and_add(&ps->io_stats.underrun_cnt, 1);
+      __sync_fetch_and_add(&ps->io_stats.underrun_us, gap);
+      hist_add(ps->io_stats.gap_hist, gap);
+   }
 
    /* Add io request to tail of the queue (FIFO). */
    list_add_tail(&io->list, &ps->head.list);
    ps->req_cnt++;
+   ps->queue_us += step_time_us(io->total);
 
-   pthread_mutex_unlock(&_mutex);
+   pthread_mutex_unlock(&ps->io_mutex);
 
-   if (empty)
-   {
-      /* Kick off first usb io request here. */
-      start_xfr(io);
-   }
+   /* Kick off usb io request here if there is room in the pipeline. */
+   start_xfr(ps);
 
-   stat = EMC_R_OK;
+   return EMC_R_OK;
+}       /* rtstepper_queue_xfr() */
 
- bugout:
-   return stat;
-}       /* rtstepper_start_xfr() */
+/* Start or stop counting io queue underruns, called at gcode program start, pause and end. */
+enum EMC_RESULT rtstepper_io_stats_run(struct emc_session *ps, int running)
+{
+   pthread_mutex_lock(&ps->io_mutex);
+   ps->io_running = running;
+   ps->io_idle_us = 0;
+   pthread_mutex_unlock(&ps->io_mutex);
+   return EMC_R_OK;
+}       /* rtstepper_io_stats_run() */
 
-/* Apply xfr hysteresis. */
-enum EMC_RESULT rtstepper_xfr_hysteresis(struct emc_session *ps)
+/* Block the caller until queued motion drains to us microseconds, a feed override or hold replan or ESTOP. */
+static void wait_queue(struct emc_session *ps, int64_t us)
 {
    struct timeval tv;
    struct timespec ts;
    int rc;
 
-   if (ps->req_cnt > RTSTEPPER_REQ_MAX)
+   do
+   {
+      gettimeofday(&tv, NULL);
+      ts.tv_sec = tv.tv_sec + 2;    /* 2 sec timeout */
+      ts.tv_nsec = 0;
+      rc=0;
+      pthread_mutex_lock(&ps->io_mutex);
+      while (ps->queue_us > us && (ps->state_bits & EMC_STATE_ESTOP_BIT)==0 && !ps->replan && rc==0)
+         rc = pthread_cond_timedwait(&ps->write_done_cond, &ps->io_mutex, &ts);
+      pthread_mutex_unlock(&ps->io_mutex);
+   } while (rc == ETIMEDOUT);
+}
+
+/* 
+ * Apply xfr hysteresis. Block the caller once queued motion exceeds the high water mark until it drains to the low
+ * water mark, so queued time (and step buffer memory) is bounded no matter how the gcode program is segmented.
+ */
+enum EMC_RESULT rtstepper_xfr_hysteresis(struct emc_session *ps)
+{
+   if (ps->queue_us > ps->queue_high_us)
    {
       DBG("rstepper_xfr_hysteresis() start...\n");
 
       /* Wait until IOs fall below minimum set point. */
-      do
-      {
-	 gettimeofday(&tv, NULL);
-	 ts.tv_sec = tv.tv_sec + 2;    /* 2 sec timeout */
-	 ts.tv_nsec = 0;
-	 rc=0;
-	 pthread_mutex_lock(&_mutex);
-	 while (ps->req_cnt > RTSTEPPER_REQ_MIN && (ps->state_bits & EMC_STATE_ESTOP_BIT)==0 && rc==0)
-	    rc = pthread_cond_timedwait(&_write_done_cond, &_mutex, &ts);
-	 pthread_mutex_unlock(&_mutex);
-      } while (rc == ETIMEDOUT);
+      wait_queue(ps, ps->queue_low_us);
 
       DBG("rstepper_xfr_hysteresis() done...\n");
    }
    return EMC_R_OK;
 }
 
-enum EMC_RESULT rtstepper_wait_xfr(struct emc_session *ps)
+/* Block the caller until the io queue is empty or ESTOP, or a feed override or hold replan if replan is set. */
+static void wait_empty(struct emc_session *ps, int replan)
 {
    struct timeval tv;
    struct timespec ts;
    int rc;
 
-   /* Wait for all IO to finish. */
-   DBG("rstepper_wait_xfr()\n");
-
    /*
     * Use ptread_cond_timedwait() here because spurious wakeups are not guaranteed. 
     * This means predicates may never get checked after pthread_cond_wait() thus
@@ -613,152 +983,345 @@ enum EMC_RESULT rtstepper_wait_xfr(struct emc_session *ps)
       ts.tv_sec = tv.tv_sec + 2;    /* 2 sec timeout */
       ts.tv_nsec = 0;
       rc=0;
-      pthread_mutex_lock(&_mutex);
-      while (list_empty(&ps->head.list)==0 && (ps->state_bits & EMC_STATE_ESTOP_BIT)==0 && rc==0)
-         rc = pthread_cond_timedwait(&_write_done_cond, &_mutex, &ts);
-      pthread_mutex_unlock(&_mutex);
+      pthread_mutex_lock(&ps->io_mutex);
+      while (list_empty(&ps->head.list)==0 && (ps->state_bits & EMC_STATE_ESTOP_BIT)==0 && !(replan && ps->replan) && rc==0)
+         rc = pthread_cond_timedwait(&ps->write_done_cond, &ps->io_mutex, &ts);
+      pthread_mutex_unlock(&ps->io_mutex);
    } while (rc == ETIMEDOUT);
+}
+
+enum EMC_RESULT rtstepper_wait_xfr(struct emc_session *ps)
+{
+   /* Wait for all IO to finish. */
+   DBG("rstepper_wait_xfr()\n");
+
+   wait_empty(ps, 0);
+
+   /* An empty queue is expected after an explicit wait (dwell, pause, mcode), it is not an underrun. */
+   pthread_mutex_lock(&ps->io_mutex);
+   ps->io_idle_us = 0;
+   pthread_mutex_unlock(&ps->io_mutex);
 
    DBG("rstepper_wait_xfr() done...\n");
    
    return EMC_R_OK;
 }
 
+/* Wait for all IO to finish like rtstepper_wait_xfr(), but return early on a feed override or hold so the caller can replan. */
+enum EMC_RESULT rtstepper_wait_xfr_replan(struct emc_session *ps)
+{
+   wait_empty(ps, 1);
+   if (ps->replan)
+      return EMC_R_OK;
+   return rtstepper_wait_xfr(ps);
+}  /* rtstepper_wait_xfr_replan() */
+
 struct rtstepper_io_req *rtstepper_alloc_io_req(struct emc_session *ps, int id)
 {
    struct rtstepper_io_req *io;
    
-   if (ps->fd_table.hd == NULL)
+   if (!is_open(&ps->fd_table[0]))
       return NULL;  /* no usb dongle available */
-   if (ps->state_bits & EMC_STATE_ESTOP_BIT)
-      return NULL;  /* ESTOP active, ignore io requests. */
 
-   if ((io = malloc(sizeof(struct rtstepper_io_req))) != NULL)
+   /* Get a step buffer from the pool, if all are queued wait for xfr_cb() to recycle one. */
+   while ((io = pool_get(&ps->pool)) == NULL)
    {
-      io->id = id;
-      io->buf = NULL;
-      io->buf_size = 0;
-      io->total = 0;
-      io->session = ps;
-      io->req = NULL;
+      if (ps->state_bits & EMC_STATE_ESTOP_BIT)
+         return NULL;
+      esleep(0.001);   /* 1ms */
+   }
+
+   if (ps->state_bits & EMC_STATE_ESTOP_BIT)
+   {
+      pool_put(&ps->pool, io);
+      return NULL;  /* ESTOP active, ignore io requests. */
    }
+
+   io->id = id;
+   io->total = 0;
+   io->submitted = 0;
+   io->pending = 0;
+   io->error = 0;
+   io->snap = NULL;
    return io;
 }  /* rtstepper_io_req() */
 
-/*
- * Given a command position in counts for each axis, encode each value into a single step/direction byte. 
- * Store the byte in buffer that is big enough to hold a complete stepper motor move.
- */
-enum EMC_RESULT rtstepper_encode(struct emc_session *ps, struct rtstepper_io_req *io, double index[])
+/* Return an io request that was never dispatched to the pool. */
+void rtstepper_free_io_req(struct emc_session *ps, struct rtstepper_io_req *io)
 {
-   int i, j, step, mid, new_size, stat = RTSTEPPER_R_MALLOC_ERROR;
-   static unsigned int cnt = 0;
-   unsigned char *tmp;
+   if (io != NULL)
+      pool_put(&ps->pool, io);
+}  /* rtstepper_free_io_req() */
 
-   if (io == NULL)
+/* Allocate cache line aligned memory. */
+static void *aligned_malloc(size_t size)
+{
+#if (defined(__WIN32__) || defined(_WINDOWS))
+   return _aligned_malloc(size, RTSTEPPER_CACHE_LINE);
+#else
+   void *p;
+   if (posix_memalign(&p, RTSTEPPER_CACHE_LINE, size) != 0)
+      return NULL;
+   return p;
+#endif
+}  /* aligned_malloc() */
+
+static void aligned_free(void *p)
+{
+#if (defined(__WIN32__) || defined(_WINDOWS))
+   _aligned_free(p);
+#else
+   free(p);
+#endif
+}  /* aligned_free() */
+
+/* 
+ * Create the io request pool. All descriptors, step buffers and libusb transfers are allocated here once,
+ * so moving never calls malloc/free. Pool count and buffer size are set from the ini file in emc_ui_open().
+ * Each io request has one step buffer and one transfer per dongle.
+ */
+enum EMC_RESULT rtstepper_pool_open(struct emc_session *ps)
+{
+   struct rtstepper_io_pool *pp = &ps->pool;
+   struct rtstepper_io_req *io;
+   enum EMC_RESULT stat = RTSTEPPER_R_MALLOC_ERROR;
+   size_t stride;
+   int i, d;
+
+   stride = (pp->buf_size + RTSTEPPER_CACHE_LINE - 1) & ~(RTSTEPPER_CACHE_LINE - 1);
+
+   pp->io = aligned_malloc(sizeof(struct rtstepper_io_req) * pp->count);
+   if (pp->io != NULL)
+      memset(pp->io, 0, sizeof(struct rtstepper_io_req) * pp->count);
+   pp->buf = aligned_malloc(stride * pp->count * ps->dongles);
+   pp->next = malloc(sizeof(uint32_t) * pp->count);
+   if (pp->io == NULL || pp->buf == NULL || pp->next == NULL)
+   {
+      BUG("unable to malloc step buffer pool count=%d size=%d\n", pp->count, pp->buf_size);
       goto bugout;
+   }
 
-   if (io->buf == NULL || (io->buf_size - io->total) < 2)
+   for (i = 0; i < pp->count; i++)
    {
-      new_size = (io->buf_size < STEP_BUF_CHUNK) ? STEP_BUF_CHUNK : io->buf_size * 2;
-      if ((tmp = (unsigned char *)realloc(io->buf, new_size)) == NULL)
+      io = &pp->io[i];
+      io->index = i;
+      io->session = ps;
+      io->buf_size = pp->buf_size;
+      for (d = 0; d < ps->dongles; d++)
       {
-         free(io->buf);
-         io->buf = NULL;
-         BUG("unable to malloc step buffer size=%d\n", new_size);
-         goto bugout;   /* bail */
+         io->buf[d] = pp->buf + stride * (i * ps->dongles + d);
+         if ((io->transfer[d] = libusb_alloc_transfer(0)) == NULL)
+         {
+            BUG("unable to malloc usb transfer\n");
+            goto bugout;
+         }
       }
-      io->buf = tmp;
-      io->buf_size = new_size;
+      pp->next[i] = (i + 1 < pp->count) ? (uint32_t)(i + 1) : POOL_EMPTY;
    }
+   pp->top = 0;   /* tag=0, index=0 */
+
+   DBG("rtstepper_pool_open() count=%d size=%d dongles=%d\n", pp->count, pp->buf_size, ps->dongles);
+
+   stat = EMC_R_OK;
+
+ bugout:
+   if (stat != EMC_R_OK)
+      rtstepper_pool_close(ps);
+   return stat;
+}  /* rtstepper_pool_open() */
+
+enum EMC_RESULT rtstepper_pool_close(struct emc_session *ps)
+{
+   struct rtstepper_io_pool *pp = &ps->pool;
+   int i, d;
+
+   if (pp->io != NULL)
+   {
+      for (i = 0; i < pp->count; i++)
+      {
+         for (d = 0; d < RTSTEPPER_DONGLE_MAX; d++)
+         {
+            if (pp->io[i].transfer[d] != NULL)
+               libusb_free_transfer(pp->io[i].transfer[d]);
+         }
+      }
+      aligned_free(pp->io);
+      pp->io = NULL;
+   }
+   if (pp->buf != NULL)
+   {
+      aligned_free(pp->buf);
+      pp->buf = NULL;
+   }
+   free(pp->next);
+   pp->next = NULL;
+   pp->top = POOL_EMPTY;
+   return EMC_R_OK;
+}  /* rtstepper_pool_close() */
 
+/* Precompute per-axis step/direction masks and the per-dongle DB25 pin polarity masks from the ini pin assignments. */
+static void init_encoder(struct emc_session *ps)
+{
+   struct emc_axis *pa;
+   int i;
+
+   memset(ps->polarity_mask, 0, sizeof(ps->polarity_mask));
+   ps->encode_axes = 0;
    for (i = 0; i < ps->axes; i++)
    {
+      pa = &ps->axis[i];
+      pa->pulse_left = 0;
+      pa->direction = 0;
+      pa->step_mask = 0;
+      pa->direction_mask = 0;
+
       /* Check DB25 pin assignments for this axis, if no pins are assigned skip this axis. Useful for XYZABC axes where AB are unused. */
-      if (ps->axis[i].step_pin == 0 || ps->axis[i].direction_pin == 0)
+      if (pa->step_pin == 0 || pa->direction_pin == 0)
          continue;   /* skip */
-
-      /* Set step bit to default state, high if low_true logic or low if high_true logic. */
-      if (ps->axis[i].step_active_high)
-      {
-         io->buf[io->total] &= ~pin_map[ps->axis[i].step_pin];
-         io->buf[io->total + 1] &= ~pin_map[ps->axis[i].step_pin];
-      }
-      else
+      if (pa->dongle < 0 || pa->dongle >= ps->dongles)
       {
-         io->buf[io->total] |= pin_map[ps->axis[i].step_pin];
-         io->buf[io->total + 1] |= pin_map[ps->axis[i].step_pin];
+         BUG("invalid axis=%d dongle=%d dongles=%d, axis disabled\n", i, pa->dongle, ps->dongles);
+         continue;
       }
 
-      /* Set direction bit to default state, high if low_true logic or low if high_true logic. */
-      if (ps->axis[i].direction_active_high)
-      {
-         io->buf[io->total] &= ~pin_map[ps->axis[i].direction_pin];
-         io->buf[io->total + 1] &= ~pin_map[ps->axis[i].direction_pin];
-      }
-      else
-      {
-         io->buf[io->total] |= pin_map[ps->axis[i].direction_pin];
-         io->buf[io->total + 1] |= pin_map[ps->axis[i].direction_pin];
-      }
+      pa->step_mask = pin_map[pa->step_pin];
+      pa->direction_mask = pin_map[pa->direction_pin];
+      if (!pa->step_active_high)
+         ps->polarity_mask[pa->dongle] |= pa->step_mask;
+      if (!pa->direction_active_high)
+         ps->polarity_mask[pa->dongle] |= pa->direction_mask;
+      ps->encode_axis[ps->encode_axes++] = i;
+   }
+}       /* init_encoder() */
 
-      /* Calculate the step pulse for this clock cycle */
-      step = round(index[i] * ps->axis[i].steps_per_unit) - ps->axis[i].master_index;
+/* Convert a command position to DDA fixed point steps. */
+static int64_t encode_dda_pos(double index, double steps_per_unit)
+{
+   return (int64_t)llround(index * steps_per_unit * (double)((int64_t)1 << RTSTEPPER_DDA_SHIFT));
+}       /* encode_dda_pos() */
 
-      if (step < -1 || step > 1)
-      {
-         if (cnt++ < 30)
-         {
-            BUG("invalid step value: id=%d axis=%d cmd_pos=%0.8f master_index=%d input_scale=%0.2f step=%d\n",
-                io->id, i, index[i], ps->axis[i].master_index, ps->axis[i].steps_per_unit, step);
-         }
-         step = 0;
-      }
+/* Apply DB25 pin polarity. Step buffers are encoded in active high logic, flip the low true pins eight bytes at a time. */
+static void encode_polarity(unsigned char *buf, int total, unsigned char polarity_mask)
+{
+   uint64_t *p = (uint64_t *)buf, mask = polarity_mask * 0x0101010101010101ULL;
+   int i, words = total / 8;
+
+   if (polarity_mask == 0)
+      return;
+
+   for (i = 0; i < words; i++)
+      p[i] ^= mask;
+   for (i = words * 8; i < total; i++)
+      buf[i] ^= polarity_mask;
+}       /* encode_polarity() */
 
-      if (step)
+/*
+ * Given a block of n servo period end positions for each axis, index[axis][period], encode the ps->servo_steps
+ * cycles of each period into two step/direction bytes per cycle. Store the bytes in the io request step buffer,
+ * caller must dispatch the buffer when it is full. Each period is a constant velocity segment run by an integer
+ * digital differential analyzer (DDA) on fixed point step positions, each cycle is an add and a compare. A segment
+ * ends exactly on its end position so step counts never drift. Bytes are built in active high logic using the masks
+ * from init_encoder(), rtstepper_start_xfr() applies the pin polarity. Step pulses are a fixed width (ini: TASK,
+ * STEP_PULSE_WIDTH) carried forward in pulse_left, encoded bytes are never rewritten so a buffer is complete as soon
+ * as it is encoded.
+ */
+enum EMC_RESULT rtstepper_encode(struct emc_session *ps, struct rtstepper_io_req *io, double index[][RTSTEPPER_ENCODE_BLOCK], int n)
+{
+   const int64_t half = (int64_t)1 << (RTSTEPPER_DDA_SHIFT - 1);
+   struct emc_axis *pa;
+   unsigned char *buf, dir;
+   int64_t pos, end, vel;
+   int a, i, k, c, cycles, count, step, prev, left, width, stat = RTSTEPPER_R_MALLOC_ERROR;
+   static unsigned int cnt = 0;
+
+   if (io == NULL)
+      goto bugout;
+
+   cycles = n * ps->servo_steps;
+   if (n > RTSTEPPER_ENCODE_BLOCK || cycles > (io->buf_size - io->total) / 2)
+   {
+      BUG("step buffer overflow size=%d\n", io->buf_size);
+      goto bugout;   /* bail */
+   }
+
+   /* Step buffers are recycled, start with all bits inactive. */
+   for (i = 0; i < ps->dongles; i++)
+      memset(io->buf[i] + io->total, 0, cycles * 2);
+   width = ps->step_pulse_width;
+
+   for (a = 0; a < ps->encode_axes; a++)
+   {
+      i = ps->encode_axis[a];
+      pa = &ps->axis[i];
+      buf = io->buf[pa->dongle] + io->total;
+
+      pos = pa->dda_pos;
+      prev = pa->master_index;
+      left = pa->pulse_left;
+      dir = (pa->direction < 0) ? pa->direction_mask : 0;
+      for (k = 0, c = 0; k < n; k++)
       {
-         /* Got a valid step pulse this cycle. */
-         if (ps->axis[i].clk_tail)
+         /* Constant velocity segment to the end of this servo period, last cycle lands on the end. */
+         end = encode_dda_pos(index[i][k], pa->steps_per_unit);
+         vel = (end - pos) / ps->servo_steps;
+         for (cycles = ps->servo_steps; cycles > 0; cycles--, c++)
          {
-            /* Using the second pulse, stretch pulse to 50% duty cycle. */
-            mid = (io->total - ps->axis[i].clk_tail) / 2;
-            for (j=0; j < mid; j++)
+            pos = (cycles == 1) ? end : pos + vel;
+            count = (int)((pos + half) >> RTSTEPPER_DDA_SHIFT);
+            step = count - prev;
+
+            if (step < -1 || step > 1)
             {
-               if (ps->axis[i].step_active_high)
-                  io->buf[ps->axis[i].clk_tail + j] |= pin_map[ps->axis[i].step_pin]; /* set bit */
-               else
-                  io->buf[ps->axis[i].clk_tail + j] &= ~pin_map[ps->axis[i].step_pin]; /* clear bit */
+               /* Over one step per cycle, step once and catch up in the following cycles. */
+               if (cnt++ < 30)
+               {
+                  BUG("invalid step value: id=%d axis=%d cmd_pos=%0.8f master_index=%d input_scale=%0.2f step=%d\n",
+                      io->id, i, index[i][k], prev, pa->steps_per_unit, step);
+               }
+               step = (step < 0) ? -1 : 1;
             }
-         }
+            prev += step;
 
-         /* save old step location */
-         ps->axis[i].clk_tail = io->total;
+            if (step)
+            {
+               /* Got a valid step pulse this cycle, save step direction. */
+               pa->direction = step;
+               dir = (step < 0) ? pa->direction_mask : 0;
+            }
 
-         /* save step direction */
-         ps->axis[i].direction = step;
-      }
+            if (step && left > 0)
+            {
+               /* Previous pulse is still active, first byte is the falling edge, rising edge on the second byte. */
+               left = width;
+               buf[c * 2 + 1] |= pa->step_mask;
+            }
+            else
+            {
+               /* Pulse is active for width bytes after the rising edge, followed by at least one inactive byte. */
+               if (step)
+                  left = width + 1;
+               if (left > 1)
+                  buf[c * 2] |= pa->step_mask;
+               if (left > 0)
+                  left--;
+               if (left > 1)
+                  buf[c * 2 + 1] |= pa->step_mask;
+               if (left > 0)
+                  left--;
+            }
 
-      /* Set direction bit. */
-      if (ps->axis[i].direction < 0)
-      {
-         if (ps->axis[i].direction_active_high)
-         {
-            io->buf[io->total] |= pin_map[ps->axis[i].direction_pin];    /* set bit */
-            io->buf[io->total + 1] |= pin_map[ps->axis[i].direction_pin];  /* set bit */
-         }
-         else
-         {
-            io->buf[io->total] &= ~pin_map[ps->axis[i].direction_pin];       /* clear bit */
-            io->buf[io->total + 1] &= ~pin_map[ps->axis[i].direction_pin];   /* clear bit */
+            /* Set direction bit. */
+            buf[c * 2] |= dir;
+            buf[c * 2 + 1] |= dir;
          }
       }
 
-      ps->axis[i].master_index += step;
-
-//      DBG("axis=%d index=%0.6f master_index=%d\n", i, index[i] * ps->axis[i].steps_per_unit, ps->axis[i].master_index);
-   }    /* for (i=0; i < num_axis; i++) */
+      pa->dda_pos = pos;
+      pa->master_index = prev;
+      pa->pulse_left = left;
+   }    /* for (a=0; a < encode_axes; a++) */
 
-   io->total += 2;
+   io->total += n * ps->servo_steps * 2;
 
    stat = EMC_R_OK;
 
@@ -768,7 +1331,14 @@ enum EMC_RESULT rtstepper_encode(struct emc_session *ps, struct rtstepper_io_req
 
 int rtstepper_is_connected(struct emc_session *ps)
 {
-   return ps->fd_table.hd != NULL;
+   int i;
+
+   for (i = 0; i < ps->dongles; i++)
+   {
+      if (!is_open(&ps->fd_table[i]))
+         return 0;
+   }
+   return ps->dongles > 0;
 }       /* rtstepper_is_connected() */
 
 enum EMC_RESULT rtstepper_home(struct emc_session *ps)
@@ -777,69 +1347,85 @@ enum EMC_RESULT rtstepper_home(struct emc_session *ps)
 
    DBG("rtstepper_home()\n");
    for (i = 0; i < ps->axes; i++)
+   {
       ps->axis[i].master_index = 0.0;
+      ps->axis[i].dda_pos = 0;
+   }
    return EMC_R_OK;
 }       /* rtstepper_home() */
 
 enum EMC_RESULT rtstepper_estop(struct emc_session *ps, int thread)
 {
-   struct rtstepper_file_descriptor *pfd = &ps->fd_table;
+   struct rtstepper_file_descriptor *pfd;
    enum EMC_RESULT stat = RTSTEPPER_R_REQ_ERROR;
+   int i, r;
 
-   ps->state_bits |= EMC_STATE_ESTOP_BIT;
+   __sync_fetch_and_or(&ps->state_bits, EMC_STATE_ESTOP_BIT);
    DBG("rtstepper_estop()\n");
 
-   if (pfd->hd == NULL)
+   /* Wake io waits and a feed hold. */
+   pthread_mutex_lock(&ps->io_mutex);
+   pthread_cond_broadcast(&ps->write_done_cond);
+   pthread_mutex_unlock(&ps->io_mutex);
+
+   if (!is_open(&ps->fd_table[0]))
       goto bugout;
 
-   if (thread != RTSTEPPER_DONGLE_THREAD)
+   if (thread == RTSTEPPER_EVENT_THREAD)
    {
-      /* Wait for dongle_thread to shutdown before sending abort. */
-      pfd->dongle_done = 1;
-      pthread_mutex_lock(&_mutex);
-      while (!pfd->dongle_abort_done)
-         pthread_cond_wait(&_dongle_done_cond, &_mutex);
-      pthread_mutex_unlock(&_mutex);
+      /* Called from a transfer callback, synchronous usb io is not allowed here. Send the abort asynchronously to every dongle. */
+      for (i = 0; i < ps->dongles; i++)
+      {
+         pfd = &ps->fd_table[i];
+         if (!is_open(pfd) || pfd->abort_busy)
+            continue;
+         libusb_fill_control_setup(pfd->abort_buf, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
+                                   STEP_ABORT_SET, 0x0, DONGLE_INTERFACE, 0);
+         libusb_fill_control_transfer(pfd->abort_xfr, pfd->hd, pfd->abort_buf, abort_cb, pfd, LIBUSB_CONTROL_REQ_TIMEOUT);
+         pfd->abort_busy = 1;
+         if ((r = submit_transfer(pfd, pfd->abort_xfr)) != 0)
+         {
+            pfd->abort_busy = 0;
+            BUG("set_abort failed dongle=%d: %s\n", i, libusb_error_name(r));
+         }
+      }
+      cancel_xfr(ps);
    }
+   else
+      rtstepper_set_abort(ps);
 
-   rtstepper_set_abort(ps);
    stat = EMC_R_OK;
 
 bugout:
    return stat;
 }       /* rtstepper_estop() */
 
-/* Set abort state in dongle. */
 enum EMC_RESULT rtstepper_set_abort(struct emc_session *ps)
 {
-   enum EMC_RESULT stat;
-   int len;
+   enum EMC_RESULT stat = EMC_R_OK;
+   int i, len;
 
    DBG("rtstepper_set_abort() state=%x\n", ps->state_bits);
 
-   if (ps->fd_table.hd == NULL)
+   if (!is_open(&ps->fd_table[0]))
    {
       stat = RTSTEPPER_R_REQ_ERROR;
       goto bugout;
    }
 
-   len = libusb_control_transfer(ps->fd_table.hd, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,      /* bmRequestType */
-                         STEP_ABORT_SET,        /* bRequest */
-                         0x0,   /* wValue */
-                         DONGLE_INTERFACE, /* wIndex */
-                         NULL, 0, LIBUSB_CONTROL_REQ_TIMEOUT);
-
-   if (len < 0)
+   /* Abort every dongle even if one fails, so no axis group keeps stepping. */
+   for (i = 0; i < ps->dongles; i++)
    {
-      BUG("set_abort failed ret=%d: %s\n", len, libusb_error_name(len));
-      stat = RTSTEPPER_R_IO_ERROR;
-      goto bugout;
+      len = control_transfer(&ps->fd_table[i], LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE, STEP_ABORT_SET, NULL, 0);
+      if (len < 0)
+      {
+         BUG("set_abort failed dongle=%d ret=%d: %s\n", i, len, libusb_error_name(len));
+         stat = RTSTEPPER_R_IO_ERROR;
+      }
    }
 
    cancel_xfr(ps);
 
-   stat = EMC_R_OK;
-
  bugout:
    return stat;
 }       /* rtstepper_set_abort() */
@@ -848,29 +1434,27 @@ enum EMC_RESULT rtstepper_set_abort(struct emc_session *ps)
 enum EMC_RESULT rtstepper_clear_abort(struct emc_session *ps)
 {
    enum EMC_RESULT stat;
-   int len;
+   int i, len;
 
-   if (ps->fd_table.hd == NULL)
+   if (!is_open(&ps->fd_table[0]))
    {
       stat = RTSTEPPER_R_REQ_ERROR;
       goto bugout;
    }
 
-   len = libusb_control_transfer(ps->fd_table.hd, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,      /* bmRequestType */
-                         STEP_ABORT_CLEAR,      /* bRequest */
-                         0x0,   /* wValue */
-                         DONGLE_INTERFACE, /* wIndex */
-                         NULL, 0, LIBUSB_CONTROL_REQ_TIMEOUT);
-
-   if (len < 0)
+   for (i = 0; i < ps->dongles; i++)
    {
-      BUG("clear_abort failed ret=%d: %s\n", len, libusb_error_name(len));
-      stat = RTSTEPPER_R_IO_ERROR;
-      goto bugout;
+      len = control_transfer(&ps->fd_table[i], LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE, STEP_ABORT_CLEAR, NULL, 0);
+      if (len < 0)
+      {
+         BUG("clear_abort failed dongle=%d ret=%d: %s\n", i, len, libusb_error_name(len));
+         stat = RTSTEPPER_R_IO_ERROR;
+         goto bugout;
+      }
    }
 
-   /* Reset step_state_inputx_bit for rtstepper_is_inputx_triggered(). */
-   ps->old_state_bits &= ~(RTSTEPPER_STEP_STATE_INPUT0_BIT | RTSTEPPER_STEP_STATE_INPUT1_BIT | RTSTEPPER_STEP_STATE_INPUT2_BIT);
+   /* Reset step_state_inputx_bit for rtstepper_is_inputx_triggered(), the event threads may be latching them. */
+   __sync_fetch_and_and(&ps->old_state_bits, ~(RTSTEPPER_STEP_STATE_INPUT0_BIT | RTSTEPPER_STEP_STATE_INPUT1_BIT | RTSTEPPER_STEP_STATE_INPUT2_BIT));
 
    stat = EMC_R_OK;
 
@@ -880,81 +1464,24 @@ enum EMC_RESULT rtstepper_clear_abort(struct emc_session *ps)
 
 enum EMC_RESULT rtstepper_is_input0_triggered(struct emc_session *ps)
 {
-   enum EMC_RESULT stat = RTSTEPPER_R_INPUT_FALSE;
-   int new_bit, old_bit;
-
-   if (ps->fd_table.hd == NULL)
-      goto bugout;
-
-   old_bit = ps->old_state_bits & RTSTEPPER_STEP_STATE_INPUT0_BIT;
-   if (ps->input0_abort_enabled)
-   {
-      new_bit = ps->state_bits & RTSTEPPER_STEP_STATE_INPUT0_BIT;
-      if ((new_bit == RTSTEPPER_STEP_STATE_INPUT0_BIT) && (old_bit == 0))
-      {
-         /* Found input0 low to high transition. */
-         stat = RTSTEPPER_R_INPUT_TRUE;
-      }
-      ps->old_state_bits |= new_bit;
-   }
-
- bugout:
-   return stat;
+   return input_triggered(ps, ps->state_bits, RTSTEPPER_STEP_STATE_INPUT0_BIT, ps->input0_abort_enabled);
 }       /* rtstepper_is_input0_triggered() */
 
 enum EMC_RESULT rtstepper_is_input1_triggered(struct emc_session *ps)
 {
-   enum EMC_RESULT stat = RTSTEPPER_R_INPUT_FALSE;
-   int new_bit, old_bit;
-
-   if (ps->fd_table.hd == NULL)
-      goto bugout;
-
-   old_bit = ps->old_state_bits & RTSTEPPER_STEP_STATE_INPUT1_BIT;
-   if (ps->input1_abort_enabled)
-   {
-      new_bit = ps->state_bits & RTSTEPPER_STEP_STATE_INPUT1_BIT;
-      if ((new_bit == RTSTEPPER_STEP_STATE_INPUT1_BIT) && (old_bit == 0))
-      {
-         /* Found input1 low to high transition. */
-         stat = RTSTEPPER_R_INPUT_TRUE;
-      }
-      ps->old_state_bits |= new_bit;
-   }
-
- bugout:
-   return stat;
+   return input_triggered(ps, ps->state_bits, RTSTEPPER_STEP_STATE_INPUT1_BIT, ps->input1_abort_enabled);
 }       /* rtstepper_is_input1_triggered() */
 
 enum EMC_RESULT rtstepper_is_input2_triggered(struct emc_session *ps)
 {
-   enum EMC_RESULT stat = RTSTEPPER_R_INPUT_FALSE;
-   int new_bit, old_bit;
-
-   if (ps->fd_table.hd == NULL)
-      goto bugout;
-
-   old_bit = ps->old_state_bits & RTSTEPPER_STEP_STATE_INPUT2_BIT;
-   if (ps->input2_abort_enabled)
-   {
-      new_bit = ps->state_bits & RTSTEPPER_STEP_STATE_INPUT2_BIT;
-      if ((new_bit == RTSTEPPER_STEP_STATE_INPUT2_BIT) && (old_bit == 0))
-      {
-         /* Found input2 low to high transition. */
-         stat = RTSTEPPER_R_INPUT_TRUE;
-      }
-      ps->old_state_bits |= new_bit;
-   }
-
- bugout:
-   return stat;
+   return input_triggered(ps, ps->state_bits, RTSTEPPER_STEP_STATE_INPUT2_BIT, ps->input2_abort_enabled);
 }       /* rtstepper_is_input2_triggered() */
 
 enum EMC_RESULT rtstepper_input0_state(struct emc_session *ps)
 {
    enum EMC_RESULT stat = RTSTEPPER_R_INPUT_FALSE;
 
-   if (ps->fd_table.hd == NULL)
+   if (!is_open(&ps->fd_table[0]))
       goto bugout;
 
    if (ps->old_state_bits & RTSTEPPER_STEP_STATE_INPUT0_BIT)
@@ -968,7 +1495,7 @@ enum EMC_RESULT rtstepper_input1_state(struct emc_session *ps)
 {
    enum EMC_RESULT stat = RTSTEPPER_R_INPUT_FALSE;
 
-   if (ps->fd_table.hd == NULL)
+   if (!is_open(&ps->fd_table[0]))
       goto bugout;
 
    if (ps->old_state_bits & RTSTEPPER_STEP_STATE_INPUT1_BIT)
@@ -982,7 +1509,7 @@ enum EMC_RESULT rtstepper_input2_state(struct emc_session *ps)
 {
    enum EMC_RESULT stat = RTSTEPPER_R_INPUT_FALSE;
 
-   if (ps->fd_table.hd == NULL)
+   if (!is_open(&ps->fd_table[0]))
       goto bugout;
 
    if (ps->old_state_bits & RTSTEPPER_STEP_STATE_INPUT2_BIT)
@@ -993,7 +1520,8 @@ enum EMC_RESULT rtstepper_input2_state(struct emc_session *ps)
 }       /* rtstepper_input2_state() */
 
 /* 
- * Read dongle state bits. Blocks on 1ms intervals. Returns following bitfield definitions.
+ * Read dongle state bits synchronously, event_thread normally polls them asynchronously (see status_poll()). 
+ * Blocks on 1ms intervals. Returns following bitfield definitions.
  *    abort_bit = 0x1
  *    empty_bit = 0x2 
  *    input0_bit = 0x8 
@@ -1005,37 +1533,34 @@ enum EMC_RESULT rtstepper_query_state(struct emc_session *ps)
 {
    struct step_query query_response;
    enum EMC_RESULT stat;
-   int len;
-   static unsigned int cnt = 0;
-   static int good_query = 0;
-
-   /* Clear dongle state bits. */
-   ps->state_bits &= ~(RTSTEPPER_STEP_STATE_INPUT0_BIT | RTSTEPPER_STEP_STATE_INPUT1_BIT | RTSTEPPER_STEP_STATE_INPUT2_BIT |
-                       RTSTEPPER_STEP_STATE_ABORT_BIT | RTSTEPPER_STEP_STATE_EMPTY_BIT | RTSTEPPER_STEP_STATE_STALL_BIT );
+   struct rtstepper_file_descriptor *pfd;
+   int i, len;
 
-   if (ps->fd_table.hd == NULL)
+   if (!is_open(&ps->fd_table[0]))
    {
       stat = RTSTEPPER_R_REQ_ERROR;
       goto bugout;
    }
 
-   len = libusb_control_transfer(ps->fd_table.hd, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,      /* bmRequestType */
-                         STEP_QUERY,    /* bRequest */
-                         0x0,   /* wValue */
-                         DONGLE_INTERFACE, /* wIndex */
-                         (unsigned char *)&query_response, sizeof(query_response), LIBUSB_CONTROL_REQ_TIMEOUT);
-
-   if (len != sizeof(query_response))
+   for (i = 0; i < ps->dongles; i++)
    {
-      if (cnt++ < 30)
-         BUG("invalid usb query_response len=%d good_query_cnt=%d: %s\n", len, good_query, libusb_error_name(len));
-      stat = RTSTEPPER_R_IO_ERROR;
-      goto bugout;
+      pfd = &ps->fd_table[i];
+      len = control_transfer(pfd, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE, STEP_QUERY, (unsigned char *)&query_response, sizeof(query_response));
+
+      if (len != sizeof(query_response))
+      {
+         if (__sync_fetch_and_add(&pfd->query_bad, 1) < 30)
+            BUG("invalid usb query_response dongle=%d len=%d good_query_cnt=%d: %s\n", i, len, pfd->query_good, libusb_error_name(len));
+         stat = RTSTEPPER_R_IO_ERROR;
+         goto bugout;
+      }
+      else
+         __sync_fetch_and_add(&pfd->query_good, 1);
+      pfd->state_bits = query_response.state_bits._word;
+      pfd->trip_cnt = query_response.trip_cnt;
    }
-   else
-      good_query++;
 
-   ps->state_bits |= query_response.state_bits._word;
+   update_state(ps, merge_state(ps));
    stat = EMC_R_OK;
 
  bugout:
@@ -1044,6 +1569,7 @@ enum EMC_RESULT rtstepper_query_state(struct emc_session *ps)
 
 enum EMC_RESULT rtstepper_open(struct emc_session *ps)
 {
+   struct rtstepper_file_descriptor *pfd;
    struct step_elements elements;
    enum EMC_RESULT stat = RTSTEPPER_R_IO_ERROR;
    int i, len;
@@ -1054,35 +1580,52 @@ enum EMC_RESULT rtstepper_open(struct emc_session *ps)
       return RTSTEPPER_R_IO_ERROR;
 
    ps->old_state_bits = 0;
-   for (i=0; i < ps->axes; i++)
-   {
-      ps->axis[i].clk_tail = 0;
-      ps->axis[i].direction = 0;
-   }
+   ps->xfr_cnt = 0;
+   ps->queue_us = 0;
+   ps->io_idle_us = 0;
+   memset(&ps->io_stats, 0, sizeof(ps->io_stats));
+   init_encoder(ps);
 
-   /* Open first usb device or usb device matching specified serial number. */
-   if ((stat = open_device(&ps->fd_table, ps->serial_num)) != EMC_R_OK)
+   for (i = 0; i < ps->dongles; i++)
    {
-      if (ps->serial_num[0])
-         MSG("unable to find rtstepper dongle serial number: %s\n", ps->serial_num);
-      else
-         MSG("unable to find rtstepper dongle\n");
-      goto bugout;
-   }
+      pfd = &ps->fd_table[i];
+      pfd->session = ps;
+      pfd->dongle = i;
+      pfd->state_bits = 0;
+      pfd->trip_cnt = 0;
+      pfd->query_good = 0;
+      pfd->query_bad = 0;
+
+      if (ps->emulate != RTSTEPPER_EMU_OFF)
+      {
+         /* Use software dongle emulator instead of usb device. */
+         if ((stat = open_emulator(pfd, ps->emulate)) != EMC_R_OK)
+         {
+            MSG("unable to open rtstepper dongle emulator\n");
+            goto bugout;
+         }
+      }
+      /* Open first usb device or usb device matching specified serial number. */
+      else if ((stat = open_device(pfd, ps->serial_num[i])) != EMC_R_OK)
+      {
+         if (ps->serial_num[i][0])
+            MSG("unable to find rtstepper dongle serial number: %s\n", ps->serial_num[i]);
+         else
+            MSG("unable to find rtstepper dongle\n");
+         goto bugout;
+      }
 
-   /* Clear any outstanding Abort and step count. */
-   memset(&elements, 0, sizeof(elements));
-   len = libusb_control_transfer(ps->fd_table.hd, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,      /* bmRequestType */
-                         STEP_SET,      /* bRequest */
-                         0x0,   /* wValue */
-                         DONGLE_INTERFACE, /* wIndex */
-                         (unsigned char *) &elements, sizeof(elements), LIBUSB_CONTROL_REQ_TIMEOUT);
+      /* Clear any outstanding Abort and step count. */
+      memset(&elements, 0, sizeof(elements));
+      len = control_transfer(pfd, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE, STEP_SET, (unsigned char *) &elements, sizeof(elements));
 
-   if (len != sizeof(elements))
-   {
-      BUG("unable to initialize dongle: %s\n", libusb_error_name(len));
-      close_device(&ps->fd_table);
-      goto bugout;
+      if (len != sizeof(elements))
+      {
+         BUG("unable to initialize dongle=%d: %s\n", i, libusb_error_name(len));
+         close_device(pfd);
+         stat = RTSTEPPER_R_IO_ERROR;
+         goto bugout;
+      }
    }
 
    /* Clear any outstanding io request in the queue. */
@@ -1091,19 +1634,46 @@ enum EMC_RESULT rtstepper_open(struct emc_session *ps)
    stat = EMC_R_OK;
 
  bugout:
+   if (stat != EMC_R_OK)
+   {
+      /* All axis groups or none, close the dongles already opened. */
+      while (--i >= 0)
+         close_device(&ps->fd_table[i]);
+   }
    return stat;
 }       /* rtstepper_open() */
 
 enum EMC_RESULT rtstepper_close(struct emc_session *ps)
 {
-   enum EMC_RESULT stat;
+   struct rtstepper_io_req *io;
+   struct list_head *p, *tmp;
+   enum EMC_RESULT stat = EMC_R_OK;
+   int i;
 
    DBG("rtstepper_close() ps=%p\n", ps);
 
    if (ps == NULL)
       return RTSTEPPER_R_IO_ERROR;
 
-   stat = close_device(&ps->fd_table);
+   for (i = 0; i < ps->dongles; i++)
+   {
+      if (close_device(&ps->fd_table[i]) != EMC_R_OK)
+         stat = RTSTEPPER_R_IO_ERROR;
+   }
+
+   /* Event thread is gone, no more xfr_cb() calls. Return any remaining io requests to the pool. */
+   pthread_mutex_lock(&ps->io_mutex);
+   list_for_each_safe(p, tmp, &ps->head.list)
+   {
+      io = list_entry(p, struct rtstepper_io_req, list);
+      list_del(&io->list);
+      io->submitted = 0;
+      pool_put(&ps->pool, io);
+   }
+   ps->req_cnt = 0;
+   ps->xfr_cnt = 0;
+   ps->queue_us = 0;
+   pthread_mutex_unlock(&ps->io_mutex);
 
    return stat;
 }       /* rtstepper_close() */
@@ -1149,7 +1719,14 @@ static int open_test_device(struct rtstepper_file_descriptor *pfd, const char *s
    
    libusb_init(&pfd->ctx);
    libusb_set_debug(pfd->ctx, 3);
-   n = libusb_get_device_list(pfd->ctx, &pfd->list_all);
+   if ((n = libusb_get_device_list(pfd->ctx, &pfd->list_all)) < 0)
+   {
+      BUG("invalid libusb_get_device_list: %s\n", libusb_error_name(n));
+      libusb_exit(pfd->ctx);
+      pfd->list_all = NULL;
+      pfd->ctx = NULL;
+      goto bugout;
+   }
 
    /* Look for rtstepper device(s). */
    for (i=0; i < n; i++)
@@ -1166,6 +1743,14 @@ static int open_test_device(struct rtstepper_file_descriptor *pfd, const char *s
    }
 
 bugout:
+   if (pfd->hd == NULL && pfd->list_all != NULL)
+   {
+      /* No interface claimed, free what release_interface() would have. */
+      libusb_free_device_list(pfd->list_all, 1);
+      libusb_exit(pfd->ctx);
+      pfd->list_all = NULL;
+      pfd->ctx = NULL;
+   }
    return stat;
 }       /* open_device() */
 
@@ -31,24 +31,107 @@
 
 #include <stdint.h>
 #include <pthread.h>
+#include <sys/time.h>
 #include <libusb.h>
 #include "list.h"
 #include "emc.h"
 
-struct rtstepper_io_req
+#define RTSTEPPER_CACHE_LINE 64
+
+/* Maximum number of dongles driven by one session, see ini file TASK SERIAL_NUMBER and AXIS_n DONGLE. */
+#define RTSTEPPER_DONGLE_MAX 3
+
+/* 
+ * One io request covers the same step cycles on every dongle in the session, buf[n] holds the step stream for
+ * dongle n. All parts are submitted together and the io request completes when the last part completes.
+ */
+struct __attribute__ ((aligned (RTSTEPPER_CACHE_LINE))) rtstepper_io_req
 {
    int id;
    EmcPose position;            // commanded position
-   unsigned char *buf;          /* step/direction buffer */
+   unsigned char *buf[RTSTEPPER_DONGLE_MAX];    /* step/direction buffer per dongle */
    int buf_size;                /* buffer size in bytes */
    int total;                   /* current buffer count, number of bytes used (total < buf_size) */
    struct emc_session *session;
-   struct libusb_transfer *req; 
+   int submitted;               /* 1 = in flight, guarded by io_mutex */
+   volatile int pending;        /* dongle transfers not yet completed */
+   int error;                   /* a dongle transfer failed */
+   struct libusb_transfer *transfer[RTSTEPPER_DONGLE_MAX];      /* preallocated transfer per dongle */
+   uint64_t submit_us;          /* time the transfer was submitted, see rtstepper_io_stats */
+   uint32_t index;              /* descriptor index in the io pool */
+   void *snap;                  /* planner state at the start of this step buffer, NULL = none, see dispatch.cc */
+   uint64_t snap_seq;           /* planner move log position of snap */
    struct list_head list;
 };
 
+/* Fixed-capacity pool of io request descriptors and step buffers, recycled through a lock-free free list. */
+struct rtstepper_io_pool
+{
+   struct rtstepper_io_req *io; /* descriptor array */
+   unsigned char *buf;          /* step buffer memory, count * stride bytes */
+   uint32_t *next;              /* free list links, index of next free descriptor */
+   volatile uint64_t top;       /* free list head, ABA tag in upper 32 bits, descriptor index in lower 32 bits */
+   int count;                   /* number of descriptors and step buffers (ini: TASK, STEP_BUF_COUNT) */
+   int buf_size;                /* step buffer size in bytes (ini: TASK, STEP_BUF_SIZE) */
+};
+
+/* Number of log2 histogram buckets, bucket 0 = 0us, bucket n = [2^(n-1), 2^n) us, the last bucket includes everything above. */
+#define RTSTEPPER_HIST_BUCKETS 32
+
+/* 
+ * IO layer instrumentation, see emc_ui_get_io_stats(). Counters are updated lock-free from the mech and usb event 
+ * threads, so a snapshot may be off by a transfer but never blocks the io path. 
+ */
+struct rtstepper_io_stats
+{
+   uint64_t xfr_cnt;            /* completed step buffer transfers */
+   uint64_t xfr_bytes;          /* completed step buffer bytes */
+   uint64_t underrun_cnt;       /* number of times the io queue ran empty while a gcode program was running */
+   uint64_t underrun_us;        /* total time the io queue was empty while a gcode program was running */
+   uint64_t query_cnt;          /* dongle status queries */
+   uint64_t empty_cnt;          /* status queries with the dongle EMPTY bit set while step data was queued */
+   uint64_t stall_cnt;          /* status queries with the dongle STALL bit set */
+   uint32_t trip_cnt;           /* last stall trip count summed over all dongles */
+   uint32_t reserved;
+   uint64_t latency_hist[RTSTEPPER_HIST_BUCKETS];       /* transfer submit to complete time */
+   uint64_t queue_hist[RTSTEPPER_HIST_BUCKETS];         /* queued motion sampled at each transfer completion */
+   uint64_t gap_hist[RTSTEPPER_HIST_BUCKETS];           /* duration of each io queue underrun */
+};
+
+/* EP0 Vendor Setup commands (bRequest). */
+enum STEP_CMD
+{
+   STEP_SET,                    /* set step elements, clear state bits */
+   STEP_QUERY,                  /* query current step and state info */
+   STEP_ABORT_SET,              /* set un-synchronized stop */
+   STEP_ABORT_CLEAR,            /* clear un-synchronized stop */
+};
+
+struct __attribute__ ((packed)) step_state
+{
+   union
+   {
+      uint16_t _word;
+   };
+};
+
+struct __attribute__ ((packed)) step_elements
+{
+   char reserved[8];
+};
+
+struct __attribute__ ((packed)) step_query
+{
+   struct step_state state_bits;
+   unsigned char reserved;
+   unsigned char trip_cnt;      /* stall trip count */
+   uint32_t step;               /* running step count */
+};
+
 struct rtstepper_file_descriptor
 {
+   struct emc_session *session;
+   int dongle;                  /* dongle index in the session */
    libusb_device_handle *hd;
    libusb_device **list_all;
    libusb_context *ctx;
@@ -56,11 +139,87 @@ struct rtstepper_file_descriptor
    int event_done;
    int event_abort_done;
    pthread_t event_tid;    /* thread handle */
-   int dongle_done;
-   int dongle_abort_done;
-   pthread_t dongle_tid;    /* thread handle */
+   struct libusb_transfer *status_xfr;   /* async STEP_QUERY, submitted by event_thread */
+   unsigned char status_buf[LIBUSB_CONTROL_SETUP_SIZE + sizeof(struct step_query)];
+   volatile int status_busy;             /* status_xfr in flight */
+   struct timeval status_next;           /* time of next STEP_QUERY */
+   struct libusb_transfer *abort_xfr;    /* async STEP_ABORT_SET, used from transfer callbacks */
+   unsigned char abort_buf[LIBUSB_CONTROL_SETUP_SIZE];
+   volatile int abort_busy;              /* abort_xfr in flight */
+   uint16_t state_bits;                  /* last STEP_QUERY state bits */
+   uint32_t trip_cnt;                    /* last STEP_QUERY stall trip count */
+   uint32_t query_good;                  /* good STEP_QUERY responses */
+   uint32_t query_bad;                   /* bad STEP_QUERY responses, only the first few are logged */
+   struct rtstepper_emu *emu;   /* software dongle emulator, NULL if using real hardware */
+};
+
+/* Step stream capture file, see rtstepper_cap.c. */
+#define RTSTEPPER_CAP_MAGIC 0x50435452  /* "RTCP" */
+#define RTSTEPPER_CAP_VERSION 2
+
+struct __attribute__ ((packed)) rtstepper_cap_header
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t period;             /* step clock period in ns, RTSTEPPER_PERIOD */
+   uint32_t axes;
+   uint32_t polarity_mask;      /* DB25 low true pins, already applied to the captured step bytes, one byte per dongle */
+   uint32_t step_pulse_width;   /* in step buffer bytes */
+   uint32_t buf_size;           /* STEP_BUF_SIZE at capture time */
+   uint32_t dongles;            /* step streams per record, 0 = 1 */
+};
+
+struct __attribute__ ((packed)) rtstepper_cap_record
+{
+   uint32_t seq;                /* record sequence number */
+   uint32_t io_index;           /* io request descriptor index in the io pool */
+   int32_t line;                /* gcode line number (io request id) */
+   uint32_t nbytes;             /* number of step bytes following this record, dongle streams back to back */
+   EmcPose position;            /* commanded position at the end of this io request */
 };
 
+/* 
+ * Event records have no step data, io_index is the event type. The state record holds the encoder and backlash state
+ * after the last step record, nbytes = axes * sizeof(struct rtstepper_cap_axis). Replay waits for the step data ahead
+ * of an M-code or dwell record before running it.
+ */
+#define RTSTEPPER_CAP_STATE 0xffffffff  /* axis state, struct rtstepper_cap_axis per axis */
+#define RTSTEPPER_CAP_MCODE 0xfffffffe  /* M-code plugin call, struct rtstepper_cap_mcode */
+#define RTSTEPPER_CAP_DELAY 0xfffffffd  /* dwell, double seconds */
+#define RTSTEPPER_CAP_EVENT 0xfffffff0  /* io_index >= RTSTEPPER_CAP_EVENT is an event record */
+
+struct __attribute__ ((packed)) rtstepper_cap_mcode
+{
+   int32_t index;               /* mcode number */
+   double p_number;
+   double q_number;
+};
+
+struct __attribute__ ((packed)) rtstepper_cap_axis
+{
+   int32_t master_index;
+   int32_t pulse_left;
+   int32_t direction;
+   int64_t dda_pos;
+   double backlash_corr;
+   double backlash_filt;
+   double backlash_vel;
+   double pos_cmd;
+   double vel_cmd;
+};
+
+/* Capture file position, a feed hold drops the records of step buffers that never reached the dongle. */
+struct rtstepper_cap_mark
+{
+   struct rtstepper_capture *capture;   /* capture file the mark belongs to, NULL = not capturing */
+   uint64_t offset;             /* file offset */
+   uint32_t seq;                /* next record sequence number */
+   uint64_t bytes;              /* step bytes written */
+   uint64_t hash;               /* FNV-1a hash of step bytes written */
+};
+
+#define RTSTEPPER_HASH_INIT 0xcbf29ce484222325ULL      /* FNV-1a 64 bit offset basis */
+
 #define RTSTEPPER_STEP_STATE_ABORT_BIT 0x01     /* abort step buffer, 1=True, 0=False (R/W) */
 #define RTSTEPPER_STEP_STATE_EMPTY_BIT 0x02     /* step buffer empty, 1=True, 0=False */
 #define RTSTEPPER_STEP_STATE_STALL_BIT 0x04     /* 1=True, 0=False */
@@ -69,14 +228,51 @@ struct rtstepper_file_descriptor
 #define RTSTEPPER_STEP_STATE_INPUT2_BIT 0x20    /* active high INPUT2, 1=True, 0=False */
 
 #define RTSTEPPER_MECH_THREAD 1
-#define RTSTEPPER_DONGLE_THREAD 0
+#define RTSTEPPER_EVENT_THREAD 0        /* called from a transfer callback */
+
+/* Dongle status query interval in ms, see ini file TASK STATUS_INTERVAL. */
+#define RTSTEPPER_STATUS_INTERVAL_DEFAULT 10
+
+/* Dongle emulation modes, see ini file TASK DONGLE_EMULATION. */
+#define RTSTEPPER_EMU_OFF 0         /* use real usb dongle */
+#define RTSTEPPER_EMU_REALTIME 1    /* emulate dongle at the real step clock rate */
+#define RTSTEPPER_EMU_TURBO 2       /* emulate dongle as fast as possible */
+
+/* Number of usb io requests kept in flight, see ini file TASK XFR_DEPTH. */
+#define RTSTEPPER_XFR_DEPTH_DEFAULT 2
+#define RTSTEPPER_XFR_DEPTH_MAX 8
+
+/* Streaming step buffer chunk size in bytes and number of step buffers, see ini file TASK STEP_BUF_SIZE and STEP_BUF_COUNT. */
+#define RTSTEPPER_STEP_BUF_SIZE_DEFAULT 65536
+#define RTSTEPPER_STEP_BUF_SIZE_MIN 1024
+#define RTSTEPPER_STEP_BUF_COUNT_DEFAULT 128
+#define RTSTEPPER_STEP_BUF_COUNT_MIN 4
 
-/* IO request hysteresis set points. */
-#define RTSTEPPER_REQ_MAX  100
-#define RTSTEPPER_REQ_MIN  50
+/* Step pulse width in microseconds, see ini file TASK STEP_PULSE_WIDTH. One step buffer byte is RTSTEPPER_PERIOD/2. */
+#define RTSTEPPER_STEP_PULSE_WIDTH_DEFAULT 43
+
+/* Number of servo periods encoded per rtstepper_encode() call. */
+#define RTSTEPPER_ENCODE_BLOCK 64
+
+/* Fraction bits of the step generator DDA fixed point step positions. */
+#define RTSTEPPER_DDA_SHIFT 32
+
+/* IO queue hysteresis set points in milliseconds of queued motion, see ini file TASK QUEUE_HIGH_WATER and QUEUE_LOW_WATER. */
+#define RTSTEPPER_QUEUE_HIGH_WATER_DEFAULT 2000
+#define RTSTEPPER_QUEUE_LOW_WATER_DEFAULT 1000
+#define RTSTEPPER_QUEUE_LOW_WATER_MIN 100
+
+/* 
+ * Feed override and feed hold latency in milliseconds of motion in usb transfers in flight, a change replans the step
+ * buffers queued behind them. See ini file TASK OVERRIDE_LATENCY, 0 = step buffers are only limited by STEP_BUF_SIZE.
+ */
+#define RTSTEPPER_OVERRIDE_LATENCY_DEFAULT 200
+#define RTSTEPPER_OVERRIDE_LATENCY_MIN 50
 
 /* Forward declarations. */
 struct emc_session;
+struct rtstepper_emu;
+struct rtstepper_capture;
 
 #ifdef __cplusplus
 extern "C"
@@ -90,9 +286,13 @@ extern "C"
    enum EMC_RESULT rtstepper_query_state(struct emc_session *ps);
    enum EMC_RESULT rtstepper_clear_abort(struct emc_session *ps);
    enum EMC_RESULT rtstepper_set_abort(struct emc_session *ps);
-   enum EMC_RESULT rtstepper_encode(struct emc_session *ps, struct rtstepper_io_req *io, double index[]);
+   enum EMC_RESULT rtstepper_encode(struct emc_session *ps, struct rtstepper_io_req *io, double index[][RTSTEPPER_ENCODE_BLOCK], int n);
    enum EMC_RESULT rtstepper_start_xfr(struct emc_session *ps, struct rtstepper_io_req *io, EmcPose pos);
+   enum EMC_RESULT rtstepper_queue_xfr(struct emc_session *ps, struct rtstepper_io_req *io);
+   enum EMC_RESULT rtstepper_io_stats_run(struct emc_session *ps, int running);
    enum EMC_RESULT rtstepper_wait_xfr(struct emc_session *ps);
+   enum EMC_RESULT rtstepper_wait_xfr_replan(struct emc_session *ps);
+   void *rtstepper_cancel_unsent(struct emc_session *ps, uint64_t seq);
    enum EMC_RESULT rtstepper_xfr_hysteresis(struct emc_session *ps);
    int rtstepper_is_connected(struct emc_session *ps);
    enum EMC_RESULT rtstepper_is_input0_triggered(struct emc_session *ps);
@@ -104,7 +304,29 @@ extern "C"
    enum EMC_RESULT rtstepper_home(struct emc_session *ps);
    enum EMC_RESULT rtstepper_estop(struct emc_session *ps, int thread);
    struct rtstepper_io_req *rtstepper_alloc_io_req(struct emc_session *ps, int id);
+   void rtstepper_free_io_req(struct emc_session *ps, struct rtstepper_io_req *io);
+   enum EMC_RESULT rtstepper_pool_open(struct emc_session *ps);
+   enum EMC_RESULT rtstepper_pool_close(struct emc_session *ps);
    enum EMC_RESULT rtstepper_test(const char *snum);
+
+   /* Software dongle emulator (rtstepper_emu.c). */
+   struct rtstepper_emu *rtstepper_emu_open(struct emc_session *ps, int mode, int dongle);
+   void rtstepper_emu_close(struct rtstepper_emu *pe);
+   int rtstepper_emu_submit_transfer(struct rtstepper_emu *pe, struct libusb_transfer *transfer);
+   int rtstepper_emu_cancel_transfer(struct rtstepper_emu *pe, struct libusb_transfer *transfer);
+   int rtstepper_emu_control_transfer(struct rtstepper_emu *pe, uint8_t request_type, uint8_t request, unsigned char *data, uint16_t length);
+
+   /* Step stream capture and replay (rtstepper_cap.c). */
+   enum EMC_RESULT rtstepper_capture_open(struct emc_session *ps, const char *path);
+   enum EMC_RESULT rtstepper_capture_close(struct emc_session *ps);
+   void rtstepper_capture_write(struct emc_session *ps, struct rtstepper_io_req *io);
+   void rtstepper_capture_event(struct emc_session *ps, uint32_t type, int line, const void *data, int nbytes);
+   void rtstepper_capture_state(struct emc_session *ps);
+   void rtstepper_capture_mark(struct emc_session *ps, struct rtstepper_cap_mark *mark);
+   void rtstepper_capture_rewind(struct emc_session *ps, const struct rtstepper_cap_mark *mark);
+   enum EMC_RESULT rtstepper_replay(struct emc_session *ps, const char *path, const char *sink);
+   uint64_t rtstepper_hash(uint64_t hash, const void *buf, int cnt);
+   enum EMC_RESULT rtstepper_hash_file(const char *path, uint64_t *hash);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,598 @@
+/*****************************************************************************\
+
+  rtstepper_cap.c - step stream capture and replay for rtstepperemc
+
+  (c) 2008-2015 Copyright Eckler Software
+
+  Author: David Suffield, dsuffiel@ecklersoft.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of version 2 of the GNU General Public License as published by
+  the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+
+  Upstream patches are welcome. Any patches submitted to the author must be
+  unencumbered (ie: no Copyright or License).
+
+  See project revision history the "configure.ac" file.
+
+  A capture file records the exact step buffer bytes sent to the dongle. It starts
+  with a struct rtstepper_cap_header followed by one record per io request: a
+  struct rtstepper_cap_record and then record.nbytes of step data, already in DB25
+  pin polarity. With more than one dongle the record holds each dongle's step bytes
+  back to back (nbytes / dongles per dongle). All fields are in host byte order.
+
+  M-code plugin calls and dwells are recorded as event records in stream order.
+  A capture may end with an axis state record (io_index = RTSTEPPER_CAP_STATE)
+  holding the encoder and backlash state after the last step record.
+
+  Replay maps a capture file and streams it to the dongle (or emulator), a raw
+  byte file or a null sink without running the interpreter or planner. Capture and
+  replay both log an FNV-1a hash of the step bytes so two runs can be compared
+  byte-for-byte. The step stream cache (see dsp_auto()) uses the same file format.
+
+\*****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "emc.h"
+#include "bug.h"
+
+#if !(defined(__WIN32__) || defined(_WINDOWS))
+#include <sys/mman.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define CAP_VBUF_SIZE (4 * 1024 * 1024)        /* stdio buffer, a few seconds of step data */
+#define FNV_OFFSET RTSTEPPER_HASH_INIT
+#define FNV_PRIME 0x100000001b3ULL
+
+struct rtstepper_capture
+{
+   FILE *fp;
+   char *vbuf;                  /* setvbuf() buffer */
+   uint32_t seq;                /* next record sequence number */
+   uint64_t bytes;              /* step bytes written */
+   uint64_t hash;               /* FNV-1a hash of step bytes written */
+   int rewound;                 /* 1 = file must be truncated on close */
+};
+
+static uint64_t fnv1a(uint64_t hash, const unsigned char *buf, int cnt)
+{
+   int i;
+
+   for (i = 0; i < cnt; i++)
+   {
+      hash ^= buf[i];
+      hash *= FNV_PRIME;
+   }
+   return hash;
+}  /* fnv1a() */
+
+/* FNV-1a hash of buf, start with hash = RTSTEPPER_HASH_INIT. */
+uint64_t rtstepper_hash(uint64_t hash, const void *buf, int cnt)
+{
+   return fnv1a(hash, (const unsigned char *)buf, cnt);
+}  /* rtstepper_hash() */
+
+/* Map file read only. Returns NULL on error. */
+static unsigned char *map_file(const char *path, size_t *len)
+{
+   unsigned char *p = NULL;
+   struct stat st;
+   int fd;
+
+   if ((fd = open(path, O_RDONLY | O_BINARY)) < 0)
+   {
+      BUG("unable to open %s: %m\n", path);
+      return NULL;
+   }
+   if (fstat(fd, &st) < 0 || st.st_size == 0)
+   {
+      BUG("invalid capture file %s\n", path);
+      goto bugout;
+   }
+   *len = st.st_size;
+
+#if (defined(__WIN32__) || defined(_WINDOWS))
+   if ((p = malloc(*len)) == NULL)
+   {
+      BUG("unable to malloc capture buffer len=%d\n", (int)*len);
+      goto bugout;
+   }
+   if ((size_t)read(fd, p, *len) != *len)
+   {
+      BUG("unable to read %s\n", path);
+      free(p);
+      p = NULL;
+   }
+#else
+   if ((p = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+   {
+      BUG("unable to mmap %s: %m\n", path);
+      p = NULL;
+      goto bugout;
+   }
+   madvise(p, *len, MADV_SEQUENTIAL);
+#endif
+
+ bugout:
+   close(fd);
+   return p;
+}  /* map_file() */
+
+static void unmap_file(unsigned char *p, size_t len)
+{
+#if (defined(__WIN32__) || defined(_WINDOWS))
+   free(p);
+#else
+   munmap(p, len);
+#endif
+}  /* unmap_file() */
+
+/* Hash the file contents into *hash. */
+enum EMC_RESULT rtstepper_hash_file(const char *path, uint64_t *hash)
+{
+   unsigned char *map;
+   size_t len, off, n;
+
+   if ((map = map_file(path, &len)) == NULL)
+      return RTSTEPPER_R_IO_ERROR;
+   for (off = 0; off < len; off += n)
+   {
+      n = len - off;
+      if (n > 0x40000000)
+         n = 0x40000000;
+      *hash = fnv1a(*hash, map + off, (int)n);
+   }
+   unmap_file(map, len);
+   return EMC_R_OK;
+}  /* rtstepper_hash_file() */
+
+/* Start capturing the step stream to a new capture file. */
+enum EMC_RESULT rtstepper_capture_open(struct emc_session *ps, const char *path)
+{
+   struct rtstepper_capture *pc;
+   struct rtstepper_cap_header hdr;
+   enum EMC_RESULT stat = RTSTEPPER_R_MALLOC_ERROR;
+   int i;
+
+   rtstepper_capture_close(ps);
+
+   if ((pc = calloc(1, sizeof(struct rtstepper_capture))) == NULL || (pc->vbuf = malloc(CAP_VBUF_SIZE)) == NULL)
+   {
+      BUG("unable to malloc capture buffer\n");
+      goto bugout;
+   }
+
+   if ((pc->fp = fopen(path, "wb")) == NULL)
+   {
+      BUG("unable to open %s: %m\n", path);
+      stat = RTSTEPPER_R_IO_ERROR;
+      goto bugout;
+   }
+   setvbuf(pc->fp, pc->vbuf, _IOFBF, CAP_VBUF_SIZE);
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.magic = RTSTEPPER_CAP_MAGIC;
+   hdr.version = RTSTEPPER_CAP_VERSION;
+   hdr.period = RTSTEPPER_PERIOD;
+   hdr.axes = ps->axes;
+   hdr.dongles = ps->dongles;
+   for (i = 0; i < ps->dongles; i++)
+      hdr.polarity_mask |= (uint32_t)ps->polarity_mask[i] << (8 * i);
+   hdr.step_pulse_width = ps->step_pulse_width;
+   hdr.buf_size = ps->pool.buf_size;
+   if (fwrite(&hdr, sizeof(hdr), 1, pc->fp) != 1)
+   {
+      BUG("unable to write %s: %m\n", path);
+      stat = RTSTEPPER_R_IO_ERROR;
+      goto bugout;
+   }
+   pc->hash = FNV_OFFSET;
+
+   pthread_mutex_lock(&ps->cap_mutex);
+   ps->capture = pc;
+   pthread_mutex_unlock(&ps->cap_mutex);
+
+   MSG("Capturing step stream to %s\n", path);
+   return EMC_R_OK;
+
+ bugout:
+   if (pc != NULL)
+   {
+      if (pc->fp != NULL)
+         fclose(pc->fp);
+      free(pc->vbuf);
+      free(pc);
+   }
+   return stat;
+}  /* rtstepper_capture_open() */
+
+enum EMC_RESULT rtstepper_capture_close(struct emc_session *ps)
+{
+   struct rtstepper_capture *pc;
+
+   pthread_mutex_lock(&ps->cap_mutex);
+   pc = ps->capture;
+   ps->capture = NULL;
+   pthread_mutex_unlock(&ps->cap_mutex);
+
+   if (pc == NULL)
+      return EMC_R_OK;
+
+   if (pc->rewound && (fflush(pc->fp) != 0 || ftruncate(fileno(pc->fp), ftello(pc->fp)) != 0))
+      BUG("unable to truncate capture file: %m\n");
+   if (fclose(pc->fp) != 0)
+      BUG("unable to close capture file: %m\n");
+   MSG("Step stream capture closed, records=%u bytes=%llu hash=%016llx\n", pc->seq, (unsigned long long)pc->bytes, (unsigned long long)pc->hash);
+   free(pc->vbuf);
+   free(pc);
+   return EMC_R_OK;
+}  /* rtstepper_capture_close() */
+
+/* Append io request to the capture file, called from rtstepper_start_xfr() after DB25 polarity is applied. */
+void rtstepper_capture_write(struct emc_session *ps, struct rtstepper_io_req *io)
+{
+   struct rtstepper_capture *pc;
+   struct rtstepper_cap_record rec;
+   int i;
+
+   pthread_mutex_lock(&ps->cap_mutex);
+
+   if ((pc = ps->capture) == NULL)
+      goto bugout;
+
+   rec.seq = pc->seq++;
+   rec.io_index = io->index;
+   rec.line = io->id;
+   rec.nbytes = io->total * ps->dongles;
+   rec.position = io->position;
+   if (fwrite(&rec, sizeof(rec), 1, pc->fp) != 1)
+      goto write_error;
+   for (i = 0; i < ps->dongles; i++)
+   {
+      if (fwrite(io->buf[i], 1, io->total, pc->fp) != (size_t)io->total)
+         goto write_error;
+      pc->hash = fnv1a(pc->hash, io->buf[i], io->total);
+   }
+   pc->bytes += rec.nbytes;
+   goto bugout;
+
+ write_error:
+   BUG("unable to write capture file: %m\n");
+
+ bugout:
+   pthread_mutex_unlock(&ps->cap_mutex);
+}  /* rtstepper_capture_write() */
+
+/* Append an event record (see RTSTEPPER_CAP_EVENT) to the capture file. */
+void rtstepper_capture_event(struct emc_session *ps, uint32_t type, int line, const void *data, int nbytes)
+{
+   struct rtstepper_capture *pc;
+   struct rtstepper_cap_record rec;
+
+   pthread_mutex_lock(&ps->cap_mutex);
+
+   if ((pc = ps->capture) == NULL)
+      goto bugout;
+
+   memset(&rec, 0, sizeof(rec));
+   rec.seq = pc->seq++;
+   rec.io_index = type;
+   rec.line = line;
+   rec.nbytes = nbytes;
+   rec.position = ps->position;
+   if (fwrite(&rec, sizeof(rec), 1, pc->fp) != 1 || fwrite(data, 1, nbytes, pc->fp) != (size_t)nbytes)
+      BUG("unable to write capture file: %m\n");
+
+ bugout:
+   pthread_mutex_unlock(&ps->cap_mutex);
+}  /* rtstepper_capture_event() */
+
+/* Save the capture file position, see rtstepper_capture_rewind(). */
+void rtstepper_capture_mark(struct emc_session *ps, struct rtstepper_cap_mark *mark)
+{
+   struct rtstepper_capture *pc;
+
+   pthread_mutex_lock(&ps->cap_mutex);
+
+   memset(mark, 0, sizeof(*mark));
+   if ((pc = ps->capture) == NULL)
+      goto bugout;
+
+   mark->capture = pc;
+   mark->offset = ftello(pc->fp);
+   mark->seq = pc->seq;
+   mark->bytes = pc->bytes;
+   mark->hash = pc->hash;
+
+ bugout:
+   pthread_mutex_unlock(&ps->cap_mutex);
+}  /* rtstepper_capture_mark() */
+
+/* Drop the records written since mark, called when queued step buffers are cancelled before reaching the dongle. */
+void rtstepper_capture_rewind(struct emc_session *ps, const struct rtstepper_cap_mark *mark)
+{
+   struct rtstepper_capture *pc;
+
+   pthread_mutex_lock(&ps->cap_mutex);
+
+   /* Nothing to do if capture was started or stopped after the mark. */
+   if ((pc = ps->capture) == NULL || pc != mark->capture || pc->seq < mark->seq)
+      goto bugout;
+
+   if (fseeko(pc->fp, mark->offset, SEEK_SET) != 0)
+   {
+      BUG("unable to rewind capture file: %m\n");
+      goto bugout;
+   }
+   pc->seq = mark->seq;
+   pc->bytes = mark->bytes;
+   pc->hash = mark->hash;
+   pc->rewound = 1;
+
+ bugout:
+   pthread_mutex_unlock(&ps->cap_mutex);
+}  /* rtstepper_capture_rewind() */
+
+/* Append the axis state record, call after the last io request of the run is encoded. */
+void rtstepper_capture_state(struct emc_session *ps)
+{
+   struct rtstepper_capture *pc;
+   struct rtstepper_cap_record rec;
+   struct rtstepper_cap_axis ax;
+   struct emc_axis *pa;
+   int i;
+
+   pthread_mutex_lock(&ps->cap_mutex);
+
+   if ((pc = ps->capture) == NULL)
+      goto bugout;
+
+   memset(&rec, 0, sizeof(rec));
+   rec.seq = pc->seq++;
+   rec.io_index = RTSTEPPER_CAP_STATE;
+   rec.nbytes = ps->axes * sizeof(ax);
+   rec.position = ps->position;
+   if (fwrite(&rec, sizeof(rec), 1, pc->fp) != 1)
+      goto write_error;
+   for (i = 0; i < ps->axes; i++)
+   {
+      pa = &ps->axis[i];
+      ax.master_index = pa->master_index;
+      ax.pulse_left = pa->pulse_left;
+      ax.direction = pa->direction;
+      ax.dda_pos = pa->dda_pos;
+      ax.backlash_corr = pa->backlash_corr;
+      ax.backlash_filt = pa->backlash_filt;
+      ax.backlash_vel = pa->backlash_vel;
+      ax.pos_cmd = pa->pos_cmd;
+      ax.vel_cmd = pa->vel_cmd;
+      if (fwrite(&ax, sizeof(ax), 1, pc->fp) != 1)
+         goto write_error;
+   }
+   goto bugout;
+
+ write_error:
+   BUG("unable to write capture file: %m\n");
+
+ bugout:
+   pthread_mutex_unlock(&ps->cap_mutex);
+}  /* rtstepper_capture_state() */
+
+/* Run an M-code or dwell event record once the step data ahead of it is done. */
+static void replay_event(struct emc_session *ps, const struct rtstepper_cap_record *rec, const unsigned char *p)
+{
+   struct rtstepper_cap_mcode mc;
+   double delay;
+
+   if (rec->io_index == RTSTEPPER_CAP_MCODE && rec->nbytes == sizeof(mc))
+   {
+      memcpy(&mc, p, sizeof(mc));
+      rtstepper_wait_xfr(ps);
+      if (!(ps->state_bits & EMC_STATE_ESTOP_BIT))
+         emc_plugin_cb(ps, mc.index, mc.p_number, mc.q_number);
+   }
+   else if (rec->io_index == RTSTEPPER_CAP_DELAY && rec->nbytes == sizeof(delay))
+   {
+      memcpy(&delay, p, sizeof(delay));
+      dsp_delay(ps, delay);
+   }
+   else
+      BUG("unknown capture event=%x seq=%u\n", rec->io_index, rec->seq);
+}  /* replay_event() */
+
+/* Restore axis state record. */
+static void replay_state(struct emc_session *ps, const unsigned char *p, uint32_t nbytes)
+{
+   struct rtstepper_cap_axis ax;
+   struct emc_axis *pa;
+   int i;
+
+   if (nbytes != ps->axes * sizeof(ax))
+   {
+      BUG("invalid axis state record axes=%d\n", (int)(nbytes / sizeof(ax)));
+      return;
+   }
+   for (i = 0; i < ps->axes; i++)
+   {
+      memcpy(&ax, p + i * sizeof(ax), sizeof(ax));
+      pa = &ps->axis[i];
+      pa->master_index = ax.master_index;
+      pa->pulse_left = ax.pulse_left;
+      pa->direction = ax.direction;
+      pa->dda_pos = ax.dda_pos;
+      pa->backlash_corr = ax.backlash_corr;
+      pa->backlash_filt = ax.backlash_filt;
+      pa->backlash_vel = ax.backlash_vel;
+      pa->pos_cmd = ax.pos_cmd;
+      pa->vel_cmd = ax.vel_cmd;
+   }
+}  /* replay_state() */
+
+/*
+ * Replay a capture file to the specified sink: NULL or "dongle" = usb dongle (or emulator), "null" = discard,
+ * otherwise a file name for the raw step bytes. Blocks until the replay is done or ESTOP. A dongle replay needs
+ * the same number of dongles and DB25 polarity as the capture.
+ */
+enum EMC_RESULT rtstepper_replay(struct emc_session *ps, const char *path, const char *sink)
+{
+   struct rtstepper_cap_header hdr;
+   struct rtstepper_cap_record rec;
+   struct rtstepper_io_req *io;
+   unsigned char *map, *p, *end;
+   size_t len;
+   FILE *fp = NULL;
+   uint32_t records = 0;
+   uint64_t bytes = 0, hash = FNV_OFFSET;
+   uint32_t n, off, per;
+   int i, dongle = 0;
+   enum EMC_RESULT stat = RTSTEPPER_R_IO_ERROR;
+
+   if ((map = map_file(path, &len)) == NULL)
+      return stat;
+   p = map;
+   end = map + len;
+
+   if (len < sizeof(hdr))
+   {
+      BUG("invalid capture file %s\n", path);
+      goto bugout;
+   }
+   memcpy(&hdr, p, sizeof(hdr));
+   p += sizeof(hdr);
+   if (hdr.magic != RTSTEPPER_CAP_MAGIC || hdr.version != RTSTEPPER_CAP_VERSION || hdr.period != RTSTEPPER_PERIOD)
+   {
+      BUG("invalid capture file %s magic=%x version=%d period=%d\n", path, hdr.magic, hdr.version, hdr.period);
+      goto bugout;
+   }
+   if (hdr.dongles == 0)
+      hdr.dongles = 1;   /* single dongle capture */
+
+   if (sink == NULL || sink[0] == 0 || strcmp(sink, "dongle") == 0)
+   {
+      if (!rtstepper_is_connected(ps))
+      {
+         BUG("unable to replay %s, no dongle\n", path);
+         stat = RTSTEPPER_R_DEVICE_UNAVAILABLE;
+         goto bugout;
+      }
+      if (hdr.dongles != (uint32_t)ps->dongles)
+      {
+         BUG("unable to replay %s, capture dongles=%d ini file dongles=%d\n", path, hdr.dongles, ps->dongles);
+         stat = RTSTEPPER_R_DEVICE_UNAVAILABLE;
+         goto bugout;
+      }
+      for (i = 0; i < ps->dongles; i++)
+      {
+         if (((hdr.polarity_mask >> (8 * i)) & 0xff) != ps->polarity_mask[i])
+         {
+            /* Step buffers are captured with polarity applied, replaying them through other wiring inverts the pins. */
+            BUG("unable to replay %s, capture dongle=%d polarity_mask=%x ini file polarity_mask=%x\n", path, i,
+                (hdr.polarity_mask >> (8 * i)) & 0xff, ps->polarity_mask[i]);
+            stat = RTSTEPPER_R_DEVICE_UNAVAILABLE;
+            goto bugout;
+         }
+      }
+      dongle = 1;
+   }
+   else if (strcmp(sink, "null") != 0)
+   {
+      if ((fp = fopen(sink, "wb")) == NULL)
+      {
+         BUG("unable to open %s: %m\n", sink);
+         goto bugout;
+      }
+   }
+
+   MSG("Replaying %s to %s\n", path, dongle ? "dongle" : fp ? sink : "null");
+
+   while (p + sizeof(rec) <= end)
+   {
+      memcpy(&rec, p, sizeof(rec));
+      p += sizeof(rec);
+      if (rec.nbytes > (size_t)(end - p))
+      {
+         BUG("truncated capture file %s seq=%u\n", path, rec.seq);
+         break;
+      }
+
+      if (rec.io_index >= RTSTEPPER_CAP_EVENT)
+      {
+         /* Not step data, only the dongle sink runs events. It continues encoding from the captured axis state. */
+         if (dongle && rec.io_index == RTSTEPPER_CAP_STATE)
+            replay_state(ps, p, rec.nbytes);
+         else if (dongle)
+            replay_event(ps, &rec, p);
+         p += rec.nbytes;
+         continue;
+      }
+
+      if (dongle)
+      {
+         /* Split record into step buffer chunks, the capture may have used a larger STEP_BUF_SIZE. */
+         per = rec.nbytes / hdr.dongles;
+         for (off = 0; off < per; off += n)
+         {
+            if ((io = rtstepper_alloc_io_req(ps, rec.line)) == NULL)
+            {
+               stat = RTSTEPPER_R_REQ_ERROR;   /* ESTOP */
+               goto bugout;
+            }
+            n = per - off;
+            if (n > (uint32_t)io->buf_size)
+               n = io->buf_size;
+            for (i = 0; i < ps->dongles; i++)
+               memcpy(io->buf[i], p + i * per + off, n);
+            io->total = n;
+            io->position = rec.position;
+            rtstepper_queue_xfr(ps, io);
+            rtstepper_xfr_hysteresis(ps);
+         }
+      }
+      else if (fp != NULL)
+      {
+         if (fwrite(p, 1, rec.nbytes, fp) != rec.nbytes)
+         {
+            BUG("unable to write %s: %m\n", sink);
+            goto bugout;
+         }
+      }
+
+      hash = fnv1a(hash, p, rec.nbytes);
+      bytes += rec.nbytes;
+      records++;
+      p += rec.nbytes;
+   }
+
+   if (dongle)
+      rtstepper_wait_xfr(ps);
+
+   MSG("Replay done, records=%u bytes=%llu hash=%016llx time=%0.3fs\n", records, (unsigned long long)bytes, (unsigned long long)hash,
+       bytes / hdr.dongles * RTSTEPPER_PERIOD * 1E-9 / 2);   /* dongles step in parallel */
+   stat = EMC_R_OK;
+
+ bugout:
+   if (fp != NULL)
+      fclose(fp);
+   unmap_file(map, len);
+   return stat;
+}  /* rtstepper_replay() */
@@ -0,0 +1,427 @@
+/*****************************************************************************\
+
+  rtstepper_emu.c - software rt-stepper dongle emulator for rtstepperemc
+
+  (c) 2008-2015 Copyright Eckler Software
+
+  Author: David Suffield, dsuffiel@ecklersoft.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of version 2 of the GNU General Public License as published by
+  the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+
+  Upstream patches are welcome. Any patches submitted to the author must be
+  unencumbered (ie: no Copyright or License).
+
+  See project revision history the "configure.ac" file.
+
+  The emulator stands in for the usb dongle so the io pipeline can be run and
+  profiled without hardware. It accepts the same asynchronous bulk OUT transfers
+  and EP0 vendor requests as the dongle firmware, drains step bytes at the real
+  step clock rate (or as fast as possible in turbo mode), decodes the step/direction
+  bits for each axis and reports the running step count and EMPTY/ABORT state bits.
+  EP0 vendor requests may be synchronous or submitted as asynchronous control transfers.
+  Completed transfers are returned through the normal libusb transfer callback
+  from the emulator thread, which takes the place of event_thread().
+
+\*****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "emc.h"
+#include "bug.h"
+
+#define EMU_BYTE_RATE (2 * 1E9 / RTSTEPPER_PERIOD)     /* step bytes per second, two bytes per step clock */
+#define EMU_TICK 0.001          /* realtime drain interval in seconds */
+
+struct emu_xfr
+{
+   struct libusb_transfer *transfer;
+   int offset;                  /* bytes consumed so far */
+   int cancelled;
+   struct list_head list;
+};
+
+struct emu_axis
+{
+   int step_mask;               /* 0 = unused axis */
+   int step_active;             /* step_mask if active high, else 0 */
+   int direction_mask;
+   int direction_active;        /* direction_mask if active high, else 0 */
+   int index;                   /* decoded position in step counts */
+};
+
+struct rtstepper_emu
+{
+   int mode;                    /* RTSTEPPER_EMU_REALTIME or RTSTEPPER_EMU_TURBO */
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   pthread_t tid;
+   int done;
+   struct list_head xfr_list;   /* submitted bulk transfers (FIFO) */
+   struct list_head ctl_list;   /* submitted control transfers (FIFO) */
+   uint16_t state_bits;         /* RTSTEPPER_STEP_STATE_xxx_BIT */
+   uint32_t step;               /* running step count (bytes clocked out) */
+   unsigned char trip_cnt;
+   unsigned char last;          /* last byte clocked out */
+   double credit;               /* realtime mode, bytes that may be clocked out now */
+   struct timeval tv;           /* realtime mode, time credit was last updated */
+   int axes;
+   struct emu_axis axis[EMC_MAX_AXIS];
+};
+
+/* Decode step/direction bits, a step is counted on each inactive to active step pin transition. */
+static void _decode(struct rtstepper_emu *pe, const unsigned char *buf, int cnt)
+{
+   struct emu_axis *pa;
+   int i, j;
+
+   for (i = 0; i < cnt; i++)
+   {
+      for (j = 0; j < pe->axes; j++)
+      {
+         pa = &pe->axis[j];
+         if (pa->step_mask == 0)
+            continue;
+         if ((buf[i] & pa->step_mask) == pa->step_active && (pe->last & pa->step_mask) != pa->step_active)
+            pa->index += ((buf[i] & pa->direction_mask) == pa->direction_active) ? -1 : 1;
+      }
+      pe->last = buf[i];
+   }
+}  /* _decode() */
+
+/* Return number of bytes the emulated step clock allows to be clocked out now. */
+static int _budget(struct rtstepper_emu *pe, int want)
+{
+   struct timeval tv;
+   double dt;
+
+   if (pe->mode == RTSTEPPER_EMU_TURBO)
+      return want;
+
+   gettimeofday(&tv, NULL);
+   dt = (tv.tv_sec - pe->tv.tv_sec) + (tv.tv_usec - pe->tv.tv_usec) * 1E-6;
+   pe->tv = tv;
+   pe->credit += dt * EMU_BYTE_RATE;
+   if (pe->credit < want)
+      want = (int)pe->credit;
+   pe->credit -= want;
+   return want;
+}  /* _budget() */
+
+/* Handle EP0 vendor request, called with mutex locked. Returns number of bytes transferred or libusb error code. */
+static int _control(struct rtstepper_emu *pe, uint8_t request, unsigned char *data, uint16_t length)
+{
+   struct step_query query;
+   int len = 0;
+
+   switch (request)
+   {
+   case STEP_SET:
+      pe->step = 0;
+      pe->trip_cnt = 0;
+      pe->state_bits &= ~(RTSTEPPER_STEP_STATE_ABORT_BIT | RTSTEPPER_STEP_STATE_STALL_BIT);
+      len = length;
+      break;
+   case STEP_QUERY:
+      memset(&query, 0, sizeof(query));
+      query.state_bits._word = pe->state_bits;
+      query.trip_cnt = pe->trip_cnt;
+      query.step = pe->step;
+      len = (length < sizeof(query)) ? length : sizeof(query);
+      memcpy(data, &query, len);
+      break;
+   case STEP_ABORT_SET:
+      pe->state_bits |= RTSTEPPER_STEP_STATE_ABORT_BIT;
+      break;
+   case STEP_ABORT_CLEAR:
+      pe->state_bits &= ~RTSTEPPER_STEP_STATE_ABORT_BIT;
+      break;
+   default:
+      len = LIBUSB_ERROR_IO;
+      break;
+   }
+
+   return len;
+}  /* _control() */
+
+/* Complete the next submitted control transfer, called with mutex locked. Returns 0 if ctl_list is empty. */
+static int _complete_control(struct rtstepper_emu *pe)
+{
+   struct libusb_transfer *transfer;
+   struct libusb_control_setup *setup;
+   struct emu_xfr *px;
+   int n;
+
+   if (list_empty(&pe->ctl_list))
+      return 0;
+
+   px = list_entry(pe->ctl_list.next, struct emu_xfr, list);
+   list_del(&px->list);
+   transfer = px->transfer;
+
+   if (px->cancelled)
+   {
+      transfer->status = LIBUSB_TRANSFER_CANCELLED;
+   }
+   else
+   {
+      setup = libusb_control_transfer_get_setup(transfer);
+      n = _control(pe, setup->bRequest, libusb_control_transfer_get_data(transfer), libusb_le16_to_cpu(setup->wLength));
+      if (n < 0)
+      {
+         transfer->status = LIBUSB_TRANSFER_ERROR;
+      }
+      else
+      {
+         transfer->status = LIBUSB_TRANSFER_COMPLETED;
+         transfer->actual_length = n;
+      }
+   }
+   free(px);
+
+   pthread_mutex_unlock(&pe->mutex);
+   transfer->callback(transfer);
+   pthread_mutex_lock(&pe->mutex);
+   return 1;
+}  /* _complete_control() */
+
+static void emu_thread(struct rtstepper_emu *pe)
+{
+   struct libusb_transfer *transfer;
+   struct emu_xfr *px;
+   struct list_head *p, *tmp;
+   int n;
+
+   pthread_mutex_lock(&pe->mutex);
+
+   while (!pe->done)
+   {
+      /* EP0 requests are serviced ahead of the bulk step stream, same as the dongle firmware. */
+      while (_complete_control(pe))
+         ;
+
+      /* Complete any cancelled transfers first, same as libusb these are returned from the event thread. */
+      list_for_each_safe(p, tmp, &pe->xfr_list)
+      {
+         px = list_entry(p, struct emu_xfr, list);
+         if (!px->cancelled)
+            continue;
+         list_del(&px->list);
+         transfer = px->transfer;
+         free(px);
+         transfer->status = LIBUSB_TRANSFER_CANCELLED;
+         pthread_mutex_unlock(&pe->mutex);
+         transfer->callback(transfer);
+         pthread_mutex_lock(&pe->mutex);
+      }
+
+      if (list_empty(&pe->xfr_list))
+      {
+         if (!list_empty(&pe->ctl_list))
+            continue;
+
+         /* Step buffer underrun, the dongle sits idle so no clock credit accumulates. */
+         pe->state_bits |= RTSTEPPER_STEP_STATE_EMPTY_BIT;
+         pe->credit = 0;
+         gettimeofday(&pe->tv, NULL);
+         pthread_cond_wait(&pe->cond, &pe->mutex);
+         gettimeofday(&pe->tv, NULL);
+         continue;
+      }
+
+      pe->state_bits &= ~RTSTEPPER_STEP_STATE_EMPTY_BIT;
+      px = list_entry(pe->xfr_list.next, struct emu_xfr, list);
+      transfer = px->transfer;
+
+      if (pe->state_bits & RTSTEPPER_STEP_STATE_ABORT_BIT)
+      {
+         /* Abort is set, step data is accepted but not clocked out. */
+         n = transfer->length - px->offset;
+      }
+      else
+      {
+         n = _budget(pe, transfer->length - px->offset);
+         _decode(pe, transfer->buffer + px->offset, n);
+         pe->step += n;
+      }
+      px->offset += n;
+
+      if (px->offset >= transfer->length)
+      {
+         list_del(&px->list);
+         free(px);
+         transfer->status = LIBUSB_TRANSFER_COMPLETED;
+         transfer->actual_length = transfer->length;
+         pthread_mutex_unlock(&pe->mutex);
+         transfer->callback(transfer);
+         pthread_mutex_lock(&pe->mutex);
+      }
+      else if (pe->mode == RTSTEPPER_EMU_REALTIME)
+      {
+         pthread_mutex_unlock(&pe->mutex);
+         esleep(EMU_TICK);
+         pthread_mutex_lock(&pe->mutex);
+      }
+   }  /* while (!done) */
+
+   pthread_mutex_unlock(&pe->mutex);
+   DBG("emu_thread() closed...\n");
+}  /* emu_thread() */
+
+int rtstepper_emu_submit_transfer(struct rtstepper_emu *pe, struct libusb_transfer *transfer)
+{
+   struct emu_xfr *px;
+
+   if ((px = malloc(sizeof(struct emu_xfr))) == NULL)
+      return LIBUSB_ERROR_NO_MEM;
+
+   px->transfer = transfer;
+   px->offset = 0;
+   px->cancelled = 0;
+   transfer->actual_length = 0;
+
+   pthread_mutex_lock(&pe->mutex);
+   if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+      list_add_tail(&px->list, &pe->ctl_list);
+   else
+      list_add_tail(&px->list, &pe->xfr_list);
+   pthread_cond_signal(&pe->cond);
+   pthread_mutex_unlock(&pe->mutex);
+   return 0;
+}  /* rtstepper_emu_submit_transfer() */
+
+int rtstepper_emu_cancel_transfer(struct rtstepper_emu *pe, struct libusb_transfer *transfer)
+{
+   struct emu_xfr *px;
+   struct list_head *p;
+   int stat = LIBUSB_ERROR_NOT_FOUND;
+
+   pthread_mutex_lock(&pe->mutex);
+   list_for_each(p, &pe->xfr_list)
+   {
+      px = list_entry(p, struct emu_xfr, list);
+      if (px->transfer == transfer)
+      {
+         px->cancelled = 1;
+         stat = 0;
+         break;
+      }
+   }
+   list_for_each(p, &pe->ctl_list)
+   {
+      px = list_entry(p, struct emu_xfr, list);
+      if (px->transfer == transfer)
+      {
+         px->cancelled = 1;
+         stat = 0;
+         break;
+      }
+   }
+   pthread_cond_signal(&pe->cond);
+   pthread_mutex_unlock(&pe->mutex);
+   return stat;
+}  /* rtstepper_emu_cancel_transfer() */
+
+/* Handle EP0 vendor request. Returns number of bytes transferred or libusb error code. */
+int rtstepper_emu_control_transfer(struct rtstepper_emu *pe, uint8_t request_type, uint8_t request, unsigned char *data, uint16_t length)
+{
+   int len;
+
+   pthread_mutex_lock(&pe->mutex);
+   len = _control(pe, request, data, length);
+   pthread_cond_signal(&pe->cond);
+   pthread_mutex_unlock(&pe->mutex);
+   return len;
+}  /* rtstepper_emu_control_transfer() */
+
+/* Open an emulator for one dongle, only the axes assigned to that dongle (ini: AXIS_n, DONGLE) are decoded. */
+struct rtstepper_emu *rtstepper_emu_open(struct emc_session *ps, int mode, int dongle)
+{
+   struct rtstepper_emu *pe;
+   int i;
+
+   if ((pe = calloc(1, sizeof(struct rtstepper_emu))) == NULL)
+   {
+      BUG("unable to malloc dongle emulator\n");
+      return NULL;
+   }
+
+   pe->mode = mode;
+   pe->state_bits = RTSTEPPER_STEP_STATE_EMPTY_BIT;
+   INIT_LIST_HEAD(&pe->xfr_list);
+   INIT_LIST_HEAD(&pe->ctl_list);
+   pthread_mutex_init(&pe->mutex, NULL);
+   pthread_cond_init(&pe->cond, NULL);
+
+   /* Use the same DB25 pin assignments as rtstepper_encode(). */
+   pe->axes = ps->axes;
+   for (i = 0; i < pe->axes; i++)
+   {
+      if (ps->axis[i].step_pin < 2 || ps->axis[i].direction_pin < 2 || ps->axis[i].dongle != dongle)
+         continue;   /* unused axis or axis on another dongle */
+      pe->axis[i].step_mask = 1 << (ps->axis[i].step_pin - 2);
+      pe->axis[i].step_active = ps->axis[i].step_active_high ? pe->axis[i].step_mask : 0;
+      pe->axis[i].direction_mask = 1 << (ps->axis[i].direction_pin - 2);
+      pe->axis[i].direction_active = ps->axis[i].direction_active_high ? pe->axis[i].direction_mask : 0;
+   }
+
+   pthread_create(&pe->tid, NULL, (void *(*)(void *))emu_thread, (void *)pe);
+
+   MSG("Using rtstepper dongle emulator %d (%s)\n", dongle, mode == RTSTEPPER_EMU_TURBO ? "turbo" : "realtime");
+   return pe;
+}  /* rtstepper_emu_open() */
+
+void rtstepper_emu_close(struct rtstepper_emu *pe)
+{
+   struct emu_xfr *px;
+   struct list_head *p, *tmp;
+   int i;
+
+   if (pe == NULL)
+      return;
+
+   pthread_mutex_lock(&pe->mutex);
+   pe->done = 1;
+   pthread_cond_signal(&pe->cond);
+   pthread_mutex_unlock(&pe->mutex);
+   pthread_join(pe->tid, NULL);
+
+   list_for_each_safe(p, tmp, &pe->xfr_list)
+   {
+      px = list_entry(p, struct emu_xfr, list);
+      list_del(&px->list);
+      free(px);
+   }
+   list_for_each_safe(p, tmp, &pe->ctl_list)
+   {
+      px = list_entry(p, struct emu_xfr, list);
+      list_del(&px->list);
+      free(px);
+   }
+
+   MSG("Dongle emulator closed, steps=%u\n", pe->step);
+   for (i = 0; i < pe->axes; i++)
+   {
+      if (pe->axis[i].step_mask)
+         DBG("  axis=%d index=%d\n", i, pe->axis[i].index);
+   }
+
+   pthread_cond_destroy(&pe->cond);
+   pthread_mutex_destroy(&pe->mutex);
+   free(pe);
+}  /* rtstepper_emu_close() */
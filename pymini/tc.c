@@ -75,9 +75,16 @@ int tcInit(TC_STRUCT *tc)
   tc->vMax = 0.0;
   tc->vScale = 1.0;
   tc->aMax = 0.0;
+  tc->vCircle = 0.0;
+  tc->jMax = 0.0;
   tc->preVMax = 0.0;
   tc->preAMax = 0.0;
   tc->vLimit = 0.0;
+  tc->junctionVel = 0.0;
+  tc->finalVel = 0.0;
+  tc->rampVel = 0.0;
+  tc->rampDist = 0.0;
+  tc->overshoot = 0.0;
   tc->toGo = 0.0;
   tc->currentPos = 0.0;
   tc->currentVel = 0.0;
@@ -94,6 +101,11 @@ int tcInit(TC_STRUCT *tc)
   tc->abc_vMax=0.0;
   tc->abc_aMax=0.0;
   tc->unitCart.x = tc->unitCart.y = tc->unitCart.z = 0.0;
+  tc->unitCartPos = -1.0;
+  tc->arcAngle = 0.0;
+  tc->arcCos = 1.0;
+  tc->arcSin = 0.0;
+  tc->arcSteps = 0;
   zero.tran.x = zero.tran.y = zero.tran.z = 0.0;
   zero.rot.s=1.0;
   zero.rot.x = zero.rot.y = zero.rot.z = 0.0;
@@ -190,6 +202,14 @@ int tcSetLine(TC_STRUCT *tc, PmLine line, PmLine line_abc)
       tc->targetPos = tmag;
     }
      
+  /* the direction of a line never changes, tcGetUnitCart() returns this */
+  pmCartCartSub(line.end.tran, line.start.tran, &tc->unitCart);
+#ifdef USE_PM_CART_NORM
+  pmCartNorm(tc->unitCart, &tc->unitCart);
+#else
+  pmCartUnit(tc->unitCart, &tc->unitCart);
+#endif
+
   tc->currentPos = 0.0;
   tc->type = TC_LINEAR;
   return 0;
@@ -211,8 +231,16 @@ int tcSetCircle(TC_STRUCT *tc, PmCircle circle, PmLine line_abc)
   tc->currentPos = 0.0;
   tc->type = TC_CIRCULAR;
 
+  /* start of the arc, see tcArcAngle() */
+  tc->unitCartPos = -1.0;
+  tc->arcAngle = 0.0;
+  tc->arcCos = 1.0;
+  tc->arcSin = 0.0;
+  tc->arcSteps = 0;
+
   tc->aMax = tc->taMax;
   tc->vMax = tc->tvMax;
+  tc->vCircle = pmSqrt(tc->aMax * circle.radius);
 
   pmCartCartDisp(line_abc.end.tran, line_abc.start.tran, &tc->abc_mag);
 
@@ -284,6 +312,19 @@ int tcSetTAmax(TC_STRUCT *tc, double _aMax)
   return 0;
 }
 
+int tcSetJmax(TC_STRUCT *tc, double jMax)
+{
+  if (jMax < 0.0 ||
+      0 == tc)
+  {
+    return -1;
+  }
+
+  tc->jMax = jMax;
+
+  return 0;
+}
+
 int tcSetPremax(TC_STRUCT *tc, double vMax, double aMax)
 {
   if (0 == tc)
@@ -359,12 +400,229 @@ int tcGetTermCond(TC_STRUCT *tc)
   return tc->termCond;
 }
 
+/* run a constant jerk segment of t secs, advancing *s, *v and *a */
+static void tcJerkSegment(double *s, double *v, double *a, double j, double t)
+{
+  *s += *v * t + 0.5 * *a * t * t + j * t * t * t / 6.0;
+  *v += *a * t + 0.5 * j * t * t;
+  *a += j * t;
+}
+
+/*
+  tcStopDist() returns the shortest distance to slow from vel and accel to
+  vf, ramping the decel in and out at jMax and holding it at aMax if needed.
+  That is the decel half of the 7-phase S-curve. 0 if vel never gets above
+  vf while accel ramps out.
+*/
+static double tcStopDist(double vel, double accel, double vf, double aMax, double jMax)
+{
+  double a1, q, t;
+  double s = 0.0;
+
+  /* peak decel of a ramp in and straight back out */
+  q = 0.5 * accel * accel + jMax * (vel - vf);
+  if (q <= 0.0) {
+    return 0.0;
+  }
+  a1 = -sqrt(q);
+
+  if (a1 > accel) {
+    /* already slowing harder than needed, passes vf while the decel ramps out */
+    t = (-accel - sqrt(accel * accel - 2.0 * jMax * (vel - vf))) / jMax;
+    tcJerkSegment(&s, &vel, &accel, jMax, t);
+    return s;
+  }
+
+  if (a1 < -aMax) {
+    a1 = -aMax;
+  }
+  tcJerkSegment(&s, &vel, &accel, -jMax, (accel - a1) / jMax);
+  if (a1 <= -aMax) {
+    /* hold max decel until ramping out ends at vf */
+    t = (vel - vf - 0.5 * aMax * aMax / jMax) / aMax;
+    if (t > 0.0) {
+      tcJerkSegment(&s, &vel, &accel, 0.0, t);
+    }
+  }
+  tcJerkSegment(&s, &vel, &accel, jMax, -accel / jMax);
+
+  return s;
+}
+
+/* returns 1 if running one cycle at accel still leaves room for the planned decel */
+static int tcJerkCanStop(TC_STRUCT *tc, double accel)
+{
+  double vel, dist;
+
+  vel = tc->currentVel + accel * tc->cycleTime;
+  if (vel <= 0.0) {
+    return 1;
+  }
+
+  /* no decel needed, may run on past targetPos into the next move */
+  dist = tcStopDist(vel, accel, tc->rampVel, tc->aMax, tc->jMax);
+  if (dist <= 0.0) {
+    return 1;
+  }
+
+  return dist <= tc->toGo + tc->rampDist - (tc->currentVel + vel) * 0.5 * tc->cycleTime;
+}
+
+/*
+  tcRunJerkCycle() is tcRunCycle() for a jerk limited S-curve profile.
+  Accel changes by at most jMax per sec. It ramps toward the accel that
+  just levels off at the target velocity, and backs off to the highest
+  accel from which tcStopDist() still fits in toGo.
+*/
+static int tcRunJerkCycle(TC_STRUCT *tc, int oldTcFlag)
+{
+  double newPos;
+  double newVel;
+  double newAccel;
+  double vTarget, dv, aUp, lo, hi, mid;
+  double jStep = tc->jMax * tc->cycleTime;
+  int isDistLimited = 0;
+  int isDone = 0;
+  int i;
+
+  vTarget = (tc->vMax - tc->preVMax) * tc->vScale;
+  if (vTarget > tc->vLimit) {
+    vTarget = tc->vLimit;
+  }
+  if (tc->type == TC_CIRCULAR) {
+    if (vTarget > tc->vCircle) {
+      vTarget = tc->vCircle;
+    }
+  }
+  if (vTarget < 0.0) {
+    vTarget = 0.0;
+  }
+
+  /* give credit for previous segment's decel, like tcRunCycle() */
+  aUp = tc->aMax - tc->preAMax;
+  if (aUp < 0.0) {
+    aUp = 0.0;
+  }
+
+  /* accel that ramps out right at vTarget, one jStep per cycle */
+  dv = vTarget - tc->currentVel;
+  if (dv > 0.0) {
+    hi = -0.5 * jStep + sqrt(0.25 * jStep * jStep + 2.0 * tc->jMax * dv);
+  }
+  else {
+    hi = 0.5 * jStep - sqrt(0.25 * jStep * jStep - 2.0 * tc->jMax * dv);
+  }
+  if (hi > tc->currentAccel + jStep) {
+    hi = tc->currentAccel + jStep;
+  }
+  if (hi < tc->currentAccel - jStep) {
+    hi = tc->currentAccel - jStep;
+  }
+  if (hi > aUp) {
+    hi = aUp;
+  }
+  if (hi < -tc->aMax) {
+    hi = -tc->aMax;
+  }
+  if ((dv >= 0.0 && hi * tc->cycleTime >= dv) ||
+      (dv <= 0.0 && hi * tc->cycleTime <= dv)) {
+    /* reaches vTarget this cycle */
+    hi = dv / tc->cycleTime;
+  }
+
+  newAccel = hi;
+  if (!tcJerkCanStop(tc, hi)) {
+    isDistLimited = 1;
+    lo = tc->currentAccel - jStep;
+    if (lo < -tc->aMax) {
+      lo = -tc->aMax;
+    }
+    if (lo > hi) {
+      lo = hi;
+    }
+    /* largest accel that can still stop, lo always stops if anything does */
+    for (i = 0; i < 16; i++) {
+      mid = 0.5 * (lo + hi);
+      if (tcJerkCanStop(tc, mid)) {
+	lo = mid;
+      }
+      else {
+	hi = mid;
+      }
+    }
+    newAccel = lo;
+  }
+
+  newVel = tc->currentVel + newAccel * tc->cycleTime;
+  if (newVel <= 0.0) {
+    newVel = 0.0;
+    newAccel = -tc->currentVel / tc->cycleTime;
+    if (isDistLimited) {
+      isDone = 1;
+    }
+  }
+  else if (isDistLimited && tc->finalVel <= 0.0 &&
+	   newVel <= jStep * tc->cycleTime) {
+    /* within a cycle of stopping */
+    isDone = 1;
+  }
+
+  newPos = tc->currentPos + (newVel + tc->currentVel) * 0.5 * tc->cycleTime;
+  if (newPos >= tc->targetPos) {
+    isDone = 1;
+  }
+
+  if (isDone) {
+    if (tc->finalVel > 0.0 && newPos >= tc->targetPos) {
+      /* passed the end at the planned exit velocity, see tcCarryCycle() */
+      tc->overshoot = newPos - tc->targetPos;
+    }
+    else {
+      newVel = 0.0;
+      newAccel = 0.0;
+    }
+    newPos = tc->targetPos;
+    tc->tcFlag = TC_IS_DONE;
+    /* set any end output bits */
+    if (tc->douts) {
+      tcDoutByte |= (tc->douts & tc->doutends);
+      tcDoutByte &= (~tc->douts | tc->doutends);
+      //extMotDout(tcDoutByte);
+    }
+  }
+  else if (isDistLimited) {
+    tc->tcFlag = TC_IS_DECEL;
+  }
+  else if (newAccel < 0.0) {
+    /* slowing to a scaled back velocity, don't flag a decel unless we
+       were already decelerating, see tcRunCycle() */
+    tc->tcFlag = oldTcFlag == TC_IS_DECEL ? TC_IS_DECEL : TC_IS_ACCEL;
+  }
+  else if (newAccel > 0.0) {
+    tc->tcFlag = TC_IS_ACCEL;
+  }
+  else if (newVel < TC_VEL_EPSILON &&
+	   tc->vScale < TC_SCALE_EPSILON) {
+    tc->tcFlag = TC_IS_PAUSED;
+  }
+  else {
+    tc->tcFlag = TC_IS_CONST;
+  }
+
+  tc->currentPos = newPos;
+  tc->currentVel = newVel;
+  tc->currentAccel = newAccel;
+
+  return 0;
+}
+
 int tcRunCycle(TC_STRUCT *tc)
 {
   double newPos;
   double newVel;
   double newAccel;
   double discr;
+  double toGoFinal;
   int isScaleDecel;
   int oldTcFlag;
 
@@ -388,16 +646,6 @@ int tcRunCycle(TC_STRUCT *tc)
     return -1;
   }
 
-  /* compute newvel = 0 limit first */
-  discr = 0.5 * tc->cycleTime * tc->currentVel - tc->toGo;
-  if (discr > 0.0) {
-    newVel = 0.0;
-  }
-  else {
-    discr = 0.25 * tc->cycleTime * tc->cycleTime - 2.0 / tc->aMax * discr;
-    newVel = - 0.5 * tc->aMax * tc->cycleTime + tc->aMax * sqrt(discr);
-  }
-
   if (tc->tcFlag == TC_IS_UNSET) {
     /* it's the start of this segment, so set any start output bits */
     if (tc->douts) {
@@ -407,6 +655,25 @@ int tcRunCycle(TC_STRUCT *tc)
     }
   }
 
+  if (tc->jMax > 0.0) {
+    return tcRunJerkCycle(tc, oldTcFlag);
+  }
+
+  /* compute newvel = finalVel limit first, run as if the move stops
+     beyond its end by the distance it takes to stop from finalVel */
+  toGoFinal = tc->toGo;
+  if (tc->finalVel > 0.0) {
+    toGoFinal += 0.5 * tc->finalVel * tc->finalVel / tc->aMax + 0.5 * tc->cycleTime * tc->finalVel;
+  }
+  discr = 0.5 * tc->cycleTime * tc->currentVel - toGoFinal;
+  if (discr > 0.0) {
+    newVel = 0.0;
+  }
+  else {
+    discr = 0.25 * tc->cycleTime * tc->cycleTime - 2.0 / tc->aMax * discr;
+    newVel = - 0.5 * tc->aMax * tc->cycleTime + tc->aMax * sqrt(discr);
+  }
+
   if (newVel <= 0.0) {
     newVel = 0.0;
     newAccel = 0;
@@ -438,8 +705,8 @@ int tcRunCycle(TC_STRUCT *tc)
     }
 
     if (tc->type == TC_CIRCULAR) {
-      if (newVel > pmSqrt(tc->aMax*tc->circle.radius)) {
-	newVel = pmSqrt(tc->aMax*tc->circle.radius);
+      if (newVel > tc->vCircle) {
+	newVel = tc->vCircle;
       }
     }
 
@@ -468,21 +735,22 @@ int tcRunCycle(TC_STRUCT *tc)
       }
     }
 
-#ifdef A_CHANGE_MAX
-    if (newAccel > A_CHANGE_MAX*tc->cycleTime+tc->currentAccel) {
-      newAccel = A_CHANGE_MAX*tc->cycleTime + tc->currentAccel;
-      newVel = tc->currentVel + newAccel * tc->cycleTime;
-    }
-    else if(newAccel < -A_CHANGE_MAX*tc->cycleTime+tc->currentAccel) {
-      newAccel = -A_CHANGE_MAX*tc->cycleTime + tc->currentAccel;
-      newVel = tc->currentVel + newAccel * tc->cycleTime;
-    }
-#endif
-
     tc->toGo = (newVel + tc->currentVel) * 0.5 * tc->cycleTime;
     newPos = tc->currentPos + tc->toGo;
 
-    if (newAccel < 0.0) {
+    if (tc->finalVel > 0.0 && newPos >= tc->targetPos) {
+      /* passed the end at the planned exit velocity, the rest of this
+         cycle is run by the next move, see tcCarryCycle() */
+      tc->overshoot = newPos - tc->targetPos;
+      newPos = tc->targetPos;
+      tc->tcFlag = TC_IS_DONE;
+      if (tc->douts) {
+	tcDoutByte |= (tc->douts & tc->doutends);
+	tcDoutByte &= (~tc->douts | tc->doutends);
+	//extMotDout(tcDoutByte);
+      }
+    }
+    else if (newAccel < 0.0) {
       if (isScaleDecel && oldTcFlag != TC_IS_DECEL) {
 	/* we're decelerating, but blending next move is not
 	   being done yet, so don't flag a decel. This will
@@ -512,6 +780,252 @@ int tcRunCycle(TC_STRUCT *tc)
   return 0;
 }
 
+/*
+  tcCarryCycle() starts tc part way through a cycle, entering at vel and
+  accel with pos already run. Used when the previous move passed its end at a planned
+  exit velocity. A pos beyond the end of a short move is carried on again
+  if this move also has a planned exit velocity.
+*/
+int tcCarryCycle(TC_STRUCT *tc, double vel, double accel, double pos)
+{
+  if (0 == tc) {
+    return -1;
+  }
+
+  tc->currentVel = vel;
+  tc->currentAccel = tc->jMax > 0.0 ? accel : 0.0;
+  tc->overshoot = 0.0;
+
+  if (pos >= tc->targetPos) {
+    if (tc->finalVel > 0.0) {
+      tc->overshoot = pos - tc->targetPos;
+    }
+    tc->currentPos = tc->targetPos;
+    tc->tcFlag = TC_IS_DONE;
+  }
+  else {
+    tc->currentPos = pos;
+    tc->tcFlag = TC_IS_CONST;
+  }
+
+  return 0;
+}
+
+/* tcGetMaxVel() returns the highest velocity tcRunCycle() allows for tc. */
+double tcGetMaxVel(TC_STRUCT *tc)
+{
+  double vMax;
+
+  if (0 == tc) {
+    return 0.0;
+  }
+
+  vMax = tc->vMax * tc->vScale;
+  if (vMax > tc->vLimit) {
+    vMax = tc->vLimit;
+  }
+  if (tc->type == TC_CIRCULAR && vMax > tc->vCircle) {
+    vMax = tc->vCircle;
+  }
+
+  return vMax;
+}
+
+/* distance a jerk limited change from v1 up to v2 takes, starting and ending with zero accel */
+static double tcJerkChangeDist(TC_STRUCT *tc, double v1, double v2)
+{
+  double dv = v2 - v1;
+
+  if (dv >= tc->aMax * tc->aMax / tc->jMax) {
+    return 0.5 * (v1 + v2) * (dv / tc->aMax + tc->aMax / tc->jMax);
+  }
+
+  return (v1 + v2) * sqrt(dv / tc->jMax);
+}
+
+/*
+  tcGetReachVel() returns the highest velocity tc can change to from vel,
+  or from which it can change back to vel, within dist. Used by the
+  planner to look ahead over the queued moves.
+*/
+double tcGetReachVel(TC_STRUCT *tc, double vel, double dist)
+{
+  double lo, hi, mid;
+  int i;
+
+  if (0 == tc || dist <= 0.0) {
+    return vel;
+  }
+
+  /* the trapezoid profile bounds the S-curve one */
+  hi = pmSqrt(pmSq(vel) + 2.0 * tc->aMax * dist);
+  if (tc->jMax <= 0.0) {
+    return hi;
+  }
+
+  lo = vel;
+  for (i = 0; i < 32; i++) {
+    mid = 0.5 * (lo + hi);
+    if (tcJerkChangeDist(tc, vel, mid) <= dist) {
+      lo = mid;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* time a change between v1 and v2 takes at aMax, jerk limited if jMax is set */
+static double tcChangeTime(TC_STRUCT *tc, double v1, double v2)
+{
+  double dv = fabs(v2 - v1);
+
+  if (tc->jMax <= 0.0) {
+    return dv / tc->aMax;
+  }
+  if (dv >= tc->aMax * tc->aMax / tc->jMax) {
+    return dv / tc->aMax + tc->aMax / tc->jMax;
+  }
+
+  return 2.0 * sqrt(dv / tc->jMax);
+}
+
+/* distance a change between v1 and v2 takes, see tcChangeTime() */
+static double tcChangeDist(TC_STRUCT *tc, double v1, double v2)
+{
+  if (tc->jMax <= 0.0) {
+    return fabs(pmSq(v2) - pmSq(v1)) / (2.0 * tc->aMax);
+  }
+
+  return v1 < v2 ? tcJerkChangeDist(tc, v1, v2) : tcJerkChangeDist(tc, v2, v1);
+}
+
+/*
+  tcGetRunTime() returns the time tc takes from entry velocity vel to its
+  planned exit finalVel without running cycles: accel to the highest
+  velocity that still leaves room for the decel, cruise, decel. Each
+  change starts and ends at zero accel, so a jerk limited move that
+  carries its accel across moves runs a little faster. *accelTime and
+  *decelTime get the time of the changes and *peakVel the top velocity.
+*/
+double tcGetRunTime(TC_STRUCT *tc, double vel, double *peakVel,
+		    double *accelTime, double *decelTime)
+{
+  double vMax, vf, lo, hi, mid, dist;
+  int i;
+
+  *peakVel = *accelTime = *decelTime = 0.0;
+  if (0 == tc || tc->targetPos <= 0.0 || tc->aMax <= 0.0) {
+    return 0.0;
+  }
+
+  vMax = tcGetMaxVel(tc);
+  vf = tc->finalVel < vMax ? tc->finalVel : vMax;
+  if (vel > vMax) {
+    vel = vMax;
+  }
+  if (tcChangeDist(tc, vel, vf) >= tc->targetPos) {
+    /* no room to cruise, the planner keeps this from happening */
+    *peakVel = vel > vf ? vel : vf;
+    if (vel < vf) {
+      *accelTime = 2.0 * tc->targetPos / (vel + vf);
+    }
+    else {
+      *decelTime = 2.0 * tc->targetPos / (vel + vf);
+    }
+    return *accelTime + *decelTime;
+  }
+
+  hi = vMax;
+  if (tcChangeDist(tc, vel, hi) + tcChangeDist(tc, hi, vf) > tc->targetPos) {
+    if (tc->jMax <= 0.0) {
+      hi = pmSqrt(tc->aMax * tc->targetPos + 0.5 * (pmSq(vel) + pmSq(vf)));
+    }
+    else {
+      lo = vel > vf ? vel : vf;
+      for (i = 0; i < 32; i++) {
+	mid = 0.5 * (lo + hi);
+	if (tcChangeDist(tc, vel, mid) + tcChangeDist(tc, mid, vf) <= tc->targetPos) {
+	  lo = mid;
+	}
+	else {
+	  hi = mid;
+	}
+      }
+      hi = lo;
+    }
+  }
+
+  *peakVel = hi;
+  *accelTime = tcChangeTime(tc, vel, hi);
+  *decelTime = tcChangeTime(tc, hi, vf);
+  dist = tc->targetPos - tcChangeDist(tc, vel, hi) - tcChangeDist(tc, hi, vf);
+
+  return *accelTime + *decelTime + (dist > 0.0 ? dist / hi : 0.0);
+}
+
+/* Rotation steps between exact sin(),cos() of the arc angle, and the
+   largest angle step taken by rotation instead of sin(),cos(). */
+#define TC_ARC_RESYNC 256
+#define TC_ARC_MAX_STEP 0.01
+
+/*
+  Moves arcCos,arcSin to the given angle along the circle. Each cycle
+  advances the angle by a small step, so the new values come from rotating
+  the old ones by the step, with the step's sin and cos from their series
+  (truncation below 1e-17 at TC_ARC_MAX_STEP). Every TC_ARC_RESYNC steps,
+  or on a large step, the values are recomputed exactly to keep the
+  rounding drift bounded.
+*/
+static void tcArcAngle(TC_STRUCT *tc, double angle)
+{
+  double d, d2, cd, sd, c, s;
+
+  if (angle == tc->arcAngle) {
+    return;
+  }
+
+  d = angle - tc->arcAngle;
+  if (++tc->arcSteps >= TC_ARC_RESYNC || fabs(d) > TC_ARC_MAX_STEP) {
+    tc->arcCos = cos(angle);
+    tc->arcSin = sin(angle);
+    tc->arcSteps = 0;
+  }
+  else {
+    d2 = d * d;
+    cd = 1.0 - d2 * (0.5 - d2 * (1.0 / 24.0 - d2 * (1.0 / 720.0)));
+    sd = d * (1.0 - d2 * (1.0 / 6.0 - d2 * (1.0 / 120.0)));
+    c = tc->arcCos;
+    s = tc->arcSin;
+    tc->arcCos = c * cd - s * sd;
+    tc->arcSin = s * cd + c * sd;
+  }
+  tc->arcAngle = angle;
+}
+
+/* Same point as pmCirclePoint() at arcAngle, from the cached arcCos,arcSin. */
+static void tcArcPoint(TC_STRUCT *tc, PmCartesian *point)
+{
+  PmCircle *circle = &tc->circle;
+  PmCartesian par, perp;
+  double scale;
+
+  /* radius vector rel to center */
+  pmCartScalMult(circle->rTan, tc->arcCos, &par);
+  pmCartScalMult(circle->rPerp, tc->arcSin, &perp);
+  pmCartCartAdd(par, perp, point);
+
+  /* spiral in the radial dir and helix, scaled by the angle so far */
+  scale = circle->angle > 0.0 ? tc->arcAngle / circle->angle : 0.0;
+  pmCartScalMult(*point, 1.0 + scale * circle->spiral / circle->radius, point);
+  pmCartScalMult(circle->rHelix, scale, &perp);
+  pmCartCartAdd(*point, perp, point);
+
+  pmCartCartAdd(circle->center, *point, point);
+}
+
 EmcPose tcGetPos(TC_STRUCT *tc)
 {
   EmcPose v;
@@ -533,7 +1047,8 @@ EmcPose tcGetPos(TC_STRUCT *tc)
     }
   else if (tc->type == TC_CIRCULAR)
     {
-      pmCirclePoint(&tc->circle, tc->currentPos / tc->circle.radius, &v1);
+      tcArcAngle(tc, tc->currentPos / tc->circle.radius);
+      tcArcPoint(tc, &v1.tran);
     }
   else
     {
@@ -767,11 +1282,12 @@ int tcqInit(TC_QUEUE_STRUCT *tcq)
 }
 
 /* put sometc on the end of the queue */
-int tcqPut(TC_QUEUE_STRUCT *tcq, TC_STRUCT tc)
+int tcqPut(TC_QUEUE_STRUCT *tcq, const TC_STRUCT *tc)
 {
   /* check for initialized */
   if (0 == tcq ||
-      0 == tcq->queue)
+      0 == tcq->queue ||
+      0 == tc)
   {
     return -1;
   }
@@ -783,7 +1299,7 @@ int tcqPut(TC_QUEUE_STRUCT *tcq, TC_STRUCT tc)
   }
 
   /* add it */
-  tcq->queue[tcq->end] = tc;
+  tcq->queue[tcq->end] = *tc;
   tcq->_len++;
 
   /* update end ptr, modulo size of queue */
@@ -798,51 +1314,27 @@ int tcqPut(TC_QUEUE_STRUCT *tcq, TC_STRUCT tc)
   return 0;
 }
 
-/* get the first item from the beginning of the queue */
-TC_STRUCT tcqGet(TC_QUEUE_STRUCT *tcq, int *status)
+/* get the first item from the beginning of the queue into tc, -1 if empty */
+int tcqGet(TC_QUEUE_STRUCT *tcq, TC_STRUCT *tc)
 {
-  TC_STRUCT tc;
-
   if ((0 == tcq) ||
       (0 == tcq->queue) ||              /* not initialized */
       ((tcq->start == tcq->end) && ! tcq->allFull)) /* empty queue */
   {
-    if (0 != status)
-    {
-      *status = -1;             /* set status flag, if passed */
-    }
-    tc.cycleTime=0;
-    tc.targetPos=0;             /* positive motion progession */
-    tc.vMax=0;                  /* max velocity */
-    tc.vScale=0;                /* scale factor for vMax */
-    tc.aMax=0;                  /* max accel */
-    tc.preVMax=0;               /* vel from previous blend */
-    tc.preAMax=0;               /* decel (negative) from previous blend */
-    tc.vLimit=0;                /* abs vel limit, including scale */
-    tc.toGo=0;
-    tc.currentPos=0;
-    tc.currentVel=0;
-    tc.currentAccel=0;
-    tc.tcFlag=0;                        /* TC_IS_DONE,ACCEL,CONST,DECEL*/
-    tc.type=0;                  /* TC_LINEAR, TC_CIRCULAR */
-    tc.id=0;                    /* id for motion segment */
-    tc.termCond=0;                      /* TC_END_STOP,BLEND */
-    return tc;
-  }
-
-  /* get current int and set status for returning */
-  if (0 != status)
+    return -1;
+  }
+
+  if (0 != tc)
   {
-    *status = 0;
+    *tc = tcq->queue[tcq->start];
   }
-  tc = tcq->queue[tcq->start];
 
   /* update start ptr and reset allFull flag and len */
   tcq->start = (tcq->start + 1) % tcq->size;
   tcq->allFull = 0;
   tcq->_len--;
 
-  return tc;
+  return 0;
 }
 
 /* remove n items from the queue */
@@ -1047,36 +1539,63 @@ int tcForceCycle(TC_STRUCT *tc, double ratio)
 
 PmCartesian tcGetUnitCart(TC_STRUCT *tc)
 {
-  PmPose currentPose;
-  PmCartesian radialCart;
+  PmCartesian par, perp;
   static const PmCartesian fake= {1.0,0.0,0.0};
 
   if(tc->type == TC_LINEAR)
     {
-      pmCartCartSub(tc->line.end.tran,tc->line.start.tran,&tc->unitCart);
-#ifdef USE_PM_CART_NORM
-      pmCartNorm(tc->unitCart,&tc->unitCart);
-#else    
-      pmCartUnit(tc->unitCart,&tc->unitCart);
-#endif
+      /* set once by tcSetLine() */
       return(tc->unitCart);
     }
   else if(tc->type == TC_CIRCULAR)
     {
-      pmCirclePoint(&tc->circle,tc->currentPos,&currentPose);
-      pmCartCartSub(currentPose.tran, tc->circle.center, &radialCart);
-      pmCartCartCross(tc->circle.normal, radialCart,&tc->unitCart);
-#ifdef USE_PM_CART_NORM
-      pmCartNorm(tc->unitCart,&tc->unitCart);
-#else    
-      pmCartUnit(tc->unitCart,&tc->unitCart);
-#endif
+      if (tc->unitCartPos != tc->currentPos)
+	{
+	  /* normal x radius vector, normal x rTan = rPerp and normal x rPerp = -rTan */
+	  tcArcAngle(tc, tc->currentPos / tc->circle.radius);
+	  pmCartScalMult(tc->circle.rPerp, tc->arcCos / tc->circle.radius, &par);
+	  pmCartScalMult(tc->circle.rTan, -tc->arcSin / tc->circle.radius, &perp);
+	  pmCartCartAdd(par, perp, &tc->unitCart);
+	  tc->unitCartPos = tc->currentPos;
+	}
       return(tc->unitCart);
     }
   // It should never really get here.
   return fake;
 }
 
+/* Unit tangent of the translation at the start and end of tc, used for junction planning. */
+static PmCartesian tcGetTangent(TC_STRUCT *tc, double angle)
+{
+  PmCartesian par, perp, tan;
+
+  if (tc->type == TC_CIRCULAR) {
+    /* derivative of pmCirclePoint(), spiral is ignored */
+    pmCartScalMult(tc->circle.rTan, -sin(angle), &par);
+    pmCartScalMult(tc->circle.rPerp, cos(angle), &perp);
+    pmCartCartAdd(par, perp, &tan);
+    if (tc->circle.angle > 0.0) {
+      pmCartScalMult(tc->circle.rHelix, 1.0 / tc->circle.angle, &perp);
+      pmCartCartAdd(tan, perp, &tan);
+    }
+  }
+  else {
+    pmCartCartSub(tc->line.end.tran, tc->line.start.tran, &tan);
+  }
+  pmCartUnit(tan, &tan);
+  return tan;
+}
+
+PmCartesian tcGetStartUnitCart(TC_STRUCT *tc)
+{
+  return tcGetTangent(tc, 0.0);
+}
+
+PmCartesian tcGetEndUnitCart(TC_STRUCT *tc)
+{
+  return tcGetTangent(tc, tc->type == TC_CIRCULAR ? tc->circle.angle : 0.0);
+}
+
 int tcSetDout(TC_STRUCT *tc, unsigned char douts, unsigned char starts, unsigned char ends)
 {
   if (0 == tc) {
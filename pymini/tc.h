@@ -54,35 +54,58 @@
 
 typedef struct
 {
-  double cycleTime;
+  /* per cycle state and limits, first so tpRunCycle() walking the queue
+     stays within the first cache lines of each tc */
+  double currentPos;
+  double currentVel;
+  double currentAccel;
+  double toGo;
   double targetPos;             /* positive motion progession */
+  double cycleTime;
   double vMax;                  /* max velocity */
   double vScale;                /* scale factor for vMax */
+  double vLimit;                /* abs vel limit, including scale */
+  double vCircle;               /* centripetal vel limit sqrt(aMax * radius), circles only */
   double aMax;                  /* max accel */
+  double jMax;                  /* max jerk, 0 = trapezoid profile */
   double preVMax;               /* vel from previous blend */
   double preAMax;               /* decel (negative) from previous blend */
-  double vLimit;                /* abs vel limit, including scale */
-  double toGo;
-  double currentPos;
-  double currentVel;
-  double currentAccel;
+  double finalVel;              /* planned exit vel, 0 = stop or classic blend */
+  double rampVel;               /* vel the planned decel through finalVel ends at, */
+  double rampDist;              /* rampDist beyond targetPos, for jerk limited moves */
+  double overshoot;             /* distance run past targetPos in the last cycle at finalVel */
+  double tmag;			/* magnitude of translation */
+  double abc_mag;		/* magnitude of rotation  */
   int tcFlag;                   /* TC_IS_DONE,ACCEL,CONST,DECEL*/
   int type;                     /* TC_LINEAR, TC_CIRCULAR */
   int id;                       /* id for motion segment */
   int termCond;                 /* TC_END_STOP,BLEND */
-  PmLine line;
-  PmLine line_abc;
-  PmCircle circle;
-  double tmag;			/* magnitude of translation */
-  double abc_mag;		/* magnitude of rotation  */
+  unsigned char douts;		/* mask for douts to set */
+  unsigned char doutstarts;	/* mask for dout start vals */
+  unsigned char doutends;	/* mask for dout end vals */
+
+  /* position and direction along the path */
+  PmCartesian unitCart;
+  double unitCartPos;           /* currentPos of a circular unitCart, -1 = not set */
+  double arcAngle;              /* angle along the circle of arcCos,arcSin */
+  double arcCos;
+  double arcSin;
+  int arcSteps;                 /* rotation steps since arcCos,arcSin were exact */
+
+  /* set up and planning only */
+  double junctionVel;           /* max vel entering from the previous move, junction deviation */
   double tvMax;			/* maximum translational velocity */
   double taMax;			/* maximum translational accelleration */
   double abc_vMax;		/* maximum rotational velocity */
   double abc_aMax;		/* maximum rotational accelleration */
-  PmCartesian unitCart;
-  unsigned char douts;		/* mask for douts to set */
-  unsigned char doutstarts;	/* mask for dout start vals */
-  unsigned char doutends;	/* mask for dout end vals */
+
+  /* geometry, type selects line or circle */
+  PmLine line_abc;
+  union
+  {
+    PmLine line;
+    PmCircle circle;
+  };
 } TC_STRUCT;
 
 extern unsigned char tcDoutByte;
@@ -103,6 +126,7 @@ int tcSetRVmax(TC_STRUCT *tc, double vmax);
 int tcSetVscale(TC_STRUCT *tc, double vscale);
 int tcSetTAmax(TC_STRUCT *tc, double amax);
 int tcSetRAmax(TC_STRUCT *tc, double wmax);
+int tcSetJmax(TC_STRUCT *tc, double jmax);
 int tcSetPremax(TC_STRUCT *tc, double vmax, double amax);
 int tcSetVlimit(TC_STRUCT *tc, double vlimit);
 int tcSetId(TC_STRUCT *tc, int id);
@@ -110,6 +134,13 @@ int tcGetId(TC_STRUCT *tc);
 int tcSetTermCond(TC_STRUCT *tc, int cond);
 int tcGetTermCond(TC_STRUCT *tc);
 int tcRunCycle(TC_STRUCT *tc);
+int tcCarryCycle(TC_STRUCT *tc, double vel, double accel, double pos);
+double tcGetMaxVel(TC_STRUCT *tc);
+double tcGetReachVel(TC_STRUCT *tc, double vel, double dist);
+double tcGetRunTime(TC_STRUCT *tc, double vel, double *peakVel,
+		    double *accelTime, double *decelTime);
+PmCartesian tcGetStartUnitCart(TC_STRUCT *tc);
+PmCartesian tcGetEndUnitCart(TC_STRUCT *tc);
 EmcPose tcGetPos(TC_STRUCT *tc);
 EmcPose tcGetGoalPos(TC_STRUCT *tc);
 double tcGetVel(TC_STRUCT *tc);
@@ -149,10 +180,10 @@ int tcqDelete(TC_QUEUE_STRUCT *tcq);
 int tcqInit(TC_QUEUE_STRUCT *tcq);
 
 /* put tc on end */
-int tcqPut(TC_QUEUE_STRUCT *tcq, TC_STRUCT tc);
+int tcqPut(TC_QUEUE_STRUCT *tcq, const TC_STRUCT *tc);
 
 /* get tcq from front */
-TC_STRUCT tcqGet(TC_QUEUE_STRUCT *tcq, int *status);
+int tcqGet(TC_QUEUE_STRUCT *tcq, TC_STRUCT *tc);
 
 /* remove n tcs from front */
 int tcqRemove(TC_QUEUE_STRUCT *tcq, int n);
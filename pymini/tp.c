@@ -42,11 +42,14 @@
   23-Jan-1997  FMP created from tc.c
 */
 
+#include <math.h>
 #include "posemath.h"
 #include "tc.h"
 #include "tp.h"
 #include "bug.h"
 
+static void tpPlan(TP_STRUCT *tp);
+
 int tpCreate(TP_STRUCT *tp, int _queueSize, TC_STRUCT *tcSpace)
 {
   if (0 == tp) {
@@ -101,11 +104,14 @@ int tpClear(TP_STRUCT *tp)
   tp->nextId = 0;
   tp->execId = 0;
   tp->termCond = TC_TERM_COND_BLEND;
+  tp->tolerance = 0.0;
   tp->done = 1;
   tp->depth = 0;
   tp->activeDepth = 0;
   tp->aborting = 0;
   tp->pausing = 0;
+  tp->estimateVel = 0.0;
+  tp->estimateDecel = 0.0;
   tp->vScale = tp->vRestore;
 
   return 0;
@@ -115,11 +121,14 @@ int tpInit(TP_STRUCT *tp)
 {
   tp->cycleTime = 0.0;
   tp->vLimit = 0.0;
+  tp->vMaxLimit = 0.0;
   tp->vScale = tp->vRestore = 1.0;
   tp->aMax = 0.0;
+  tp->jMax = 0.0;
   tp->vMax = 0.0;
   tp->wMax = 0.0;
   tp->wDotMax = 0.0;
+  tp->junctionDeviation = 0.0;
 
   tp->currentPos.tran.x = 0.0;
   tp->currentPos.tran.y = 0.0;
@@ -155,6 +164,33 @@ int tpSetVmax(TP_STRUCT *tp, double vMax)
   return 0;
 }
 
+/*
+  tpSetVmaxLimit() sets the axis limited velocity for subsequent moves.
+  A feed override above 1 scales vMax up to at most this, 0 leaves only
+  vLimit.
+  */
+int tpSetVmaxLimit(TP_STRUCT *tp, double vMaxLimit)
+{
+  if (0 == tp ||
+      vMaxLimit < 0.0) {
+    return -1;
+  }
+
+  tp->vMaxLimit = vMaxLimit;
+
+  return 0;
+}
+
+/* absolute upper limit on the vel of the next queued move */
+static double tpMoveVlimit(TP_STRUCT *tp)
+{
+  if (tp->vMaxLimit > 0.0 && tp->vMaxLimit < tp->vLimit) {
+    return tp->vMaxLimit;
+  }
+
+  return tp->vLimit;
+}
+
 int tpSetWmax(TP_STRUCT *tp, double wMax)
 {
   if (0 == tp ||
@@ -214,6 +250,12 @@ int tpSetVscale(TP_STRUCT *tp, double scale)
       thisTc = tcqItem(&tp->queue, t, 0);
       tcSetVscale(thisTc, scale);
     }
+
+    /* replan the exit velocities for the new scale, a 0 scale
+       (tpPause) is planned on resume */
+    if (scale > 0.0) {
+      tpPlan(tp);
+    }
   }
 
   return 0;
@@ -231,6 +273,23 @@ int tpSetAmax(TP_STRUCT *tp, double aMax)
   return 0;
 }
 
+/*
+  tpSetJmax() sets the jerk limit for subsequent moves. 0 gives the
+  classic trapezoid velocity profile, otherwise moves run a jerk limited
+  S-curve, see tcRunCycle().
+  */
+int tpSetJmax(TP_STRUCT *tp, double jMax)
+{
+  if (0 == tp ||
+      jMax < 0.0) {
+    return -1;
+  }
+
+  tp->jMax = jMax;
+
+  return 0;
+}
+
 int tpSetWDotmax(TP_STRUCT *tp, double wdotmax)
 {
   if (0 == tp ||
@@ -243,6 +302,145 @@ int tpSetWDotmax(TP_STRUCT *tp, double wdotmax)
   return 0;
 }
 
+/*
+  tpSetJunctionDeviation() sets how far the path may be assumed to deviate
+  from a sharp corner when computing the velocity a blended junction can be
+  passed at, see tpJunctionVel(). 0 disables junction planning and moves
+  blend the classic way, by overlapping the decel of one move with the
+  accel of the next.
+  */
+int tpSetJunctionDeviation(TP_STRUCT *tp, double deviation)
+{
+  if (0 == tp ||
+      deviation < 0.0) {
+    return -1;
+  }
+
+  tp->junctionDeviation = deviation;
+
+  return 0;
+}
+
+/*
+  tpJunctionVel() returns the max velocity for entering tc from the last
+  queued move. The corner is treated as a circle tangent to both moves
+  that deviates junctionDeviation from the corner point, and the velocity
+  is the one whose centripetal accel on that circle is aMax.
+  */
+static double tpJunctionVel(TP_STRUCT *tp, TC_STRUCT *tc)
+{
+  TC_STRUCT *prevTc;
+  PmCartesian prevCart, thisCart;
+  double cosTheta, sinHalf, aMax;
+
+  if (tp->junctionDeviation <= 0.0 || 0 == tcqLen(&tp->queue)) {
+    return 0.0;
+  }
+
+  prevTc = tcqLast(&tp->queue, 0);
+  if (0 == prevTc ||
+      tcGetTermCond(prevTc) != TC_TERM_COND_BLEND ||
+      prevTc->tmag < TP_PURE_ROTATION_EPSILON ||
+      tc->tmag < TP_PURE_ROTATION_EPSILON) {
+    return 0.0;
+  }
+
+  prevCart = tcGetEndUnitCart(prevTc);
+  thisCart = tcGetStartUnitCart(tc);
+  pmCartCartDot(prevCart, thisCart, &cosTheta);
+  cosTheta = -cosTheta;
+  if (cosTheta > 0.999999) {
+    /* reversal */
+    return 0.0;
+  }
+
+  sinHalf = pmSqrt(0.5 * (1.0 - cosTheta));
+  if (sinHalf > 0.999999) {
+    /* straight through */
+    return tp->vLimit;
+  }
+
+  aMax = prevTc->aMax < tc->aMax ? prevTc->aMax : tc->aMax;
+  return pmSqrt(aMax * tp->junctionDeviation * sinHalf / (1.0 - sinHalf));
+}
+
+/*
+  tpPlan() sets the exit velocity of each queued move. The backward pass
+  starts with the last queued move stopping at its end and finds the
+  fastest entry from which each move can still slow to its exit, limited
+  by the junction and move velocities. The forward pass then limits each
+  exit to what the move can accelerate to from its entry. tcRunCycle()
+  uses the exit velocity as its decel target, or for a jerk limited move
+  the end of the decel ramp it is part of, rampVel at rampDist past its end.
+  */
+static void tpPlan(TP_STRUCT *tp)
+{
+  TC_STRUCT *thisTc;
+  double vel, maxVel, reachVel, startVel, dist;
+  int t, depth;
+
+  if (tp->junctionDeviation <= 0.0 || tp->pausing) {
+    /* a pause plans on resume, its 0 vScale would plan every move to stop */
+    return;
+  }
+
+  depth = tcqLen(&tp->queue);
+
+  /* backward pass, a jerk limited decel runs on across moves until
+     something limits it, so reach is found over the whole ramp */
+  vel = reachVel = startVel = dist = 0.0;
+  for (t = depth - 1; t >= 0; t--) {
+    thisTc = tcqItem(&tp->queue, t, 0);
+    if (tcIsDone(thisTc) ||
+	(t + 1 < depth && tcqItem(&tp->queue, t + 1, 0)->tcFlag != TC_IS_UNSET)) {
+      /* done, or already blending the classic way into a started move */
+      break;
+    }
+    maxVel = tcGetMaxVel(thisTc);
+    thisTc->finalVel = vel < maxVel ? vel : maxVel;
+    if (thisTc->jMax <= 0.0 || thisTc->finalVel < reachVel) {
+      startVel = thisTc->finalVel;
+      dist = 0.0;
+    }
+    thisTc->rampVel = startVel;
+    thisTc->rampDist = dist;
+    dist += thisTc->targetPos - thisTc->currentPos;
+    vel = reachVel = tcGetReachVel(thisTc, startVel, dist);
+    if (vel > maxVel) {
+      vel = maxVel;
+    }
+    if (vel > thisTc->junctionVel) {
+      vel = thisTc->junctionVel;
+    }
+  }
+
+  /* forward pass, a jerk limited move is left to reach what it can and
+     carries its accel on into the next move, limiting its exit here to a
+     reach from zero accel would restart its ramp at every junction. An
+     unstarted first move enters from a stop, or at the exit of the move
+     tpEstimate() removed before it */
+  vel = tp->estimateVel;
+  for (t = 0; t < depth; t++) {
+    thisTc = tcqItem(&tp->queue, t, 0);
+    if (tcIsDone(thisTc)) {
+      continue;
+    }
+    if (thisTc->jMax > 0.0) {
+      vel = thisTc->finalVel;
+      continue;
+    }
+    if (thisTc->tcFlag != TC_IS_UNSET) {
+      /* already running, starts from where it is now */
+      vel = thisTc->currentVel;
+    }
+    vel = tcGetReachVel(thisTc, vel, thisTc->targetPos - thisTc->currentPos);
+    if (thisTc->finalVel > vel) {
+      thisTc->finalVel = vel;
+    }
+    vel = thisTc->finalVel;
+  }
+}
+
 /*
   tpSetId() sets the id that will be used for the next appended motions.
   nextId is incremented so that the next time a motion is appended its id
@@ -287,12 +485,14 @@ int tpGetExecId(TP_STRUCT *tp)
 }
 
 /*
-  tpSetTermCond(tp, cond) sets the termination condition for all subsequent
-  queued moves. If cond is TC_TERM_STOP, motion comes to a stop before
-  a subsequent move begins. If cond is TC_TERM_BLEND, the following move
-  is begun when the current move decelerates.
+  tpSetTermCond(tp, cond, tolerance) sets the termination condition for all
+  subsequent queued moves. If cond is TC_TERM_STOP, motion comes to a stop
+  before a subsequent move begins. If cond is TC_TERM_BLEND, the following
+  move is begun when the current move decelerates. A tolerance > 0 (G64 P)
+  also rounds blended line corners with arcs that stay within tolerance of
+  the programmed corner, see tpAddBlendArc().
   */
-int tpSetTermCond(TP_STRUCT *tp, int cond)
+int tpSetTermCond(TP_STRUCT *tp, int cond, double tolerance)
 {
   if (0 == tp) {
     return -1;
@@ -303,7 +503,12 @@ int tpSetTermCond(TP_STRUCT *tp, int cond)
     return -1;
   }
 
+  if (tolerance < 0.0) {
+    return -1;
+  }
+
   tp->termCond = cond;
+  tp->tolerance = tolerance;
 
   return 0;
 }
@@ -329,6 +534,107 @@ int tpSetPos(TP_STRUCT *tp, EmcPose pos)
   return 0;
 }
 
+/*
+  tpAddBlendArc() rounds the corner between the last queued line and line
+  with an arc tangent to both, queued between them. The arc radius is the
+  one whose midpoint deviates tp->tolerance from the corner, shrunk so the
+  arc takes at most half of either line. The last queued line is shortened
+  to end at the arc and line is changed to start at its end. Only unstarted
+  translation lines that blend are rounded, other corners are left as is.
+  */
+static int tpAddBlendArc(TP_STRUCT *tp, PmLine *line, PmLine line_abc)
+{
+  TC_STRUCT tc, *prevTc;
+  PmLine prevLine;
+  PmCircle circle;
+  PmCartesian u1, u2, w, normal, corner, center;
+  PmPose start, end;
+  double cosPhi, halfPhi, radius, dist, maxDist;
+
+  if (tp->tolerance <= 0.0 ||
+      tp->termCond != TC_TERM_COND_BLEND ||
+      0 == tcqLen(&tp->queue)) {
+    return 0;
+  }
+
+  prevTc = tcqLast(&tp->queue, 0);
+  if (0 == prevTc ||
+      prevTc->type != TC_LINEAR ||
+      prevTc->tcFlag != TC_IS_UNSET ||
+      tcGetTermCond(prevTc) != TC_TERM_COND_BLEND ||
+      prevTc->abc_mag > TP_PURE_ROTATION_EPSILON ||
+      line_abc.tmag > TP_PURE_ROTATION_EPSILON ||
+      prevTc->tmag < TP_PURE_ROTATION_EPSILON ||
+      line->tmag < TP_PURE_ROTATION_EPSILON) {
+    return 0;
+  }
+
+  u1 = prevTc->unitCart;
+  u2 = line->uVec;
+  pmCartCartDot(u1, u2, &cosPhi);
+  if (cosPhi > 0.999999 || cosPhi < -0.999) {
+    /* straight through needs no arc, a reversal has no room for one */
+    return 0;
+  }
+
+  /* phi is the change in direction, the arc turns through it */
+  halfPhi = 0.5 * acos(cosPhi);
+  radius = tp->tolerance * cos(halfPhi) / (1.0 - cos(halfPhi));
+  dist = radius * tan(halfPhi);
+
+  maxDist = 0.5 * (prevTc->tmag < line->tmag ? prevTc->tmag : line->tmag);
+  if (dist > maxDist) {
+    dist = maxDist;
+    radius = dist / tan(halfPhi);
+  }
+  if (dist < TP_BLEND_EPSILON) {
+    return 0;
+  }
+
+  /* w points from the arc start to its center, normal makes the arc turn from u1 to u2 */
+  pmCartScalMult(u1, cosPhi, &w);
+  pmCartCartSub(u2, w, &w);
+  pmCartUnit(w, &w);
+  pmCartCartCross(u1, w, &normal);
+
+  corner = line->start.tran;
+  start = line->start;
+  pmCartScalMult(u1, -dist, &start.tran);
+  pmCartCartAdd(corner, start.tran, &start.tran);
+  end = line->start;
+  pmCartScalMult(u2, dist, &end.tran);
+  pmCartCartAdd(corner, end.tran, &end.tran);
+  pmCartScalMult(w, radius, &center);
+  pmCartCartAdd(start.tran, center, &center);
+
+  tcInit(&tc);
+  pmCircleInit(&circle, start, end, center, normal, 0);
+  tcSetCycleTime(&tc, tp->cycleTime);
+  tcSetTVmax(&tc, tp->vMax);
+  tcSetTAmax(&tc, tp->aMax);
+  tcSetJmax(&tc, tp->jMax);
+  tcSetRVmax(&tc, tp->wMax);
+  tcSetRAmax(&tc, tp->wDotMax);
+  tcSetVscale(&tc, tp->vScale);
+  tcSetVlimit(&tc, tpMoveVlimit(tp));
+  tcSetCircle(&tc, circle, line_abc);
+  tcSetId(&tc, tp->nextId);
+  tcSetTermCond(&tc, TC_TERM_COND_BLEND);
+
+  /* the arc replaces the corner, so the last line now ends where it starts */
+  pmLineInit(&prevLine, prevTc->line.start, start);
+  tcSetLine(prevTc, prevLine, prevTc->line_abc);
+  tc.junctionVel = tpJunctionVel(tp, &tc);
+
+  if (-1 == tcqPut(&tp->queue, &tc)) {
+    return -1;
+  }
+
+  pmLineInit(line, end, line->end);
+
+  return 0;
+}
+
 int tpAddLine(TP_STRUCT *tp, EmcPose end)
 {
   TC_STRUCT tc;
@@ -366,16 +672,21 @@ int tpAddLine(TP_STRUCT *tp, EmcPose end)
 
   pmLineInit(&line, goal_tran_pose, tran_pose);
   pmLineInit(&line_abc, goal_abc_pose, abc_pose);
+  if (-1 == tpAddBlendArc(tp, &line, line_abc)) {
+    return -1;
+  }
   tcSetCycleTime(&tc, tp->cycleTime);
   tcSetTVmax(&tc, tp->vMax);
   tcSetTAmax(&tc, tp->aMax);
+  tcSetJmax(&tc, tp->jMax);
   tcSetRVmax(&tc, tp->wMax);
   tcSetRAmax(&tc, tp->wDotMax);
   tcSetVscale(&tc, tp->vScale);
-  tcSetVlimit(&tc, tp->vLimit);
+  tcSetVlimit(&tc, tpMoveVlimit(tp));
   tcSetLine(&tc, line, line_abc);
   tcSetId(&tc, tp->nextId);
   tcSetTermCond(&tc, tp->termCond);
+  tc.junctionVel = tpJunctionVel(tp, &tc);
   if (tp->douts) {
     tcSetDout(&tc, tp->douts, tp->doutstart, tp->doutend);
     tp->douts = 0;
@@ -383,7 +694,7 @@ int tpAddLine(TP_STRUCT *tp, EmcPose end)
     tp->doutend = 0;
   }
 
-  if (-1 == tcqPut(&tp->queue, tc)) {
+  if (-1 == tcqPut(&tp->queue, &tc)) {
     return -1;
   }
 
@@ -391,6 +702,7 @@ int tpAddLine(TP_STRUCT *tp, EmcPose end)
   tp->done = 0;
   tp->depth = tcqLen(&tp->queue);
   tp->nextId++;
+  tpPlan(tp);
 
   return 0;
 }
@@ -423,10 +735,11 @@ int tpAddCircle(TP_STRUCT *tp, EmcPose end,
   tcSetCycleTime(&tc, tp->cycleTime);
   tcSetTVmax(&tc, tp->vMax);
   tcSetTAmax(&tc, tp->aMax);
+  tcSetJmax(&tc, tp->jMax);
   tcSetRVmax(&tc, tp->wMax);
   tcSetRAmax(&tc, tp->wDotMax);
   tcSetVscale(&tc, tp->vScale);
-  tcSetVlimit(&tc, tp->vLimit);
+  tcSetVlimit(&tc, tpMoveVlimit(tp));
 
   abc_pose.tran.x = end.a;
   abc_pose.tran.y = end.b;
@@ -443,6 +756,7 @@ int tpAddCircle(TP_STRUCT *tp, EmcPose end,
   tcSetCircle(&tc, circle, line_abc);
   tcSetId(&tc, tp->nextId);
   tcSetTermCond(&tc, tp->termCond);
+  tc.junctionVel = tpJunctionVel(tp, &tc);
 
   if (tp->douts) {
     tcSetDout(&tc, tp->douts, tp->doutstart, tp->doutend);
@@ -451,7 +765,7 @@ int tpAddCircle(TP_STRUCT *tp, EmcPose end,
     tp->doutend = 0;
   }
 
-  if (-1 == tcqPut(&tp->queue, tc)) {
+  if (-1 == tcqPut(&tp->queue, &tc)) {
     return -1;
   }
 
@@ -459,6 +773,7 @@ int tpAddCircle(TP_STRUCT *tp, EmcPose end,
   tp->done = 0;
   tp->depth = tcqLen(&tp->queue);
   tp->nextId++;
+  tpPlan(tp);
 
   return 0;
 }
@@ -481,6 +796,8 @@ int tpRunCycle(TP_STRUCT *tp)
   EmcPose before, after;
   double preVMax = 0.0;
   double preAMax = 0.0;
+  int carry = 0;
+  double carryVel = 0.0, carryAccel = 0.0, carryPos = 0.0;
 
   if (0 == tp) {
     return -1;
@@ -514,7 +831,8 @@ int tpRunCycle(TP_STRUCT *tp)
       continue;
     }
 
-    if (thisTc->currentPos <= 0.0  && (tp->pausing || tp->aborting)) {
+    if (thisTc->currentPos <= 0.0  && (tp->pausing || tp->aborting) && !carry) {
+      /* don't start a new move, unless the last one ran into it */
       continue;
     }
     /* If either this move or the last move was a pure rotation
@@ -566,8 +884,16 @@ int tpRunCycle(TP_STRUCT *tp)
     }
 
     before = tcGetPos(thisTc);
-    tcSetPremax(thisTc, preVMax, preAMax);
-    tcRunCycle(thisTc);
+    if (carry) {
+      /* the last move passed its end at its exit velocity-- this one
+	 runs the rest of the cycle */
+      tcCarryCycle(thisTc, carryVel, carryAccel, carryPos);
+      carry = 0;
+    }
+    else {
+      tcSetPremax(thisTc, preVMax, preAMax);
+      tcRunCycle(thisTc);
+    }
     after = tcGetPos(thisTc);
     if (tp->activeDepth <= toRemove) {
       tp->execId = tcGetId(thisTc);
@@ -584,6 +910,13 @@ int tpRunCycle(TP_STRUCT *tp)
       if (t <= toRemove) {
 	toRemove++;
       }
+      if (thisTc->overshoot > 0.0) {
+	carry = 1;
+	carryVel = thisTc->currentVel;
+	carryAccel = thisTc->currentAccel;
+	carryPos = thisTc->overshoot;
+	thisTc->overshoot = 0.0;
+      }
       continue;
     }
 
@@ -591,7 +924,8 @@ int tpRunCycle(TP_STRUCT *tp)
     tp->activeDepth++;
 
     if (tcIsDecel(thisTc) &&
-	tcGetTermCond(thisTc) == TC_TERM_COND_BLEND) {
+	tcGetTermCond(thisTc) == TC_TERM_COND_BLEND &&
+	thisTc->finalVel <= 0.0) {
       /* this one is decelerating-- blend in the next one with
 	 credit for this decel */
       thisAccel = tcGetAccel(thisTc);
@@ -652,6 +986,70 @@ int tpRunCycle(TP_STRUCT *tp)
   return 0;
 }
 
+/*
+  tpEstimate() removes the first queued move without running it and
+  returns its id, 0 if the queue is empty. *time gets the time the move
+  takes, see tcGetRunTime(), and *slowTime the part of it spent below
+  the move's requested velocity. The move enters at the exit velocity
+  of the last move estimated, and its exit is limited to what it can
+  reach from there, the forward pass of tpPlan(). A classic blend from
+  the last move is credited as overlap, tpRunCycle() starts this move
+  as soon as that one decelerates. Like tpRunCycle() only remove moves
+  once more than the look-ahead are queued, so each is planned with the
+  same moves after it.
+  */
+int tpEstimate(TP_STRUCT *tp, double *time, double *slowTime)
+{
+  TC_STRUCT *tc;
+  double vel, peakVel, accelTime, decelTime, overlap;
+  int id;
+
+  *time = *slowTime = 0.0;
+  if (0 == tp ||
+      0 == (tc = tcqItem(&tp->queue, 0, 0))) {
+    return 0;
+  }
+
+  vel = tcGetReachVel(tc, tp->estimateVel, tc->targetPos);
+  if (tc->finalVel > vel) {
+    tc->finalVel = vel;
+  }
+  *time = tcGetRunTime(tc, tp->estimateVel, &peakVel, &accelTime, &decelTime);
+  if (peakVel < tc->vMax - TP_VEL_EPSILON) {
+    /* never up to speed, a short move, a corner or the vel limits */
+    *slowTime = *time;
+  }
+  else {
+    *slowTime = accelTime + decelTime;
+  }
+
+  if (tp->estimateDecel > 0.0 &&
+      tc->tmag >= TP_PURE_ROTATION_EPSILON) {
+    overlap = tp->estimateDecel < *time ? tp->estimateDecel : *time;
+    *time -= overlap;
+    *slowTime = *slowTime > overlap ? *slowTime - overlap : 0.0;
+  }
+  tp->estimateDecel = 0.0;
+  if (tc->finalVel <= 0.0 &&
+      tcGetTermCond(tc) == TC_TERM_COND_BLEND &&
+      tc->tmag >= TP_PURE_ROTATION_EPSILON) {
+    tp->estimateDecel = decelTime;
+  }
+  tp->estimateVel = tc->finalVel;
+
+  id = tcGetId(tc);
+  tcqRemove(&tp->queue, 1);
+  tp->depth = tcqLen(&tp->queue);
+  if (tp->depth == 0) {
+    /* queue ran out, the last move stops */
+    tp->done = 1;
+    tp->estimateVel = 0.0;
+    tp->estimateDecel = 0.0;
+  }
+
+  return id;
+}
+
 int tpPause(TP_STRUCT *tp)
 {
   if (0 == tp)
@@ -696,6 +1094,9 @@ int tpResume(TP_STRUCT *tp)
 
       /* apply the restored scale value to queued motions */
       tpSetVscale(tp, tp->vScale);
+
+      /* plan the moves queued while paused */
+      tpPlan(tp);
     }
 
   return 0;
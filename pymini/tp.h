@@ -36,6 +36,9 @@
 /* closeness to zero, for determining if vel and accel are effectively zero */
 #define TP_VEL_EPSILON 1e-6
 #define TP_ACCEL_EPSILON 1e-6
+
+/* shortest corner cut worth a blend arc, see tpAddBlendArc() */
+#define TP_BLEND_EPSILON 1e-6
   
 typedef struct
 {
@@ -45,12 +48,16 @@ typedef struct
   double vMax;                  /* vel for subsequent moves */
   double vScale, vRestore;
   double aMax;
+  double jMax;                  /* jerk for subsequent moves, 0 = trapezoid */
   double vLimit;                /* absolute upper limit on all vels */
+  double vMaxLimit;             /* axis limited vel for subsequent moves, 0 = vLimit */
   double wMax;			/* rotational velocity max  */
   double wDotMax;		/* rotational accelleration max */
+  double junctionDeviation;	/* corner path deviation for junction vels, 0 = classic blend only */
   int nextId;
   int execId;
   int termCond;
+  double tolerance;             /* G64 P path deviation, 0 = no blend arcs */
   EmcPose currentPos;
   EmcPose goalPos;
   int done;
@@ -58,6 +65,8 @@ typedef struct
   int activeDepth;              /* number of motions blending */
   int aborting;
   int pausing;
+  double estimateVel;           /* exit vel of the last move tpEstimate() removed */
+  double estimateDecel;         /* its decel time if the next move blends in the classic way */
   unsigned char douts;		/* mask for douts to set */
   unsigned char doutstart;	/* mask for dout start vals */
   unsigned char doutend;	/* mask for dout end vals */
@@ -75,21 +84,25 @@ int tpInit(TP_STRUCT *tp);
 
 int tpSetCycleTime(TP_STRUCT *tp, double secs);
 int tpSetVmax(TP_STRUCT *tp, double vmax);
+int tpSetVmaxLimit(TP_STRUCT *tp, double vMaxLimit);
 int tpSetWmax(TP_STRUCT *tp, double vmax);
 int tpSetVlimit(TP_STRUCT *tp, double limit);
 int tpSetVscale(TP_STRUCT *tp, double scale); /* 0.0 .. large */
 int tpSetAmax(TP_STRUCT *tp, double amax);
+int tpSetJmax(TP_STRUCT *tp, double jmax);
 int tpSetWDotmax(TP_STRUCT *tp, double amax);
+int tpSetJunctionDeviation(TP_STRUCT *tp, double deviation);
 int tpSetId(TP_STRUCT *tp, int id);
 int tpGetNextId(TP_STRUCT *tp);
 int tpGetExecId(TP_STRUCT *tp);
-int tpSetTermCond(TP_STRUCT *tp, int cond);
+int tpSetTermCond(TP_STRUCT *tp, int cond, double tolerance);
 int tpGetTermCond(TP_STRUCT *tp);
 int tpSetPos(TP_STRUCT *tp, EmcPose pos);
 int tpAddLine(TP_STRUCT *tp, EmcPose end);
 int tpAddCircle(TP_STRUCT *tp, EmcPose end,
                        PmCartesian center, PmCartesian normal, int turn);
 int tpRunCycle(TP_STRUCT *tp);
+int tpEstimate(TP_STRUCT *tp, double *time, double *slowTime);
 int tpPause(TP_STRUCT *tp);
 int tpResume(TP_STRUCT *tp);
 int tpAbort(TP_STRUCT *tp);
@@ -48,6 +48,7 @@ enum GUI_EVENT
    GUI_EVENT_MECH_POSITION = 4,
    GUI_EVENT_MECH_ESTOP = 5,
    GUI_EVENT_MECH_PAUSED = 6,
+   GUI_EVENT_MECH_INPUT = 7,
 };
 
 struct emcpose_py
@@ -69,16 +70,15 @@ struct post_position_py
    struct emcpose_py pos;
 };
 
-char USER_HOME_DIR[LINELEN];
-
 static logger_cb_t _logger_cb = NULL;
 static post_event_cb_t _post_event_cb = NULL;
 static post_position_cb_t _post_position_cb = NULL;
 static plugin_cb_t _plugin_cb = NULL;
+static post_input_cb_t _post_input_cb = NULL;
 
 static pthread_mutex_t ui_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-struct emc_session session;
+__thread struct emc_session *current_session;
 
 /* Axis:                                    1    2    3    4     5     6     7     8      9  */
 static const int _map_axes_mask[] = { 0x0, 0x1, 0x3, 0x7, 0xf, 0x1f, 0x3f, 0x7f, 0xff, 0x1ff };
@@ -124,7 +124,7 @@ static double _map_angular_units(const char *units)
    return 0;
 }
 
-static enum EMC_RESULT _load_tool_table(const char *filename, struct CANON_TOOL_TABLE toolTable[])
+static enum EMC_RESULT _load_tool_table(const char *home, const char *filename, struct CANON_TOOL_TABLE toolTable[])
 {
    FILE *fp;
    int i, toolno, pocket, scanned;
@@ -133,7 +133,7 @@ static enum EMC_RESULT _load_tool_table(const char *filename, struct CANON_TOOL_
    char comment[CANON_TOOL_ENTRY_LEN];
    char path[LINELEN];
 
-   snprintf(path, sizeof(path), "%s/%s", USER_HOME_DIR, filename);
+   snprintf(path, sizeof(path), "%s/%s", home, filename);
 
    MSG("Loading tool table: %s\n", path);
 
@@ -237,6 +237,11 @@ static enum EMC_RESULT _load_axis(struct emc_session *ps, int axis)
    if (iniGetKeyValue(section, "MAX_ACCELERATION", inistring, sizeof(inistring)) > 0)
       ps->axis[axis].max_acceleration = strtod(inistring, NULL);
 
+   // set max jerk, 0 = trapezoid velocity profile
+   ps->axis[axis].max_jerk = 0;
+   if (iniGetKeyValue(section, "MAX_JERK", inistring, sizeof(inistring)) > 0)
+      ps->axis[axis].max_jerk = strtod(inistring, NULL);
+
    // set input scale
    ps->axis[axis].steps_per_unit = 0;
    if (iniGetKeyValue(section, "INPUT_SCALE", inistring, sizeof(inistring)) > 0)
@@ -262,9 +267,41 @@ static enum EMC_RESULT _load_axis(struct emc_session *ps, int axis)
    if (iniGetKeyValue(section, "DIRECTION_ACTIVE_HIGH", inistring, sizeof(inistring)) > 0)
       ps->axis[axis].direction_active_high = strtod(inistring, NULL);
 
+   // set dongle for this axis, index into the SERIAL_NUMBER list
+   ps->axis[axis].dongle = 0;
+   if (iniGetKeyValue(section, "DONGLE", inistring, sizeof(inistring)) > 0)
+      ps->axis[axis].dongle = strtod(inistring, NULL);
+   if (ps->axis[axis].dongle < 0 || ps->axis[axis].dongle >= RTSTEPPER_DONGLE_MAX)
+   {
+      BUG("Invalid ini file setting: axis=%d dongle=%d\n", axis, ps->axis[axis].dongle);
+      ps->axis[axis].dongle = 0;
+   }
+
    return EMC_R_OK;
 } /* _load_axis() */
 
+/* Parse comma or space separated dongle serial numbers. Returns number of serial numbers. */
+static int _load_serial_num(const char *value, char serial_num[][64])
+{
+   const char *p = value;
+   int i, n = 0;
+
+   while (*p && n < RTSTEPPER_DONGLE_MAX)
+   {
+      while (*p == ',' || *p == ' ' || *p == '\t')
+         p++;
+      if (*p == 0)
+         break;
+      for (i = 0; *p && *p != ',' && *p != ' ' && *p != '\t'; p++)
+      {
+         if (i < 63)
+            serial_num[n][i++] = *p;
+      }
+      serial_num[n++][i] = 0;
+   }
+   return n;
+} /* _load_serial_num() */
+
 static void _emcpose2py(struct emcpose_py *pospy, EmcPose pos)
 {
    pospy->x = pos.tran.x;
@@ -386,7 +423,7 @@ enum EMC_RESULT emc_post_position_cb_old(EmcPose pos)
 }
 #endif
 
-enum EMC_RESULT emc_post_position_cb(int id, EmcPose pos)
+enum EMC_RESULT emc_post_position_cb(struct emc_session *ps, int id, EmcPose pos)
 {
    struct post_position_py post;
 
@@ -394,8 +431,8 @@ enum EMC_RESULT emc_post_position_cb(int id, EmcPose pos)
    post.id = id;
    _emcpose2py(&post.pos, pos);
 
-   if (_post_position_cb)
-      (_post_position_cb) (GUI_EVENT_MECH_POSITION, &post);  /* post message to gui queue */
+   if (ps->post_position_cb)
+      (ps->post_position_cb) (GUI_EVENT_MECH_POSITION, &post);  /* post message to gui queue */
 
    return EMC_R_OK;
 }
@@ -405,8 +442,8 @@ enum EMC_RESULT emc_post_estop_cb(struct emc_session *ps)
    ps->state_bits |= EMC_STATE_ESTOP_BIT;
 
    DBG("emc_post_estop_cb()\n");
-   if (_post_event_cb)
-      (_post_event_cb) (GUI_EVENT_MECH_ESTOP);  /* post message to gui queue */
+   if (ps->post_event_cb)
+      (ps->post_event_cb) (GUI_EVENT_MECH_ESTOP);  /* post message to gui queue */
    return EMC_R_OK;
 }
 
@@ -415,17 +452,26 @@ enum EMC_RESULT emc_post_paused_cb(struct emc_session *ps)
    ps->state_bits |= EMC_STATE_PAUSED_BIT;
 
    DBG("emc_post_paused_cb()\n");
-   if (_post_event_cb)
-      (_post_event_cb) (GUI_EVENT_MECH_PAUSED);  /* post message to gui queue */
+   if (ps->post_event_cb)
+      (ps->post_event_cb) (GUI_EVENT_MECH_PAUSED);  /* post message to gui queue */
+   return EMC_R_OK;
+}
+
+/* Called from the usb event thread on each dongle INPUTn change. */
+enum EMC_RESULT emc_post_input_cb(struct emc_session *ps, int input_num, int state)
+{
+   DBG("emc_post_input_cb() INPUT%d=%d\n", input_num, state);
+   if (ps->post_input_cb)
+      (ps->post_input_cb) (input_num, state);
    return EMC_R_OK;
 }
 
-enum EMC_RESULT emc_plugin_cb(int mcode, double p_number, double q_number)
+enum EMC_RESULT emc_plugin_cb(struct emc_session *ps, int mcode, double p_number, double q_number)
 {
    DBG("emc_plugin_cb() M%d\n", mcode);
 
-   if (_plugin_cb)
-      (_plugin_cb) (mcode, p_number, q_number);   /* make direct call to python plugin */
+   if (ps->plugin_cb)
+      (ps->plugin_cb) (mcode, p_number, q_number);   /* make direct call to python plugin */
 
    return EMC_R_OK;
 }
@@ -453,6 +499,12 @@ DLL_EXPORT enum EMC_RESULT emc_ui_register_plugin_cb(plugin_cb_t fp)
    return EMC_R_OK;
 }
 
+DLL_EXPORT enum EMC_RESULT emc_ui_register_input_cb(post_input_cb_t fp)
+{
+   _post_input_cb = fp;
+   return EMC_R_OK;
+}
+
 DLL_EXPORT enum EMC_RESULT emc_ui_get_state(void *hd, unsigned long *stat)
 {
    struct emc_session *ps = (struct emc_session *)hd;
@@ -525,6 +577,13 @@ DLL_EXPORT enum EMC_RESULT emc_ui_verify_cancel(void *hd)
    return dsp_verify_cancel(ps);
 }       /* emc_ui_verify_cancel() */
 
+DLL_EXPORT enum EMC_RESULT emc_ui_estimate(void *hd, const char *gcode_file, struct emc_estimate *est, double *line_time, int line_cnt)
+{
+   struct emc_session *ps = (struct emc_session *)hd;
+   DBG("emc_ui_estimate() called\n");
+   return dsp_estimate(ps, gcode_file, est, line_time, line_cnt);
+}       /* emc_ui_estimate() */
+
 DLL_EXPORT enum EMC_RESULT emc_ui_enable_din_abort(void *hd, int input_num)
 {
    struct emc_session *ps = (struct emc_session *)hd;
@@ -542,21 +601,147 @@ DLL_EXPORT enum EMC_RESULT emc_ui_test(const char *snum)
    return rtstepper_test(snum);
 }
 
+DLL_EXPORT enum EMC_RESULT emc_ui_capture_start(void *hd, const char *capture_file)
+{
+   struct emc_session *ps = (struct emc_session *)hd;
+   return rtstepper_capture_open(ps, capture_file);
+}       /* emc_ui_capture_start() */
+
+DLL_EXPORT enum EMC_RESULT emc_ui_capture_stop(void *hd)
+{
+   struct emc_session *ps = (struct emc_session *)hd;
+   return rtstepper_capture_close(ps);
+}       /* emc_ui_capture_stop() */
+
+DLL_EXPORT enum EMC_RESULT emc_ui_replay(void *hd, const char *capture_file, const char *sink)
+{
+   struct emc_session *ps = (struct emc_session *)hd;
+   return rtstepper_replay(ps, capture_file, sink);
+}       /* emc_ui_replay() */
+
+DLL_EXPORT enum EMC_RESULT emc_ui_get_io_stats(void *hd, struct rtstepper_io_stats *stats)
+{
+   struct emc_session *ps = (struct emc_session *)hd;
+   memcpy(stats, &ps->io_stats, sizeof(struct rtstepper_io_stats));
+   return EMC_R_OK;
+}       /* emc_ui_get_io_stats() */
+
+DLL_EXPORT enum EMC_RESULT emc_ui_feed_override(void *hd, double scale)
+{
+   struct emc_session *ps = (struct emc_session *)hd;
+   return dsp_feed_override(ps, scale);
+}       /* emc_ui_feed_override() */
+
+DLL_EXPORT enum EMC_RESULT emc_ui_feed_hold(void *hd)
+{
+   struct emc_session *ps = (struct emc_session *)hd;
+   DBG("emc_ui_feed_hold() called\n");
+   return dsp_feed_hold(ps);
+}       /* emc_ui_feed_hold() */
+
+DLL_EXPORT enum EMC_RESULT emc_ui_feed_resume(void *hd)
+{
+   struct emc_session *ps = (struct emc_session *)hd;
+   DBG("emc_ui_feed_resume() called\n");
+   return dsp_feed_resume(ps);
+}       /* emc_ui_feed_resume() */
+
+/*
+ * Open a new machine session for the specified ini file. Each session has its own interpreter, planner, io queue
+ * and usb event thread, so one process can run several dongles (see SERIAL_NUMBER). Callbacks registered before
+ * emc_ui_open() apply to this session. Returns an opaque handle or NULL on error.
+ */
 DLL_EXPORT void *emc_ui_open(const char *home, const char *ini_file)
 {
-   struct emc_session *ret = NULL, *ps = &session;
+   struct emc_session *ps;
    char inistring[LINELEN];
-   int i;
+   int i, serials;
 
    DBG("[%d] emc_ui_open() ini=%s\n", getpid(), ini_file);
 
-   strncpy(USER_HOME_DIR, home, sizeof(USER_HOME_DIR));
-   USER_HOME_DIR[sizeof(USER_HOME_DIR)-1] = 0;  /* force zero termination */
+   if ((ps = calloc(1, sizeof(struct emc_session))) == NULL)
+   {
+      BUG("unable to malloc emc session\n");
+      return NULL;
+   }
+   current_session = ps;   /* bind session for iniGetKeyValue() */
+
+   pthread_mutex_init(&ps->io_mutex, NULL);
+   pthread_cond_init(&ps->write_done_cond, NULL);
+   pthread_cond_init(&ps->event_done_cond, NULL);
+   pthread_mutex_init(&ps->cap_mutex, NULL);
+
+   ps->post_event_cb = _post_event_cb;
+   ps->post_position_cb = _post_position_cb;
+   ps->plugin_cb = _plugin_cb;
+   ps->post_input_cb = _post_input_cb;
+
+   strncpy(ps->home_dir, home, sizeof(ps->home_dir));
+   ps->home_dir[sizeof(ps->home_dir)-1] = 0;  /* force zero termination */
 
    strncpy(ps->ini_file, ini_file, sizeof(ps->ini_file));
    ps->ini_file[sizeof(ps->ini_file)-1] = 0;  /* force zero termination */
 
-   iniGetKeyValue("TASK", "SERIAL_NUMBER", ps->serial_num, sizeof(ps->serial_num));
+   ps->dongles = 1;
+   if (iniGetKeyValue("TASK", "SERIAL_NUMBER", inistring, sizeof(inistring)) > 0)
+      ps->dongles = _load_serial_num(inistring, ps->serial_num);
+   ps->emulate = RTSTEPPER_EMU_OFF;
+   if (iniGetKeyValue("TASK", "DONGLE_EMULATION", inistring, sizeof(inistring)) > 0)
+      ps->emulate = strtod(inistring, NULL);
+   ps->xfr_depth = RTSTEPPER_XFR_DEPTH_DEFAULT;
+   if (iniGetKeyValue("TASK", "XFR_DEPTH", inistring, sizeof(inistring)) > 0)
+      ps->xfr_depth = strtod(inistring, NULL);
+   if (ps->xfr_depth < 1 || ps->xfr_depth > RTSTEPPER_XFR_DEPTH_MAX)
+   {
+      BUG("Invalid ini file setting: xfr_depth=%d\n", ps->xfr_depth);
+      ps->xfr_depth = RTSTEPPER_XFR_DEPTH_DEFAULT;
+   }
+   ps->pool.buf_size = RTSTEPPER_STEP_BUF_SIZE_DEFAULT;
+   if (iniGetKeyValue("TASK", "STEP_BUF_SIZE", inistring, sizeof(inistring)) > 0)
+      ps->pool.buf_size = strtod(inistring, NULL);
+   if (ps->pool.buf_size < RTSTEPPER_STEP_BUF_SIZE_MIN)
+   {
+      BUG("Invalid ini file setting: step_buf_size=%d\n", ps->pool.buf_size);
+      ps->pool.buf_size = RTSTEPPER_STEP_BUF_SIZE_DEFAULT;
+   }
+   ps->pool.buf_size &= ~1;   /* two bytes per step cycle */
+   ps->step_pulse_width = RTSTEPPER_STEP_PULSE_WIDTH_DEFAULT;
+   if (iniGetKeyValue("TASK", "STEP_PULSE_WIDTH", inistring, sizeof(inistring)) > 0)
+      ps->step_pulse_width = strtod(inistring, NULL);
+   ps->step_pulse_width = (int)round(ps->step_pulse_width * 1000.0 / (RTSTEPPER_PERIOD / 2.0));   /* convert us to step buffer bytes */
+   if (ps->step_pulse_width < 1)
+      ps->step_pulse_width = 1;
+   ps->pool.count = RTSTEPPER_STEP_BUF_COUNT_DEFAULT;
+   if (iniGetKeyValue("TASK", "STEP_BUF_COUNT", inistring, sizeof(inistring)) > 0)
+      ps->pool.count = strtod(inistring, NULL);
+   if (ps->pool.count < RTSTEPPER_STEP_BUF_COUNT_MIN)
+   {
+      BUG("Invalid ini file setting: step_buf_count=%d\n", ps->pool.count);
+      ps->pool.count = RTSTEPPER_STEP_BUF_COUNT_DEFAULT;
+   }
+   ps->queue_high_us = RTSTEPPER_QUEUE_HIGH_WATER_DEFAULT;
+   if (iniGetKeyValue("TASK", "QUEUE_HIGH_WATER", inistring, sizeof(inistring)) > 0)
+      ps->queue_high_us = strtod(inistring, NULL);
+   ps->queue_low_us = RTSTEPPER_QUEUE_LOW_WATER_DEFAULT;
+   if (iniGetKeyValue("TASK", "QUEUE_LOW_WATER", inistring, sizeof(inistring)) > 0)
+      ps->queue_low_us = strtod(inistring, NULL);
+   if (ps->queue_low_us < RTSTEPPER_QUEUE_LOW_WATER_MIN || ps->queue_high_us <= ps->queue_low_us)
+   {
+      BUG("Invalid ini file setting: queue_high_water=%d queue_low_water=%d\n", (int)ps->queue_high_us, (int)ps->queue_low_us);
+      ps->queue_high_us = RTSTEPPER_QUEUE_HIGH_WATER_DEFAULT;
+      ps->queue_low_us = RTSTEPPER_QUEUE_LOW_WATER_DEFAULT;
+   }
+   ps->queue_high_us *= 1000;   /* convert ms to us */
+   ps->queue_low_us *= 1000;
+   ps->override_latency_us = RTSTEPPER_OVERRIDE_LATENCY_DEFAULT;
+   if (iniGetKeyValue("TASK", "OVERRIDE_LATENCY", inistring, sizeof(inistring)) > 0)
+      ps->override_latency_us = strtod(inistring, NULL);
+   if (ps->override_latency_us != 0 && ps->override_latency_us < RTSTEPPER_OVERRIDE_LATENCY_MIN)
+   {
+      BUG("Invalid ini file setting: override_latency=%d\n", (int)ps->override_latency_us);
+      ps->override_latency_us = RTSTEPPER_OVERRIDE_LATENCY_MIN;
+   }
+   ps->override_latency_us *= 1000;   /* convert ms to us */
    ps->input0_abort_enabled = 0;
    if (iniGetKeyValue("TASK", "INPUT0_ABORT", inistring, sizeof(inistring)) > 0)
       ps->input0_abort_enabled = strtod(inistring, NULL);
@@ -567,6 +752,15 @@ DLL_EXPORT void *emc_ui_open(const char *home, const char *ini_file)
    if (iniGetKeyValue("TASK", "INPUT2_ABORT", inistring, sizeof(inistring)) > 0)
       ps->input2_abort_enabled = strtod(inistring, NULL);
 
+   ps->status_interval = RTSTEPPER_STATUS_INTERVAL_DEFAULT;
+   if (iniGetKeyValue("TASK", "STATUS_INTERVAL", inistring, sizeof(inistring)) > 0)
+      ps->status_interval = strtod(inistring, NULL);
+   if (ps->status_interval < 1)
+   {
+      BUG("Invalid ini file setting: status_interval=%d\n", ps->status_interval);
+      ps->status_interval = RTSTEPPER_STATUS_INTERVAL_DEFAULT;
+   }
+
    ps->axes = 4;        /* default to XYZA */
    if (iniGetKeyValue("TRAJ", "AXES", inistring, sizeof(inistring)) > 0)
    {
@@ -593,25 +787,73 @@ DLL_EXPORT void *emc_ui_open(const char *home, const char *ini_file)
    if (iniGetKeyValue("TRAJ", "MAX_ACCELERATION", inistring, sizeof(inistring)) > 0)
       ps->maxAcceleration = strtod(inistring, NULL);
 
+   ps->junctionDeviation = 0.0;
+   if (iniGetKeyValue("TRAJ", "JUNCTION_DEVIATION", inistring, sizeof(inistring)) > 0)
+      ps->junctionDeviation = strtod(inistring, NULL);
+   if (ps->junctionDeviation < 0.0)
+   {
+      BUG("Invalid ini file setting: junction_deviation=%f\n", ps->junctionDeviation);
+      ps->junctionDeviation = 0.0;
+   }
+
+   ps->servo_steps = 1;
+   if (iniGetKeyValue("TRAJ", "SERVO_PERIOD", inistring, sizeof(inistring)) > 0)
+   {
+      double us = strtod(inistring, NULL);
+      if (us < 0.0 || us > MAX_SERVO_PERIOD)
+         BUG("Invalid ini file setting: servo_period=%f\n", us);
+      else
+         ps->servo_steps = (int)round(us * 1000.0 / RTSTEPPER_PERIOD);   /* convert us to step cycles */
+      if (ps->servo_steps < 1)
+         ps->servo_steps = 1;
+   }
+
+   ps->tc_queue_size = DEFAULT_TC_QUEUE_SIZE;
+   if (iniGetKeyValue("TRAJ", "TC_QUEUE_SIZE", inistring, sizeof(inistring)) > 0)
+      ps->tc_queue_size = strtod(inistring, NULL);
+   if (ps->tc_queue_size <= DEFAULT_TP_LOOKAHEAD + 2)
+   {
+      BUG("Invalid ini file setting: tc_queue_size=%d\n", ps->tc_queue_size);
+      ps->tc_queue_size = DEFAULT_TC_QUEUE_SIZE;
+   }
+
    if (iniGetKeyValue("EMC", "TOOL_TABLE", inistring, sizeof(inistring)) > 0)
-      _load_tool_table(inistring, ps->toolTable);
+      _load_tool_table(ps->home_dir, inistring, ps->toolTable);
 
+   if (ps->dongles < 1)
+      ps->dongles = 1;
+   serials = ps->dongles;   /* a single dongle needs no serial number */
    for (i=0; i < ps->axes; i++)
+   {
       _load_axis(ps, i);
+      if (ps->axis[i].dongle < serials)
+         continue;
+      if (ps->emulate == RTSTEPPER_EMU_OFF)
+      {
+         /* Usb dongles are told apart by serial number only, "first dongle found" would open dongle 0 twice. */
+         BUG("Invalid ini file setting: axis=%d dongle=%d has no SERIAL_NUMBER, axis disabled\n", i, ps->axis[i].dongle);
+         continue;
+      }
+      if (ps->axis[i].dongle >= ps->dongles)
+         ps->dongles = ps->axis[i].dongle + 1;  /* emulated dongles need no serial number */
+   }
 
-   ps->cycle_time = RTSTEPPER_PERIOD * 1e-9;  /* convert ns to sec */
+   ps->cycle_time = ps->servo_steps * RTSTEPPER_PERIOD * 1e-9;  /* convert ns to sec */
    ps->cycle_freq = 1 / ps->cycle_time;
 
    INIT_LIST_HEAD(&ps->head.list);
 
-   emc_post_position_cb(0, ps->position);
+   emc_post_position_cb(ps, 0, ps->position);
 
-   if (dsp_open(ps) != EMC_R_OK || rtstepper_open(ps) != EMC_R_OK)
+   if (dsp_open(ps) != EMC_R_OK || rtstepper_pool_open(ps) != EMC_R_OK || rtstepper_open(ps) != EMC_R_OK)
       emc_post_estop_cb(ps);
 
-   ret = ps;
+   if (iniGetKeyValue("TASK", "STEP_CAPTURE", inistring, sizeof(inistring)) > 0 && inistring[0])
+      rtstepper_capture_open(ps, inistring);
+
+   iniGetKeyValue("TASK", "STEP_CACHE", ps->step_cache, sizeof(ps->step_cache));
 
-   return ret;  /* return an opaque handle */
+   return ps;  /* return an opaque handle */
 }       /* emc_ui_open() */
 
 DLL_EXPORT enum EMC_RESULT emc_ui_close(void *hd)
@@ -619,7 +861,16 @@ DLL_EXPORT enum EMC_RESULT emc_ui_close(void *hd)
    struct emc_session *ps = (struct emc_session *)hd;
    DBG("[%d] emc_ui_close()\n", getpid());
    dsp_close(ps);
+   rtstepper_capture_close(ps);
    rtstepper_close(ps);
+   rtstepper_pool_close(ps);
+   pthread_mutex_destroy(&ps->cap_mutex);
+   pthread_cond_destroy(&ps->event_done_cond);
+   pthread_cond_destroy(&ps->write_done_cond);
+   pthread_mutex_destroy(&ps->io_mutex);
+   if (current_session == ps)
+      current_session = NULL;
+   free(ps);
    return EMC_R_OK;
 }       /* emc_ui_close() */
 
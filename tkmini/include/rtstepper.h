@@ -65,6 +65,17 @@ enum RTSTEPPER_GPO_BIT
 
 typedef int (*rtstepper_io_error_cb)(int result);
 
+#define RTSTEPPER_XFR_QUEUE_MAX 2       /* step buffers queued or on the wire, one written while the next is encoded */
+
+/* Step buffer queued for bulk_write_thread(). */
+struct rtstepper_xfr
+{
+   struct list_head list;
+   unsigned char *buf;          /* step/direction buffer */
+   int total;                   /* buffer count */
+   int id;                      /* gcode line number */
+};
+
 struct rtstepper_app_session
 {
    uint16_t state_bits;         /* dongle state bits */
@@ -87,14 +98,17 @@ struct rtstepper_app_session
    unsigned char *buf;          /* staging step/direction buffer */
    int buf_size;                /* staging buffer size */
    int total;                   /* staging current buffer count */
-   unsigned char *xfr_buf;     /* step/direction buffer */
-   int xfr_total;           /* buffer count */
-   int xfr_active;              /* 0=no, 1=yes */
+   struct rtstepper_xfr xfr_head;       /* step buffers waiting for bulk_write_thread */
+   int xfr_active;              /* step buffers queued or on the wire, 0 = all writes done */
+   int xfr_thread;              /* 0=no, 1=bulk_write_thread running */
+   int xfr_exit;                /* 1 = bulk_write_thread exit request */
+   int xfr_closed;              /* 1 = aborted, rtstepper_start_xfr() drops step buffers until rtstepper_clear_abort() */
    struct usb_device *libusb_device;    /* selected usb device */
    int usbfd;                   /* usb file descriptor */
    pthread_t bulk_write_tid;    /* thread handle */
    pthread_mutex_t mutex;
    pthread_cond_t write_done_cond;
+   pthread_cond_t write_cond;   /* wakes bulk_write_thread, new step buffer or exit */
    rtstepper_io_error_cb error_function;   /* client callback function */
 };
 
@@ -497,13 +497,7 @@ static void _run_control_cycle(struct emc_session *ps)
    }
    while (!(emcmotStatus.motionFlag & EMCMOT_MOTION_INPOS_BIT && emcmotStatus.depth == 0 && emcmotStatus.homing_active == 0));
 
-   /* Wait for any previous write to finish. */
-   pthread_mutex_lock(&ps->dongle.mutex);
-   while (ps->dongle.xfr_active)
-      pthread_cond_wait(&ps->dongle.write_done_cond, &ps->dongle.mutex);
-   pthread_mutex_unlock(&ps->dongle.mutex);
-
-   /* Start a new write. */
+   /* Queue the write, bulk_write_thread() sends it while the next move is encoded. */
    rtstepper_start_xfr(&ps->dongle, tpGetExecId(&emcmotDebug.queue), emcmotStatus.traj.axes);
 } /* _run_control_cycle() */
 
@@ -34,7 +34,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <math.h>
-#include "rtstepper.h"
+#include "emc.h"
 #include "bug.h"
 
 #define LIBUSB_TIMEOUT 30000    /* milliseconds */
@@ -317,70 +317,107 @@ static int raw_write(struct rtstepper_app_session *ps, const void *buf, int size
    return len;
 }       /* raw_write() */
 
-void bulk_write_thread(struct rtstepper_app_session *ps)
+/* Free step buffers waiting in the queue, the buffer on the wire is left to bulk_write_thread(). Caller must hold ps->mutex. */
+static void flush_xfr(struct rtstepper_app_session *ps)
 {
+   struct rtstepper_xfr *x;
+   struct list_head *p, *tmp;
+
+   list_for_each_safe(p, tmp, &ps->xfr_head.list)
+   {
+      x = list_entry(p, struct rtstepper_xfr, list);
+      list_del(&x->list);
+      free(x->buf);
+      free(x);
+      ps->xfr_active--;
+   }
+   pthread_cond_broadcast(&ps->write_done_cond);
+}       /* flush_xfr() */
+
+/* 
+ * Long lived usb writer, started by rtstepper_init(). Writes queued step buffers in order so the control cycle can
+ * encode the next move while this one is on the wire.
+ */
+static void bulk_write_thread(struct rtstepper_app_session *ps)
+{
+   struct rtstepper_xfr *x;
    int i, result, cnt = 0;
    char s[64];
    static int derr = 0;
 
-   pthread_detach(pthread_self());
-
-   if (verbose)
+   pthread_mutex_lock(&ps->mutex);
+   while (1)
    {
-      if (!derr && dump == NULL)
+      while (list_empty(&ps->xfr_head.list) && !ps->xfr_exit)
+         pthread_cond_wait(&ps->write_cond, &ps->mutex);
+      if (ps->xfr_exit)
+         break;
+
+      x = list_entry(ps->xfr_head.list.next, struct rtstepper_xfr, list);
+      list_del(&x->list);
+      pthread_mutex_unlock(&ps->mutex);
+
+      if (verbose)
       {
-         sprintf(s, "%s/.%s/raw.dat", USER_HOME_DIR, PACKAGE_NAME);
-         if ((dump = fopen(s, "w+")) == NULL)   /* truncate any old file */
+         if (!derr && dump == NULL)
          {
-            BUG("unable to create %s\n", s);
-            derr = 1;
+            sprintf(s, "%s/.%s/raw.dat", USER_HOME_DIR, PACKAGE_NAME);
+            if ((dump = fopen(s, "w+")) == NULL)   /* truncate any old file */
+            {
+               BUG("unable to create %s\n", s);
+               derr = 1;
+            }
+            fprintf(dump, "byte: gcode_line_num: cnt:\n");
+         }
+         if (!derr)
+         {
+            /* Dump byte_value, ring buffer index, gcode line number. */
+            for (i = 0; i < x->total; i++)
+               fprintf(dump, "%x %d %d\n", x->buf[i], x->id, ++cnt);
          }
-         fprintf(dump, "byte: gcode_line_num: cnt:\n");
-      }
-      if (!derr)
-      {
-         /* Dump byte_value, ring buffer index, gcode line number. */
-         for (i = 0; i < ps->xfr_total; i++)
-            fprintf(dump, "%x %d %d\n", ps->xfr_buf[i], ps->id, ++cnt);
       }
-   }
 
-   result = raw_write(ps, ps->xfr_buf, ps->xfr_total);
-   
-   DBG("bulk_write_thread() done ret=%d\n", result);
+      result = raw_write(ps, x->buf, x->total);
 
-   if (verbose && dump)
-      fflush(dump);
+      DBG("bulk_write_thread() done ret=%d\n", result);
 
-   free(ps->xfr_buf);
-   ps->xfr_buf = NULL;
-   ps->xfr_total = 0;
+      if (verbose && dump)
+         fflush(dump);
 
-   pthread_mutex_lock(&ps->mutex);
-   ps->xfr_active = 0;
-   pthread_cond_broadcast(&ps->write_done_cond);
-   pthread_mutex_unlock(&ps->mutex);
+      free(x->buf);
+      free(x);
 
-   if (result < 0 && ps->error_function != NULL)
-      ps->error_function(result);  /* call client error handler */
+      pthread_mutex_lock(&ps->mutex);
+      ps->xfr_active--;
+      if (result < 0)
+         flush_xfr(ps);   /* rest of the move is invalid */
+      pthread_cond_broadcast(&ps->write_done_cond);
+
+      if (result < 0 && ps->error_function != NULL)
+      {
+         pthread_mutex_unlock(&ps->mutex);
+         ps->error_function(result);  /* call client error handler */
+         pthread_mutex_lock(&ps->mutex);
+      }
+   }
+   pthread_mutex_unlock(&ps->mutex);
 
    return;
 }       /* bulk_write_thread() */
 
+/* 
+ * Queue the staging step buffer for bulk_write_thread(). Blocks only while RTSTEPPER_XFR_QUEUE_MAX buffers are already
+ * queued or on the wire.
+ */
 enum RTSTEPPER_RESULT rtstepper_start_xfr(struct rtstepper_app_session *ps, int id, int num_axis)
 {
    enum RTSTEPPER_RESULT stat = RTSTEPPER_R_IO_ERROR;
+   struct rtstepper_xfr *x;
    int i, axis, mid;
 
    if (ps->total == 0)
       return RTSTEPPER_R_OK;
 
-   if (ps->xfr_active)
-   {
-      BUG("unable start bulk_write_thread, already active\n");
-      goto bugout;      /* bail */
-   }
-
    DBG("start_xfr: x_index=%d y_index=%d z_index=%d a_index=%d c_index=%d buf=%p cnt=%d\n", ps->master_index[0],
        ps->master_index[1], ps->master_index[2], ps->master_index[3], ps->master_index[5], ps->buf, ps->total);
 
@@ -404,9 +441,20 @@ enum RTSTEPPER_RESULT rtstepper_start_xfr(struct rtstepper_app_session *ps, int
       }
    }
 
+   /* Hand the staging buffer to bulk_write_thread, a new one is started by the next step. */
+   if ((x = (struct rtstepper_xfr *) malloc(sizeof(struct rtstepper_xfr))) == NULL)
+   {
+      BUG("unable to malloc step buffer xfr\n");
+      free(ps->buf);
+   }
+   else
+   {
+      x->id = id;
+      x->buf = ps->buf;
+      x->total = ps->total;
+   }
+
    ps->id = id;
-   ps->xfr_buf = ps->buf;
-   ps->xfr_total = ps->total;
    ps->buf = NULL;
    ps->buf_size = 0;
    ps->total = 0;
@@ -416,12 +464,36 @@ enum RTSTEPPER_RESULT rtstepper_start_xfr(struct rtstepper_app_session *ps, int
       ps->direction[i] = 0;
    }
 
-   ps->xfr_active = 1;
-   if (pthread_create(&ps->bulk_write_tid, NULL, (void *(*)(void *)) bulk_write_thread, (void *) ps) != 0)
+   if (x == NULL)
+      goto bugout;      /* bail */
+
+   pthread_mutex_lock(&ps->mutex);
+   if (!ps->xfr_thread)
    {
-      BUG("unable to creat bulk_write_thread\n");
+      pthread_mutex_unlock(&ps->mutex);
+      BUG("unable to start xfr, no bulk_write_thread\n");
+      free(x->buf);
+      free(x);
+      if (ps->error_function != NULL)
+         ps->error_function(-EIO);  /* call client error handler */
+      goto bugout;      /* bail */
+   }
+   if (ps->xfr_closed)
+   {
+      /* Dongle is aborted, drop the move until rtstepper_clear_abort(). */
+      pthread_mutex_unlock(&ps->mutex);
+      DBG("start_xfr dropped, abort is set id=%d\n", id);
+      free(x->buf);
+      free(x);
+      stat = RTSTEPPER_R_REQ_ERROR;
       goto bugout;      /* bail */
    }
+   while (ps->xfr_active >= RTSTEPPER_XFR_QUEUE_MAX)
+      pthread_cond_wait(&ps->write_done_cond, &ps->mutex);
+   list_add_tail(&x->list, &ps->xfr_head.list);
+   ps->xfr_active++;
+   pthread_cond_signal(&ps->write_cond);
+   pthread_mutex_unlock(&ps->mutex);
 
    stat = RTSTEPPER_R_OK;
 
@@ -596,6 +668,16 @@ enum RTSTEPPER_RESULT rtstepper_set_abort(struct rtstepper_app_session *ps)
       goto bugout;
    }
 
+   /* 
+    * Drop step buffers still waiting for bulk_write_thread and close the queue before the dongle aborts, so no queued
+    * buffer is written after STEP_ABORT_SET and the control cycle can not queue new ones. Only the buffer already on
+    * the wire is left to finish.
+    */
+   pthread_mutex_lock(&ps->mutex);
+   flush_xfr(ps);
+   ps->xfr_closed = 1;
+   pthread_mutex_unlock(&ps->mutex);
+
    len = usb_control_msg(fd_table[ps->usbfd].hd, USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,      /* bmRequestType */
                          STEP_ABORT_SET,        /* bRequest */
                          0x0,   /* wValue */
@@ -607,6 +689,7 @@ enum RTSTEPPER_RESULT rtstepper_set_abort(struct rtstepper_app_session *ps)
       stat = RTSTEPPER_R_IO_ERROR;
       goto bugout;
    }
+
    stat = RTSTEPPER_R_OK;
 
  bugout:
@@ -640,6 +723,11 @@ enum RTSTEPPER_RESULT rtstepper_clear_abort(struct rtstepper_app_session *ps)
    /* Reset step_state_inputx_bit for rtstepper_is_inputx_triggered(). */
    ps->old_state_bits &= ~(RTSTEPPER_STEP_STATE_INPUT0_BIT | RTSTEPPER_STEP_STATE_INPUT1_BIT | RTSTEPPER_STEP_STATE_INPUT2_BIT);
 
+   /* Accept step buffers again. */
+   pthread_mutex_lock(&ps->mutex);
+   ps->xfr_closed = 0;
+   pthread_mutex_unlock(&ps->mutex);
+
    stat = RTSTEPPER_R_OK;
 
  bugout:
@@ -896,12 +984,15 @@ enum RTSTEPPER_RESULT rtstepper_init(struct rtstepper_app_session *ps, rtstepper
       ps->direction[i] = 0;
    }
    ps->total = 0;
-   ps->xfr_total = 0;
    ps->xfr_active = 0;
+   ps->xfr_thread = 0;
+   ps->xfr_exit = 0;
+   INIT_LIST_HEAD(&ps->xfr_head.list);
    ps->error_function = error_function;
 
 //   pthread_mutex_init(&ps->mutex, NULL);
 //   pthread_cond_init(&ps->write_done_cond, NULL);
+//   pthread_cond_init(&ps->write_cond, NULL);
 
    usb_init();
    usb_find_busses();
@@ -942,6 +1033,13 @@ enum RTSTEPPER_RESULT rtstepper_init(struct rtstepper_app_session *ps, rtstepper
       goto bugout;
    }
 
+   if (pthread_create(&ps->bulk_write_tid, NULL, (void *(*)(void *)) bulk_write_thread, (void *) ps) != 0)
+   {
+      BUG("unable to creat bulk_write_thread\n");
+      goto bugout;
+   }
+   ps->xfr_thread = 1;
+
    stat = RTSTEPPER_R_OK;
 
  bugout:
@@ -961,10 +1059,17 @@ enum RTSTEPPER_RESULT rtstepper_exit(struct rtstepper_app_session *ps)
       ps->buf = NULL;
    }
 
-   if (ps->xfr_buf)
+   if (ps->xfr_thread)
    {
-      free(ps->xfr_buf);
-      ps->xfr_buf = NULL;
+      /* Let the buffer on the wire finish, then stop the writer. */
+      pthread_mutex_lock(&ps->mutex);
+      flush_xfr(ps);
+      ps->xfr_exit = 1;
+      pthread_cond_signal(&ps->write_cond);
+      pthread_mutex_unlock(&ps->mutex);
+      pthread_join(ps->bulk_write_tid, NULL);
+      ps->xfr_thread = 0;
+      ps->xfr_exit = 0;
    }
 
    if (ps->usbfd)
@@ -975,6 +1080,7 @@ enum RTSTEPPER_RESULT rtstepper_exit(struct rtstepper_app_session *ps)
 
 //   pthread_mutex_destroy(&ps->mutex);
 //   pthread_cond_destroy(&ps->write_done_cond);
+//   pthread_cond_destroy(&ps->write_cond);
 
    return RTSTEPPER_R_OK;
 }       /* rtstepper_exit() */
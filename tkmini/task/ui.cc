@@ -1032,6 +1032,7 @@ DLL_EXPORT void *emc_ui_open(const char *ini_file)
    pthread_cond_init(&ps->mcode_thread_done_cond, NULL);
    pthread_cond_init(&ps->event_cond, NULL);
    pthread_cond_init(&ps->dongle.write_done_cond, NULL);
+   pthread_cond_init(&ps->dongle.write_cond, NULL);
    INIT_LIST_HEAD(&ps->head.list);
 
    iniGetKeyValue("TASK", "SERIAL_NUMBER", serial_num, sizeof(serial_num));
@@ -1137,6 +1138,7 @@ DLL_EXPORT enum EMC_RESULT emc_ui_close(void *hd)
    pthread_cond_destroy(&ps->mcode_thread_done_cond);
    pthread_cond_destroy(&ps->event_cond);
    pthread_cond_destroy(&ps->dongle.write_done_cond);
+   pthread_cond_destroy(&ps->dongle.write_cond);
 
    return EMC_R_OK;
 }       /* emc_ui_close() */